@@ -0,0 +1,340 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2011 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Decoding of base64 data, as found in encrypted AMZ files.  Runs of
+   plain base64 characters are decoded with SSSE3 or AVX2 instructions
+   where the CPU has them; anything else (line breaks, padding, and
+   invalid characters) goes through a lookup table. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) \
+  && (defined(__x86_64__) || defined(__i386__))
+# define USE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+#include "clamz.h"
+
+/* Special values in the decoding table */
+#define B64_SKIP    0x40	/* whitespace, '=' and 8-bit characters */
+#define B64_INVALID 0x80
+
+static unsigned char decode_table[256];
+
+/* Decoder for runs of valid characters.  It decodes as many complete
+   groups of characters as it can from IN, stopping before any group
+   that contains something else; sets *USED to the number of
+   characters used, and returns the number of bytes written. */
+typedef size_t (*block_decoder)(unsigned char *out, const unsigned char *in,
+				size_t len, size_t *used);
+
+static block_decoder decode_blocks;
+static int selected;
+
+/* Fill in the decoding table.  Control characters, spaces, and (as
+   they are signed chars on most systems) bytes above 127 are
+   skipped, like '='; anything else outside the alphabet is an
+   error. */
+static void init_table(void)
+{
+  static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    if (i <= ' ' || i >= 128 || i == '=')
+      decode_table[i] = B64_SKIP;
+    else
+      decode_table[i] = B64_INVALID;
+  }
+
+  for (i = 0; i < 64; i++)
+    decode_table[(unsigned char) alphabet[i]] = i;
+}
+
+#ifdef USE_X86_SIMD
+
+/* The vector decoders translate 16 characters at a time, using the
+   high and low nibbles of each character to look up whether it is
+   valid, and what to add to it to get its value.  (See Wojciech Muła,
+   "Base64 decoding with SIMD instructions".)  Each group of four
+   6-bit values is then packed into three bytes. */
+
+/* Decode 16 characters to 12 bytes, if they are all valid.  This is
+   inlined into the AVX2 decoder as well, so that it is compiled with
+   the same instruction encoding; mixing the two is slow. */
+__attribute__((target("ssse3"), always_inline))
+static inline int decode_16(unsigned char *out, const unsigned char *in)
+{
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+				       0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+				       0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+				       0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+				       0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+				     14, 13, 12, -1, -1, -1, -1);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i v, hi_nibbles, lo_nibbles, hi, lo, roll;
+
+  v = _mm_loadu_si128((const __m128i *) in);
+  hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+  lo_nibbles = _mm_and_si128(v, mask_2f);
+  hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+  lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+				       _mm_setzero_si128())) != 0xffff)
+    return 0;
+
+  roll = _mm_shuffle_epi8(lut_roll,
+			  _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f),
+				       hi_nibbles));
+  v = _mm_add_epi8(v, roll);
+
+  v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+  v = _mm_shuffle_epi8(v, pack);
+
+  /* 16 bytes are stored, of which 12 are used */
+  _mm_storeu_si128((__m128i *) out, v);
+  return 1;
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(unsigned char *out, const unsigned char *in,
+			   size_t len, size_t *used)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i + 16 <= len && decode_16(out + n, in + i); i += 16)
+    n += 12;
+
+  *used = i;
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(unsigned char *out, const unsigned char *in,
+			  size_t len, size_t *used)
+{
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+					  0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+					  0x1B, 0x1B, 0x1B, 0x1A,
+					  0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+					  0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+					  0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+					  0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+					  0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					    0, 0, 0, 0, 0, 0, 0, 0,
+					    0, 16, 19, 4, -65, -65, -71, -71,
+					    0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					14, 13, 12, -1, -1, -1, -1,
+					2, 1, 0, 6, 5, 4, 10, 9, 8,
+					14, 13, 12, -1, -1, -1, -1);
+  const __m256i merge = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  __m256i v, hi_nibbles, lo_nibbles, hi, lo, roll;
+  size_t i, n = 0;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *) (in + i));
+    hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+    lo_nibbles = _mm256_and_si256(v, mask_2f);
+    hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      break;
+
+    roll = _mm256_shuffle_epi8(lut_roll,
+			       _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask_2f),
+					       hi_nibbles));
+    v = _mm256_add_epi8(v, roll);
+
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, pack);
+    v = _mm256_permutevar8x32_epi32(v, merge);
+
+    /* 32 bytes are stored, of which 24 are used */
+    _mm256_storeu_si256((__m256i *) (out + n), v);
+    n += 24;
+  }
+
+  /* finish off with the 16-byte version */
+  for (; i + 16 <= len && decode_16(out + n, in + i); i += 16)
+    n += 12;
+
+  *used = i;
+  return n;
+}
+
+#endif /* USE_X86_SIMD */
+
+/* Choose a decoder: "scalar", "ssse3" or "avx2", or NULL for the
+   fastest that this CPU supports.  Return 0 if successful, or 1 if
+   the decoder is not available. */
+int base64_use(const char *name)
+{
+  init_table();
+
+  if (!name || !strcmp(name, "avx2")) {
+#ifdef USE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      decode_blocks = &decode_avx2;
+      selected = 1;
+      return 0;
+    }
+#endif
+    if (name)
+      return 1;
+  }
+
+  if (!name || !strcmp(name, "ssse3")) {
+#ifdef USE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+      decode_blocks = &decode_ssse3;
+      selected = 1;
+      return 0;
+    }
+#endif
+    if (name)
+      return 1;
+  }
+
+  if (name && strcmp(name, "scalar"))
+    return 1;
+
+  decode_blocks = NULL;
+  selected = 1;
+  return 0;
+}
+
+/* Begin decoding a new stream of base64 data */
+void base64_start(clamz_base64 *b64)
+{
+  b64->bits = 0;
+  b64->nch = 0;
+}
+
+/* Decode a piece of base64 data, continuing from where the last
+   piece left off.  OUT must have room for BASE64_DECODED_SIZE(LEN)
+   bytes.  Return the number of bytes written, or -1 if the data
+   contains an invalid character. */
+long base64_decode(clamz_base64 *b64, unsigned char *out, const char *in,
+		   size_t len)
+{
+  const unsigned char *p = (const unsigned char *) in;
+  const unsigned char *end = p + len;
+  unsigned long bits = b64->bits;
+  unsigned char c, c1, c2, c3;
+  int nch = b64->nch, special;
+  size_t n = 0, used;
+
+  if (!selected)
+    base64_use(NULL);
+
+  while (p < end) {
+    /* vector decoding needs to start at a group boundary; it is tried
+       again after whatever stopped it */
+    if (decode_blocks && nch == 0) {
+      n += (*decode_blocks)(out + n, p, end - p, &used);
+      p += used;
+    }
+
+    special = 0;
+    for (; p < end; p++) {
+      /* a complete group of four valid characters */
+      if (nch == 0 && end - p >= 4) {
+	c = decode_table[p[0]];
+	c1 = decode_table[p[1]];
+	c2 = decode_table[p[2]];
+	c3 = decode_table[p[3]];
+	if (!((c | c1 | c2 | c3) & (B64_SKIP | B64_INVALID))) {
+	  bits = ((unsigned long) c << 18) | (c1 << 12) | (c2 << 6) | c3;
+	  out[n++] = (bits >> 16) & 0xff;
+	  out[n++] = (bits >> 8) & 0xff;
+	  out[n++] = bits & 0xff;
+	  bits = 0;
+	  p += 3;
+	  if (decode_blocks && special) {
+	    p++;
+	    goto next;
+	  }
+	  continue;
+	}
+      }
+
+      c = decode_table[*p];
+      if (c & B64_SKIP) {
+	special = 1;
+	if (decode_blocks && nch == 0) {
+	  p++;
+	  goto next;
+	}
+	continue;
+      }
+      else if (c & B64_INVALID) {
+	b64->bits = bits;
+	b64->nch = nch;
+	return -1;
+      }
+
+      bits = (bits << 6) | c;
+      switch (++nch) {
+      case 2:
+	out[n++] = (bits >> 4) & 0xff;
+	break;
+
+      case 3:
+	out[n++] = (bits >> 2) & 0xff;
+	break;
+
+      case 4:
+	out[n++] = bits & 0xff;
+	nch = 0;
+	bits = 0;
+	if (decode_blocks && special) {
+	  p++;
+	  goto next;
+	}
+	break;
+      }
+    }
+  next:;
+  }
+
+  b64->bits = bits;
+  b64->nch = nch;
+  return n;
+}
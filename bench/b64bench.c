@@ -0,0 +1,226 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measure the speed of each of clamz's base64 decoders, on data laid
+   out like an encrypted AMZ file, and check that they all agree with
+   the scalar decoder. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../clamz.h"
+
+/* Size of each piece passed to the decoder, as when clamz reads an
+   AMZ file */
+#define PIECE_SIZE 65536
+
+static const char *const decoders[] = { "scalar", "ssse3", "avx2" };
+
+/* Encode data in base64, with a line break after every LINE
+   characters (if LINE is not zero) */
+static char *encode(const unsigned char *data, size_t n, int line,
+		    size_t *len)
+{
+  static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char *out, *p;
+  unsigned long v;
+  size_t i, col = 0;
+
+  out = malloc((n + 2) / 3 * 4 + (line ? n / line * 2 : 0) + 2);
+  if (!out)
+    return NULL;
+
+  p = out;
+  for (i = 0; i < n; i += 3) {
+    v = (unsigned long) data[i] << 16;
+    if (i + 1 < n)
+      v |= data[i + 1] << 8;
+    if (i + 2 < n)
+      v |= data[i + 2];
+
+    *p++ = b64chars[(v >> 18) & 0x3f];
+    *p++ = b64chars[(v >> 12) & 0x3f];
+    *p++ = (i + 1 < n ? b64chars[(v >> 6) & 0x3f] : '=');
+    *p++ = (i + 2 < n ? b64chars[v & 0x3f] : '=');
+
+    col += 4;
+    if (line && col >= (size_t) line) {
+      *p++ = '\n';
+      col = 0;
+    }
+  }
+  *p++ = '\n';
+
+  *len = p - out;
+  return out;
+}
+
+/* Decode a whole buffer, a piece at a time */
+static long decode_all(unsigned char *out, const char *in, size_t len)
+{
+  clamz_base64 b64;
+  size_t i, n;
+  long k, total = 0;
+
+  base64_start(&b64);
+  for (i = 0; i < len; i += n) {
+    n = (len - i < PIECE_SIZE ? len - i : PIECE_SIZE);
+    k = base64_decode(&b64, out + total, in + i, n);
+    if (k < 0)
+      return -1;
+    total += k;
+  }
+  return total;
+}
+
+/* Check that the current decoder treats every possible byte the same
+   way as the scalar decoder, at every position in a run of valid
+   characters */
+static int check_bytes(const char *name)
+{
+  unsigned char expect[128], got[128];
+  char in[80];
+  clamz_base64 b64;
+  long n1, n2;
+  int c, pos;
+
+  for (c = 0; c < 256; c++) {
+    for (pos = 0; pos < 64; pos++) {
+      memset(in, 'Q', sizeof(in));
+      in[pos] = (char) c;
+
+      base64_use("scalar");
+      base64_start(&b64);
+      n1 = base64_decode(&b64, expect, in, sizeof(in));
+
+      base64_use(name);
+      base64_start(&b64);
+      n2 = base64_decode(&b64, got, in, sizeof(in));
+
+      if (n1 != n2 || (n1 > 0 && memcmp(expect, got, n1))) {
+	fprintf(stderr, "b64bench: %s decoder differs for byte 0x%02x"
+		" at position %d\n", name, c, pos);
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void print_usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options]\n"
+	  " -s SIZE:    size of the decoded data (default 64M)\n"
+	  " -l N:       characters per line (default 72; 0 for none)\n"
+	  " -t SECS:    time to spend on each decoder (default 1)\n",
+	  progname);
+}
+
+int main(int argc, char **argv)
+{
+  long long size = 64 * 1024 * 1024;
+  unsigned char *data, *out;
+  char *text;
+  size_t len;
+  double secs = 1.0, t0, t;
+  int line = 72, opt, i, runs, failed = 0;
+  long n;
+
+  while ((opt = getopt(argc, argv, "s:l:t:")) != -1) {
+    switch (opt) {
+    case 's':
+      if (parse_bench_size(optarg, &size) || size < 1) {
+	print_usage(argv[0]);
+	return 2;
+      }
+      break;
+
+    case 'l':
+      line = atoi(optarg);
+      if (line < 0 || line % 4) {
+	fprintf(stderr, "%s: line length must be a multiple of 4\n",
+		argv[0]);
+	return 2;
+      }
+      break;
+
+    case 't':
+      secs = atof(optarg);
+      break;
+
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+
+  data = malloc(size);
+  if (!data) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  fill_pattern(data, 1, 0, size);
+  text = encode(data, size, line, &len);
+  out = (text ? malloc(BASE64_DECODED_SIZE(len)) : NULL);
+  if (!out) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  printf("input:       %.1f MB of base64, %d characters per line\n",
+	 len / 1e6, line);
+
+  for (i = 0; i < (int) (sizeof(decoders) / sizeof(decoders[0])); i++) {
+    if (base64_use(decoders[i])) {
+      printf("%-12s not supported by this CPU\n", decoders[i]);
+      continue;
+    }
+
+    memset(out, 0, size);
+    runs = 0;
+    t0 = get_time();
+    do {
+      n = decode_all(out, text, len);
+      runs++;
+      t = get_time() - t0;
+    } while (t < secs);
+
+    if (n != size || memcmp(out, data, size) || check_bytes(decoders[i])) {
+      printf("%-12s FAILED\n", decoders[i]);
+      failed = 1;
+      continue;
+    }
+
+    printf("%-12s %8.2f GB/s  (%d runs)\n", decoders[i],
+	   (double) len * runs / t / 1e9, runs);
+  }
+
+  free(text);
+  free(data);
+  free(out);
+  return failed;
+}
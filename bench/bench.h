@@ -0,0 +1,39 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Definitions shared by the benchmark programs (mkamz, fakestore and
+   runbench.) */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Format of the ASIN given to each synthetic track; the benchmark
+   runner names output files after it */
+#define BENCH_ASIN "B0%08d"
+
+/* Size of the cover image served by fakestore */
+#define BENCH_IMAGE_SIZE 65536
+
+/* common.c */
+void fill_pattern(unsigned char *buf, long track, long long pos,
+		  long len);
+int parse_bench_size(const char *s, long long *value);
+double get_time(void);
+void sleep_for(double t);
+
+#endif
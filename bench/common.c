@@ -0,0 +1,104 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bench.h"
+
+/* Contents of a given 8-byte word of a synthetic track */
+static unsigned long long pattern_word(long track, long long w)
+{
+  unsigned long long x = ((unsigned long long) w
+			  ^ ((unsigned long long) track << 40));
+
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* Fill a buffer with part of the contents of a synthetic track.  The
+   contents depend only on the track number and position, so that the
+   server can send any range, and the runner can check the files
+   which were downloaded. */
+void fill_pattern(unsigned char *buf, long track, long long pos, long len)
+{
+  unsigned long long x;
+  long i;
+
+  x = pattern_word(track, pos / 8);
+  for (i = 0; i < len; i++, pos++) {
+    if (i > 0 && pos % 8 == 0)
+      x = pattern_word(track, pos / 8);
+    buf[i] = (unsigned char) (x >> (8 * (pos % 8)));
+  }
+}
+
+/* Parse a size, with an optional suffix K, M or G */
+int parse_bench_size(const char *s, long long *value)
+{
+  char *end;
+  long long n;
+
+  n = strtoll(s, &end, 10);
+  if (end == s || n < 0)
+    return 1;
+
+  if (*end == 'k' || *end == 'K')
+    n *= 1024;
+  else if (*end == 'm' || *end == 'M')
+    n *= 1024 * 1024;
+  else if (*end == 'g' || *end == 'G')
+    n *= 1024 * 1024 * 1024;
+  else if (*end)
+    return 1;
+
+  if (*end && end[1])
+    return 1;
+
+  *value = n;
+  return 0;
+}
+
+/* Get the current time, in seconds */
+double get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Wait for a given number of seconds */
+void sleep_for(double t)
+{
+  struct timespec ts;
+
+  if (t <= 0)
+    return;
+  ts.tv_sec = (time_t) t;
+  ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) && errno == EINTR)
+    ;
+}
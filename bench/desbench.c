@@ -0,0 +1,182 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measure how the speed of AMZ decryption scales with the number of
+   threads, and check that the result is the same as decrypting the
+   whole file in one call. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gcrypt.h>
+
+#include "bench.h"
+#include "../clamz.h"
+
+/* Size of each piece passed to the decryptor; the amount of
+   ciphertext in each piece clamz reads from an AMZ file */
+#define PIECE_SIZE (1024 * 1024 / 4 * 3)
+
+/* Encrypt data the way an AMZ file is encrypted */
+static int encrypt(unsigned char *data, size_t n)
+{
+  static const unsigned char key[8] = { 0x29, 0xAB, 0x9D, 0x18,
+					0xB2, 0x44, 0x9E, 0x31 };
+  static const unsigned char initv[8] = { 0x5E, 0x72, 0xD7, 0x9A,
+					  0x11, 0xB3, 0x4F, 0xEE };
+  gcry_cipher_hd_t hd;
+
+  if (gcry_cipher_open(&hd, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0)
+      || gcry_cipher_setkey(hd, key, 8)
+      || gcry_cipher_setiv(hd, initv, 8)
+      || gcry_cipher_encrypt(hd, data, n, NULL, 0))
+    return 1;
+  gcry_cipher_close(hd);
+  return 0;
+}
+
+/* Decrypt a whole buffer, a piece at a time */
+static int decrypt_all(unsigned char *data, size_t len, int threads)
+{
+  clamz_decryptor *dec;
+  size_t i, n;
+  int status = 0;
+
+  dec = new_decryptor(threads);
+  if (!dec)
+    return 1;
+
+  for (i = 0; i < len && !status; i += n) {
+    n = (len - i < PIECE_SIZE ? len - i : PIECE_SIZE);
+    status = decryptor_run(dec, data + i, n);
+  }
+
+  if (status)
+    fprintf(stderr, "desbench: %s\n", decryptor_error(dec));
+  free_decryptor(dec);
+  return status;
+}
+
+static void print_usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options]\n"
+	  " -s SIZE:    size of the encrypted data (default 64M)\n"
+	  " -j N:       largest number of threads to try (default: CPUs)\n"
+	  " -t SECS:    time to spend on each number of threads"
+	  " (default 1)\n",
+	  progname);
+}
+
+int main(int argc, char **argv)
+{
+  long long size = 64 * 1024 * 1024;
+  unsigned char *data, *cipher, *out;
+  double secs = 1.0, t0, t, base = 0.0, rate;
+  int maxthreads = 0, opt, threads, runs, failed = 0;
+  long n;
+
+  while ((opt = getopt(argc, argv, "s:j:t:")) != -1) {
+    switch (opt) {
+    case 's':
+      if (parse_bench_size(optarg, &size) || size < 8) {
+	print_usage(argv[0]);
+	return 2;
+      }
+      break;
+
+    case 'j':
+      maxthreads = atoi(optarg);
+      break;
+
+    case 't':
+      secs = atof(optarg);
+      break;
+
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (maxthreads < 1) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    maxthreads = (n > 0 ? n : 1);
+  }
+
+  if (!gcry_check_version(GCRYPT_VERSION)) {
+    fprintf(stderr, "%s: libgcrypt version mismatch\n", argv[0]);
+    return 1;
+  }
+  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  size -= size % 8;
+  data = malloc(size);
+  cipher = malloc(size);
+  out = malloc(size);
+  if (!data || !cipher || !out) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  fill_pattern(data, 1, 0, size);
+  memcpy(cipher, data, size);
+  if (encrypt(cipher, size)) {
+    fprintf(stderr, "%s: unable to encrypt test data\n", argv[0]);
+    return 1;
+  }
+
+  printf("input:       %.1f MB of ciphertext, %d KB per piece\n",
+	 size / 1e6, PIECE_SIZE / 1024);
+
+  for (threads = 1; threads <= maxthreads; threads++) {
+    runs = 0;
+    t = 0.0;
+    do {
+      memcpy(out, cipher, size);
+      t0 = get_time();
+      if (decrypt_all(out, size, threads))
+	return 1;
+      t += get_time() - t0;
+      runs++;
+    } while (t < secs);
+
+    if (memcmp(out, data, size)) {
+      printf("%2d threads:  FAILED\n", threads);
+      failed = 1;
+      continue;
+    }
+
+    rate = (double) size * runs / t / 1e6;
+    if (threads == 1)
+      base = rate;
+    printf("%2d threads:  %8.1f MB/s  (%.2fx, %d runs)\n",
+	   threads, rate, rate / base, runs);
+  }
+
+  free(data);
+  free(cipher);
+  free(out);
+  return failed;
+}
@@ -0,0 +1,440 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A minimal HTTP server standing in for the Amazon MP3 store.  Each
+   connection is handled by a separate process.  Tracks are requested
+   as /track/N.mp3?size=SIZE, and their contents are generated by
+   fill_pattern().  Cover images, /image/N.jpg, are generated the same
+   way, and are BENCH_IMAGE_SIZE bytes long.
+
+   Faults may be requested with additional URL parameters.  Requests
+   for each track are numbered from 1 (across all connections), and
+   the faults apply to successive requests in the following order:
+
+     fail=N        the first N requests get "503 Service Unavailable"
+     drop=N        the next N requests are cut off half way through
+     stall=N       the next N requests stop half way through for
+                   stall_ms milliseconds (default 2000)
+
+   In addition:
+
+     bad_range=N   the first N requests with a Range header get "416
+                   Requested Range Not Satisfiable"
+     norange=1     Range headers are ignored */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#define REQUEST_MAX 8192
+#define CHUNK_SIZE 65536
+#define MAX_TRACKS 65536
+
+/* Server settings */
+static long latency_ms;		/* delay before each response */
+static long long bandwidth;	/* bytes per second per connection, or 0 */
+
+/* Number of requests, and requests with a Range header, received so
+   far for each track (shared by all processes) */
+static long *request_count;
+static long *range_count;
+
+/* A parsed request */
+struct request {
+  char path[1024];
+  long track;
+  long long size;
+  long long range_start;	/* or -1 if no range was requested */
+  long long range_end;		/* or -1 if open-ended */
+  int keep_alive;
+  int image;
+
+  /* faults to inject */
+  long fail, drop, stall, stall_ms, bad_range;
+  int norange;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Find the value of a query parameter */
+static const char *get_param(const char *path, const char *name)
+{
+  const char *p = strchr(path, '?');
+  size_t n = strlen(name);
+
+  while (p) {
+    p++;
+    if (!strncmp(p, name, n) && p[n] == '=')
+      return p + n + 1;
+    p = strchr(p, '&');
+  }
+  return NULL;
+}
+
+static long get_count_param(const char *path, const char *name, long def)
+{
+  const char *v = get_param(path, name);
+  return (v ? atol(v) : def);
+}
+
+/* Parse the request line and headers.  Return 0 if successful. */
+static int parse_request(char *text, struct request *req)
+{
+  char *line, *next, *p;
+  const char *v;
+  int first = 1;
+
+  req->path[0] = 0;
+  req->track = -1;
+  req->size = 0;
+  req->range_start = req->range_end = -1;
+  req->keep_alive = 1;
+
+  for (line = text; line && *line; line = next) {
+    next = strstr(line, "\r\n");
+    if (next) {
+      *next = 0;
+      next += 2;
+    }
+
+    if (first) {
+      if (strncmp(line, "GET ", 4))
+	return 1;
+      p = strchr(line + 4, ' ');
+      if (!p || p - (line + 4) >= (long) sizeof(req->path))
+	return 1;
+      memcpy(req->path, line + 4, p - (line + 4));
+      req->path[p - (line + 4)] = 0;
+      if (strcmp(p + 1, "HTTP/1.1"))
+	req->keep_alive = 0;
+      first = 0;
+    }
+    else if (!strncasecmp(line, "Connection:", 11)) {
+      if (strstr(line, "close"))
+	req->keep_alive = 0;
+    }
+    else if (!strncasecmp(line, "Range:", 6)) {
+      p = strstr(line, "bytes=");
+      if (p) {
+	req->range_start = strtoll(p + 6, &p, 10);
+	if (*p == '-' && p[1])
+	  req->range_end = strtoll(p + 1, NULL, 10);
+      }
+    }
+  }
+
+  req->image = 0;
+  if (sscanf(req->path, "/image/%ld.jpg", &req->track) == 1) {
+    req->image = 1;
+    req->size = BENCH_IMAGE_SIZE;
+  }
+  else if (sscanf(req->path, "/track/%ld.mp3", &req->track) != 1)
+    req->track = -1;
+  if (req->track < 0 || req->track >= MAX_TRACKS)
+    req->track = -1;
+  if ((v = get_param(req->path, "size")))
+    req->size = strtoll(v, NULL, 10);
+
+  req->fail = get_count_param(req->path, "fail", 0);
+  req->drop = get_count_param(req->path, "drop", 0);
+  req->stall = get_count_param(req->path, "stall", 0);
+  req->stall_ms = get_count_param(req->path, "stall_ms", 2000);
+  req->bad_range = get_count_param(req->path, "bad_range", 0);
+  req->norange = get_count_param(req->path, "norange", 0);
+  return 0;
+}
+
+/* Send part of a track, limiting the rate if necessary */
+static int send_body(int fd, const struct request *req, long long start,
+		     long long len)
+{
+  static unsigned char buf[CHUNK_SIZE];
+  double t0 = get_time();
+  long long sent = 0;
+  long n;
+
+  while (sent < len) {
+    n = (len - sent < CHUNK_SIZE ? len - sent : CHUNK_SIZE);
+    if (bandwidth && n > bandwidth / 20 + 1)
+      n = bandwidth / 20 + 1;
+
+    fill_pattern(buf, req->track, start + sent, n);
+    if (write_all(fd, buf, n))
+      return 1;
+    sent += n;
+
+    if (bandwidth)
+      sleep_for(t0 + (double) sent / bandwidth - get_time());
+  }
+  return 0;
+}
+
+/* Send the response to a request.  Return 0 if the connection may be
+   used for another request. */
+static int send_response(int fd, const struct request *req)
+{
+  char head[1024];
+  long long start, end, len;
+  long count, rcount;
+  int n, ranged;
+
+  sleep_for(latency_ms / 1000.0);
+
+  if (req->track < 0 || req->size <= 0) {
+    n = sprintf(head, "HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\n\r\n");
+    return write_all(fd, head, n) || !req->keep_alive;
+  }
+
+  /* faults are only injected into tracks, so images are not counted */
+  count = rcount = 1;
+  ranged = (req->range_start >= 0 && !req->norange);
+  if (!req->image) {
+    count = __sync_add_and_fetch(&request_count[req->track], 1);
+    if (ranged)
+      rcount = __sync_add_and_fetch(&range_count[req->track], 1);
+  }
+
+  if (count <= req->fail) {
+    n = sprintf(head, "HTTP/1.1 503 Service Unavailable\r\n"
+		"Content-Length: 0\r\n\r\n");
+    return write_all(fd, head, n) || !req->keep_alive;
+  }
+  count -= req->fail;
+
+  if (ranged && rcount <= req->bad_range) {
+    n = sprintf(head, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+		"Content-Range: bytes */%lld\r\n"
+		"Content-Length: 0\r\n\r\n", req->size);
+    return write_all(fd, head, n) || !req->keep_alive;
+  }
+
+  start = 0;
+  end = req->size - 1;
+  if (ranged) {
+    start = req->range_start;
+    if (req->range_end >= 0 && req->range_end < end)
+      end = req->range_end;
+
+    if (start >= req->size) {
+      n = sprintf(head, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+		  "Content-Range: bytes */%lld\r\n"
+		  "Content-Length: 0\r\n\r\n", req->size);
+      return write_all(fd, head, n) || !req->keep_alive;
+    }
+  }
+
+  n = sprintf(head, "HTTP/1.1 %s\r\n"
+	      "Content-Type: %s\r\n"
+	      "Content-Length: %lld\r\n"
+	      "Accept-Ranges: bytes\r\n"
+	      "ETag: \"track-%ld-%lld\"\r\n"
+	      "Last-Modified: Sat, 01 Jan 2011 00:00:00 GMT\r\n",
+	      (ranged ? "206 Partial Content" : "200 OK"),
+	      (req->image ? "image/jpeg" : "audio/mpeg"), end - start + 1, req->track, req->size);
+  if (ranged)
+    n += sprintf(head + n, "Content-Range: bytes %lld-%lld/%lld\r\n",
+		 start, end, req->size);
+  if (!req->keep_alive)
+    n += sprintf(head + n, "Connection: close\r\n");
+  n += sprintf(head + n, "\r\n");
+
+  if (write_all(fd, head, n))
+    return 1;
+
+  len = end - start + 1;
+  if (count <= req->drop) {
+    /* send half of the data, then close the connection */
+    send_body(fd, req, start, len / 2);
+    return 1;
+  }
+  count -= req->drop;
+
+  if (count <= req->stall) {
+    if (send_body(fd, req, start, len / 2))
+      return 1;
+    sleep_for(req->stall_ms / 1000.0);
+    start += len / 2;
+    len -= len / 2;
+  }
+
+  if (send_body(fd, req, start, len))
+    return 1;
+  return !req->keep_alive;
+}
+
+/* Handle requests on a connection until it is closed */
+static void serve_connection(int fd)
+{
+  char buf[REQUEST_MAX + 1];
+  struct request req;
+  size_t len = 0, hlen;
+  ssize_t n;
+  char *p;
+
+  for (;;) {
+    buf[len] = 0;
+    while (!(p = strstr(buf, "\r\n\r\n"))) {
+      if (len >= REQUEST_MAX)
+	return;
+      n = read(fd, buf + len, REQUEST_MAX - len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return;
+      len += n;
+      buf[len] = 0;
+    }
+
+    *p = 0;
+    hlen = p + 4 - buf;
+    if (parse_request(buf, &req))
+      return;
+    if (send_response(fd, &req))
+      return;
+
+    memmove(buf, buf + hlen, len - hlen);
+    len -= hlen;
+  }
+}
+
+static void print_usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options]\n"
+	  " -p PORT:    port to listen on (default 8080; 0 to choose any)\n"
+	  " -l MS:      wait MS milliseconds before each response\n"
+	  " -b RATE:    limit each connection to RATE bytes per second\n",
+	  progname);
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int port = 8080, sock, fd, c, one = 1;
+  pid_t pid;
+
+  while ((c = getopt(argc, argv, "p:l:b:")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      latency_ms = atol(optarg);
+      break;
+    case 'b':
+      if (parse_bench_size(optarg, &bandwidth)) {
+	fprintf(stderr, "%s: invalid rate '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  request_count = mmap(NULL, 2 * MAX_TRACKS * sizeof(long),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+  if (request_count == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  range_count = request_count + MAX_TRACKS;
+
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr))
+      || listen(sock, 128)) {
+    perror("bind");
+    return 1;
+  }
+
+  /* report the port number, so that runbench can find us */
+  addrlen = sizeof(addr);
+  getsockname(sock, (struct sockaddr *) &addr, &addrlen);
+  printf("%d\n", ntohs(addr.sin_port));
+  fflush(stdout);
+
+  for (;;) {
+    fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      perror("accept");
+      return 1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+      close(sock);
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      serve_connection(fd);
+      close(fd);
+      _exit(0);
+    }
+    if (pid < 0)
+      perror("fork");
+    close(fd);
+  }
+}
@@ -0,0 +1,301 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generate a synthetic AMZ file, listing tracks served by fakestore */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <gcrypt.h>
+
+#include "bench.h"
+
+/* Append a formatted string to a growing buffer */
+static int append(char **buf, size_t *len, size_t *size, const char *fmt, ...)
+{
+  va_list ap;
+  char *p;
+  int n;
+
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return 1;
+    if (*len + n < *size) {
+      *len += n;
+      return 0;
+    }
+
+    p = realloc(*buf, *size * 2 + n);
+    if (!p)
+      return 1;
+    *buf = p;
+    *size = *size * 2 + n;
+  }
+}
+
+/* Escape ampersands in a URL query, for use in XML */
+static char *escape_query(const char *query)
+{
+  char *buf, *p;
+
+  buf = p = malloc(strlen(query) * 5 + 1);
+  if (!buf)
+    return NULL;
+
+  for (; *query; query++) {
+    if (*query == '&') {
+      strcpy(p, "&amp;");
+      p += 5;
+    }
+    else {
+      *p++ = *query;
+    }
+  }
+  *p = 0;
+  return buf;
+}
+
+/* Generate the playlist XML */
+static char *make_playlist(const char *base_url, int num_tracks,
+			   long long size, const char *query,
+			   int query_tracks, size_t *len)
+{
+  size_t bufsize = 4096;
+  char *buf = malloc(bufsize);
+  int i, err;
+
+  if (!buf)
+    return NULL;
+  *len = 0;
+
+  err = append(&buf, len, &bufsize,
+	       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	       "<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\">\n"
+	       "<title>Benchmark Album</title>\n"
+	       "<creator>Benchmark Artist</creator>\n"
+	       "<image>%s/image/1.jpg</image>\n"
+	       "<trackList>\n", base_url);
+
+  for (i = 1; i <= num_tracks && !err; i++) {
+    if (query_tracks && i > query_tracks)
+      query = NULL;
+
+    err = append(&buf, len, &bufsize,
+		 "<track>"
+		 "<location>%s/track/%d.mp3?size=%lld%s%s</location>"
+		 "<creator>Benchmark Artist</creator>"
+		 "<album>Benchmark Album</album>"
+		 "<title>Track %d</title>"
+		 "<trackNum>%d</trackNum>"
+		 "<image>%s/image/1.jpg</image>"
+		 "<meta rel=\"http://www.amazon.com/dmusic/ASIN\">"
+		 BENCH_ASIN "</meta>"
+		 "<meta rel=\"http://www.amazon.com/dmusic/albumASIN\">"
+		 "B000000000</meta>"
+		 "<meta rel=\"http://www.amazon.com/dmusic/albumPrimaryArtist\">"
+		 "Benchmark Artist</meta>"
+		 "<meta rel=\"http://www.amazon.com/dmusic/discNum\">1</meta>"
+		 "<meta rel=\"http://www.amazon.com/dmusic/fileSize\">"
+		 "%lld</meta>"
+		 "<meta rel=\"http://www.amazon.com/dmusic/trackType\">"
+		 "mp3</meta>"
+		 "</track>\n",
+		 base_url, i, size, (query ? "&amp;" : ""),
+		 (query ? query : ""), i, i, base_url, i, size);
+  }
+
+  if (!err)
+    err = append(&buf, len, &bufsize, "</trackList>\n</playlist>\n");
+
+  if (err) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/* Encrypt the playlist, the same way Amazon does, and encode it in
+   base64 */
+static char *encrypt_playlist(const char *xml, size_t xml_len,
+			      size_t *len)
+{
+  static const unsigned char key[8] = { 0x29, 0xAB, 0x9D, 0x18,
+					0xB2, 0x44, 0x9E, 0x31 };
+  static const unsigned char initv[8] = { 0x5E, 0x72, 0xD7, 0x9A,
+					  0x11, 0xB3, 0x4F, 0xEE };
+  static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  gcry_cipher_hd_t hd;
+  unsigned char *data;
+  char *out, *p;
+  size_t n, i;
+  unsigned long v;
+
+  /* pad with null bytes, which clamz ignores */
+  n = (xml_len + 7) & ~(size_t) 7;
+  data = calloc(n, 1);
+  out = malloc((n + 2) / 3 * 4 + n / 54 + 2);
+  if (!data || !out) {
+    free(data);
+    free(out);
+    return NULL;
+  }
+  memcpy(data, xml, xml_len);
+
+  if (gcry_cipher_open(&hd, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0)
+      || gcry_cipher_setkey(hd, key, 8)
+      || gcry_cipher_setiv(hd, initv, 8)
+      || gcry_cipher_encrypt(hd, data, n, NULL, 0)) {
+    fprintf(stderr, "mkamz: unable to encrypt playlist\n");
+    free(data);
+    free(out);
+    return NULL;
+  }
+  gcry_cipher_close(hd);
+
+  p = out;
+  for (i = 0; i < n; i += 3) {
+    v = (unsigned long) data[i] << 16;
+    if (i + 1 < n)
+      v |= data[i + 1] << 8;
+    if (i + 2 < n)
+      v |= data[i + 2];
+
+    *p++ = b64chars[(v >> 18) & 0x3f];
+    *p++ = b64chars[(v >> 12) & 0x3f];
+    *p++ = (i + 1 < n ? b64chars[(v >> 6) & 0x3f] : '=');
+    *p++ = (i + 2 < n ? b64chars[v & 0x3f] : '=');
+
+    if ((i / 3) % 18 == 17)
+      *p++ = '\n';
+  }
+  *p++ = '\n';
+
+  free(data);
+  *len = p - out;
+  return out;
+}
+
+static void print_usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options] output-file\n"
+	  " -u URL:     base URL of the server (default http://127.0.0.1:8080)\n"
+	  " -n N:       number of tracks (default 10)\n"
+	  " -s SIZE:    size of each track in bytes (default 4M)\n"
+	  " -q QUERY:   extra parameters to add to each track's URL\n"
+	  " -m N:       add the extra parameters only to the first N tracks\n"
+	  " -p:         write plain XML, rather than an encrypted file\n",
+	  progname);
+}
+
+int main(int argc, char **argv)
+{
+  const char *base_url = "http://127.0.0.1:8080";
+  const char *query = NULL;
+  int num_tracks = 10, query_tracks = 0, plain = 0;
+  long long size = 4 * 1024 * 1024;
+  char *xml, *data, *equery = NULL;
+  size_t xml_len, len;
+  FILE *f;
+  int c;
+
+  while ((c = getopt(argc, argv, "u:n:s:q:m:p")) != -1) {
+    switch (c) {
+    case 'u':
+      base_url = optarg;
+      break;
+    case 'n':
+      num_tracks = atoi(optarg);
+      break;
+    case 's':
+      if (parse_bench_size(optarg, &size)) {
+	fprintf(stderr, "%s: invalid size '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    case 'q':
+      query = optarg;
+      break;
+    case 'm':
+      query_tracks = atoi(optarg);
+      break;
+    case 'p':
+      plain = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1 || num_tracks < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (!gcry_check_version(GCRYPT_VERSION)) {
+    fprintf(stderr, "%s: libgcrypt version mismatch\n", argv[0]);
+    return 1;
+  }
+  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  if (query && !(equery = escape_query(query))) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  xml = make_playlist(base_url, num_tracks, size, equery, query_tracks,
+		      &xml_len);
+  free(equery);
+  if (!xml) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+
+  if (plain) {
+    data = xml;
+    len = xml_len;
+  }
+  else {
+    data = encrypt_playlist(xml, xml_len, &len);
+    free(xml);
+    if (!data)
+      return 1;
+  }
+
+  f = fopen(argv[optind], "wb");
+  if (!f || fwrite(data, 1, len, f) != len || fclose(f)) {
+    perror(argv[optind]);
+    free(data);
+    return 1;
+  }
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measure the time taken to parse an AMZ file (such as one made by
+   mkamz), and to expand output filenames for each of its tracks,
+   using a format that refers to every track and playlist variable. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <gcrypt.h>
+
+#include "bench.h"
+#include "../clamz.h"
+
+#define DEFAULT_FORMAT \
+  "${album_artist}/${album} (${album_asin})/${discnum}-${tracknum}" \
+  " - ${creator} - ${title} [${asin}, ${genre}] ${amz_title}" \
+  " ${amz_creator} ${amz_asin} ${amz_genre}.${suffix}"
+
+/* The parts of clamz that the playlist parser and filename expansion
+   depend on */
+
+void print_error(const char *message, ...)
+{
+  va_list ap;
+
+  fputs("namebench: ", stderr);
+  va_start(ap, message);
+  vfprintf(stderr, message, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+char *get_config_file_name(const char *subdir UNUSED,
+			   const char *name UNUSED,
+			   const char *envname UNUSED)
+{
+  return NULL;
+}
+
+static clamz_playlist *read_playlist(const char *fname)
+{
+  clamz_playlist *pl;
+  int fd;
+
+  if ((fd = open(fname, O_RDONLY)) < 0) {
+    perror(fname);
+    return NULL;
+  }
+
+  pl = new_playlist();
+  if (pl && read_amz_file(pl, NULL, fd, NULL, fname)) {
+    free_playlist(pl);
+    pl = NULL;
+  }
+
+  close(fd);
+  return pl;
+}
+
+static void print_usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options] amz-file\n"
+	  " -f FORMAT:  filename format (default: every variable)\n"
+	  " -t SECS:    time to spend on each test (default 1)\n",
+	  progname);
+}
+
+int main(int argc, char **argv)
+{
+  clamz_config cfg;
+  clamz_playlist *pl;
+  const char *format = DEFAULT_FORMAT;
+  char *name;
+  double secs = 1.0, t0, t;
+  long long names;
+  int opt, i, runs;
+
+  while ((opt = getopt(argc, argv, "f:t:")) != -1) {
+    switch (opt) {
+    case 'f':
+      format = optarg;
+      break;
+
+    case 't':
+      secs = atof(optarg);
+      break;
+
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  if (!gcry_check_version(GCRYPT_VERSION)) {
+    fprintf(stderr, "%s: libgcrypt version mismatch\n", argv[0]);
+    return 1;
+  }
+  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  memset(&cfg, 0, sizeof(cfg));
+
+  runs = 0;
+  t0 = get_time();
+  do {
+    if (!(pl = read_playlist(argv[optind])))
+      return 1;
+    runs++;
+    t = get_time() - t0;
+    if (t < secs)
+      free_playlist(pl);
+  } while (t < secs);
+
+  printf("parse:       %8.2f ms per file    (%d tracks, %d runs)\n",
+	 t / runs * 1e3, pl->num_tracks, runs);
+
+  if (pl->num_tracks < 1) {
+    fprintf(stderr, "%s: no tracks in %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+
+  names = 0;
+  t0 = get_time();
+  do {
+    for (i = 0; i < pl->num_tracks; i++) {
+      name = NULL;
+      if (expand_file_name(&cfg, pl->tracks[i], &name, format))
+	return 1;
+      free(name);
+    }
+    names += pl->num_tracks;
+    t = get_time() - t0;
+  } while (t < secs);
+
+  printf("expand:      %8.2f us per name   (%lld names)\n",
+	 t / names * 1e6, names);
+
+  free_playlist(pl);
+  return 0;
+}
@@ -0,0 +1,629 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Run clamz against fakestore, with a synthetic AMZ file, and report
+   how long it took.  Everything happens in a temporary directory,
+   which is also used as $HOME, so the user's configuration is not
+   used or modified.
+
+   With -F, a series of scenarios is run instead, each with a
+   different fault injected by the server, to check that the files
+   are still downloaded correctly and to measure the time lost. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+/* for nftw() and wait4() */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <gcrypt.h>
+
+#include "bench.h"
+
+#define MAX_ARGS 64
+
+/* Settings for a benchmark run */
+struct bench {
+  const char *clamz;
+  const char *tools_dir;
+  char work_dir[64];
+  int num_tracks;
+  long long size;
+  long latency_ms;
+  long long bandwidth;
+  int plain;
+  const char *faults;		/* fakestore URL parameters */
+  int fault_tracks;		/* number of tracks affected, or 0 for all */
+  char **clamz_args;
+  int num_clamz_args;
+  int log_errors;		/* send clamz's messages to a log file */
+
+  char run_dir[128];
+  pid_t server_pid;
+  int port;
+};
+
+/* Outcome of a benchmark run */
+struct result {
+  int status;			/* exit status of (the last run of) clamz */
+  int bad;			/* number of tracks downloaded incorrectly */
+  double wall;
+  double user;
+  double sys;
+};
+
+/* Fault injection scenarios */
+static const struct scenario {
+  const char *name;
+  const char *faults;
+  int fault_tracks;
+  double kill_after;		/* kill clamz, then run it with --resume */
+} scenarios[] = {
+  { "no faults", NULL, 0, 0 },
+  { "503 burst", "fail=2", 0, 0 },
+  { "disconnect", "drop=1", 0, 0 },
+  { "stall", "stall=1&stall_ms=2000", 0, 0 },
+  { "Range ignored", "drop=1&norange=1", 0, 0 },
+  { "416 on retry", "drop=1&bad_range=1", 0, 0 },
+  /* the first track stalls half way, and clamz is killed while
+     waiting for it (after its journal has been saved) */
+  { "killed, resumed", "stall=1&stall_ms=10000", 1, 1.5 }
+};
+
+/* Start a program, with its standard output optionally sent to a
+   pipe, and its standard error optionally sent to a file.  Return
+   the process ID, or -1 on failure. */
+static pid_t start_program(char **args, int *outfd, const char *home,
+			   const char *errfile)
+{
+  int fds[2], fd;
+  pid_t pid;
+
+  if (outfd && pipe(fds)) {
+    perror("pipe");
+    return -1;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    /* each program gets its own process group, so that the server
+       can be stopped along with the processes serving each
+       connection */
+    setpgid(0, 0);
+    if (outfd) {
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+    }
+    if (errfile) {
+      fd = open(errfile, O_WRONLY | O_CREAT | O_APPEND, 0600);
+      if (fd >= 0) {
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+      }
+    }
+    if (home)
+      setenv("HOME", home, 1);
+    execv(args[0], args);
+    perror(args[0]);
+    _exit(127);
+  }
+  if (pid < 0)
+    perror("fork");
+
+  if (outfd) {
+    close(fds[1]);
+    *outfd = fds[0];
+  }
+  return pid;
+}
+
+/* Wait for a program to finish.  Return its exit status, or -1 if it
+   did not exit normally. */
+static int wait_program(pid_t pid, struct rusage *ru)
+{
+  struct rusage dummy;
+  int status;
+
+  while (wait4(pid, &status, 0, (ru ? ru : &dummy)) < 0) {
+    if (errno != EINTR) {
+      perror("wait");
+      return -1;
+    }
+  }
+
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return -1;
+}
+
+static int start_server(struct bench *b)
+{
+  char path[4096], latency[32], bandwidth[32], line[32];
+  char *args[MAX_ARGS];
+  int n = 0, fd, len;
+
+  snprintf(path, sizeof(path), "%s/fakestore", b->tools_dir);
+  sprintf(latency, "%ld", b->latency_ms);
+  sprintf(bandwidth, "%lld", b->bandwidth);
+  args[n++] = path;
+  args[n++] = "-p";
+  args[n++] = "0";
+  args[n++] = "-l";
+  args[n++] = latency;
+  args[n++] = "-b";
+  args[n++] = bandwidth;
+  args[n] = NULL;
+
+  b->server_pid = start_program(args, &fd, NULL, NULL);
+  if (b->server_pid < 0)
+    return 1;
+
+  len = read(fd, line, sizeof(line) - 1);
+  close(fd);
+  if (len <= 0) {
+    fprintf(stderr, "runbench: unable to start fakestore\n");
+    return 1;
+  }
+  line[len] = 0;
+  b->port = atoi(line);
+  return 0;
+}
+
+static void stop_server(struct bench *b)
+{
+  if (b->server_pid > 0) {
+    kill(-b->server_pid, SIGTERM);
+    wait_program(b->server_pid, NULL);
+    b->server_pid = 0;
+  }
+}
+
+static int make_amz_file(struct bench *b, const char *amzfile)
+{
+  char path[4096], url[64], tracks[32], size[32], fault_tracks[32];
+  char *args[MAX_ARGS];
+  int n = 0;
+  pid_t pid;
+
+  snprintf(path, sizeof(path), "%s/mkamz", b->tools_dir);
+  sprintf(url, "http://127.0.0.1:%d", b->port);
+  sprintf(tracks, "%d", b->num_tracks);
+  sprintf(size, "%lld", b->size);
+  args[n++] = path;
+  args[n++] = "-u";
+  args[n++] = url;
+  args[n++] = "-n";
+  args[n++] = tracks;
+  args[n++] = "-s";
+  args[n++] = size;
+  if (b->plain)
+    args[n++] = "-p";
+  if (b->faults) {
+    args[n++] = "-q";
+    args[n++] = (char *) b->faults;
+  }
+  if (b->fault_tracks) {
+    sprintf(fault_tracks, "%d", b->fault_tracks);
+    args[n++] = "-m";
+    args[n++] = fault_tracks;
+  }
+  args[n++] = (char *) amzfile;
+  args[n] = NULL;
+
+  pid = start_program(args, NULL, NULL, NULL);
+  if (pid < 0 || wait_program(pid, NULL)) {
+    fprintf(stderr, "runbench: unable to create %s\n", amzfile);
+    return 1;
+  }
+  return 0;
+}
+
+/* Check that the manifest written by clamz gives the correct digest
+   for a track.  Return 0 if so. */
+static int verify_manifest(struct bench *b, int track,
+			   const unsigned char *digest)
+{
+  char path[4096], name[64], hex[65], *line = NULL;
+  size_t linesize = 0;
+  FILE *f;
+  int i, found = 0;
+
+  snprintf(path, sizeof(path), "%s/out/SHA256SUMS", b->run_dir);
+  snprintf(name, sizeof(name), BENCH_ASIN ".mp3\n", track);
+  for (i = 0; i < 32; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+
+  if (!(f = fopen(path, "r"))) {
+    fprintf(stderr, "runbench: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  while (getline(&line, &linesize, f) > 0)
+    if (!strncmp(line, hex, 64) && !strncmp(line + 64, "  ", 2)
+	&& !strcmp(line + 66, name))
+      found = 1;
+  fclose(f);
+  free(line);
+
+  if (!found)
+    fprintf(stderr, "runbench: %s: no correct entry for track %d\n",
+	    path, track);
+  return !found;
+}
+
+/* Check that each track was downloaded correctly, and listed in the
+   manifest with the correct digest.  Return the number of tracks
+   which were not. */
+static int verify_output(struct bench *b)
+{
+  static unsigned char buf[65536], expect[65536];
+  char path[4096];
+  long long pos;
+  ssize_t n;
+  int i, fd, bad = 0;
+  gcry_md_hd_t md;
+
+  for (i = 1; i <= b->num_tracks; i++) {
+    snprintf(path, sizeof(path), "%s/out/" BENCH_ASIN ".mp3",
+	     b->run_dir, i);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "runbench: %s: %s\n", path, strerror(errno));
+      bad++;
+      continue;
+    }
+
+    if (gcry_md_open(&md, GCRY_MD_SHA256, 0)) {
+      close(fd);
+      bad++;
+      continue;
+    }
+
+    pos = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      fill_pattern(expect, i, pos, n);
+      if (pos + n > b->size || memcmp(buf, expect, n))
+	break;
+      gcry_md_write(md, buf, n);
+      pos += n;
+    }
+    close(fd);
+
+    if (n != 0 || pos != b->size) {
+      fprintf(stderr, "runbench: %s: contents are incorrect\n", path);
+      bad++;
+    }
+    else if (verify_manifest(b, i, gcry_md_read(md, GCRY_MD_SHA256)))
+      bad++;
+    gcry_md_close(md);
+  }
+  return bad;
+}
+
+static int remove_entry(const char *path, const struct stat *st,
+			int flag, struct FTW *ftw)
+{
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  return remove(path);
+}
+
+static void add_rusage(struct result *r, const struct rusage *ru)
+{
+  r->user += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+  r->sys += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/* Run clamz.  If KILL_AFTER is nonzero, kill it after that many
+   seconds, and then run it again with --resume. */
+static int run_clamz(struct bench *b, const char *amzfile,
+		     double kill_after, struct result *r)
+{
+  char outdir[160], logfile[160];
+  char *args[MAX_ARGS];
+  struct rusage ru;
+  double t0;
+  int n = 0, i, status;
+  pid_t pid;
+
+  snprintf(outdir, sizeof(outdir), "%s/out", b->run_dir);
+  snprintf(logfile, sizeof(logfile), "%s/clamz.log", b->run_dir);
+
+  args[n++] = (char *) b->clamz;
+  args[n++] = "-q";
+  args[n++] = "-d";
+  args[n++] = outdir;
+  args[n++] = "-o";
+  args[n++] = "${asin}.mp3";
+  for (i = 0; i < b->num_clamz_args && n < MAX_ARGS - 3; i++)
+    args[n++] = b->clamz_args[i];
+  args[n++] = (char *) amzfile;
+  args[n] = NULL;
+
+  r->user = r->sys = 0;
+  t0 = get_time();
+  pid = start_program(args, NULL, b->run_dir,
+		      (b->log_errors ? logfile : NULL));
+  if (pid < 0)
+    return 1;
+
+  if (kill_after > 0) {
+    while (wait4(pid, &status, WNOHANG, &ru) == 0) {
+      if (get_time() >= t0 + kill_after) {
+	kill(pid, SIGKILL);
+	wait4(pid, &status, 0, &ru);
+	break;
+      }
+      sleep_for(0.01);
+    }
+    add_rusage(r, &ru);
+
+    args[n - 1] = "-r";
+    args[n++] = (char *) amzfile;
+    args[n] = NULL;
+    pid = start_program(args, NULL, b->run_dir,
+			(b->log_errors ? logfile : NULL));
+    if (pid < 0)
+      return 1;
+  }
+
+  r->status = wait_program(pid, &ru);
+  r->wall = get_time() - t0;
+  add_rusage(r, &ru);
+  return 0;
+}
+
+/* Start the server, run clamz, and check the results */
+static int run_bench(struct bench *b, const char *name, double kill_after,
+		     struct result *r)
+{
+  char amzfile[160];
+  int err;
+
+  snprintf(b->run_dir, sizeof(b->run_dir), "%s/%s", b->work_dir, name);
+  if (mkdir(b->run_dir, 0700)) {
+    perror(b->run_dir);
+    return 1;
+  }
+  snprintf(amzfile, sizeof(amzfile), "%s/bench.amz", b->run_dir);
+
+  err = start_server(b);
+  if (!err)
+    err = make_amz_file(b, amzfile);
+  if (!err)
+    err = run_clamz(b, amzfile, kill_after, r);
+  stop_server(b);
+
+  if (!err)
+    r->bad = verify_output(b);
+  return err;
+}
+
+static void print_report(const struct bench *b, const struct result *r)
+{
+  double mb = (double) b->size * b->num_tracks / (1024 * 1024);
+  int i;
+
+  printf("tracks:      %d x %.1f MB (%s AMZ file)\n", b->num_tracks,
+	 b->size / (1024.0 * 1024.0), (b->plain ? "plain" : "encrypted"));
+  printf("server:      %ld ms latency, ", b->latency_ms);
+  if (b->bandwidth)
+    printf("%.1f MB/s per connection", b->bandwidth / (1024.0 * 1024.0));
+  else
+    printf("unlimited bandwidth");
+  if (b->faults)
+    printf(", faults: %s", b->faults);
+  printf("\n");
+  printf("options:    ");
+  for (i = 0; i < b->num_clamz_args; i++)
+    printf(" %s", b->clamz_args[i]);
+  printf("%s\n", (b->num_clamz_args ? "" : " (none)"));
+  printf("exit status: %d\n", r->status);
+  printf("wall time:   %.3f s\n", r->wall);
+  printf("throughput:  %.2f tracks/s, %.2f MB/s\n",
+	 b->num_tracks / r->wall, mb / r->wall);
+  printf("CPU time:    %.3f s user, %.3f s system (%.1f%% of wall time)\n",
+	 r->user, r->sys, 100 * (r->user + r->sys) / r->wall);
+  printf("verified:    %d of %d tracks\n", b->num_tracks - r->bad,
+	 b->num_tracks);
+}
+
+/* Run each of the fault injection scenarios, and report the time
+   lost compared to the first.  Messages from clamz are saved in
+   clamz.log in the directory for each scenario. */
+static int run_scenarios(struct bench *b)
+{
+  const struct scenario *sc;
+  struct result r;
+  char name[16];
+  double base = 0;
+  int i, failed = 0;
+
+  b->log_errors = 1;
+  printf("%d tracks x %.1f MB\n", b->num_tracks,
+	 b->size / (1024.0 * 1024.0));
+  printf("%-18s %8s %8s %8s %8s %6s\n", "scenario", "wall(s)",
+	 "lost(s)", "CPU(s)", "verified", "status");
+
+  for (i = 0; i < (int) (sizeof(scenarios) / sizeof(scenarios[0])); i++) {
+    sc = &scenarios[i];
+    b->faults = sc->faults;
+    b->fault_tracks = sc->fault_tracks;
+    sprintf(name, "%d", i);
+    if (run_bench(b, name, sc->kill_after, &r))
+      return 1;
+    if (i == 0)
+      base = r.wall;
+
+    printf("%-18s %8.2f %8.2f %8.2f %5d/%-2d %6d\n", sc->name, r.wall,
+	   r.wall - base, r.user + r.sys, b->num_tracks - r.bad,
+	   b->num_tracks, r.status);
+    fflush(stdout);
+
+    if (r.bad || r.status)
+      failed = 1;
+  }
+
+  return failed;
+}
+
+static void print_usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options] [-- clamz-options]\n"
+	  " -n N:       number of tracks (default 10)\n"
+	  " -s SIZE:    size of each track (default 4M)\n"
+	  " -l MS:      server latency in milliseconds (default 0)\n"
+	  " -b RATE:    server bandwidth per connection (default unlimited)\n"
+	  " -p:         use a plain XML AMZ file, rather than encrypted\n"
+	  " -f FAULTS:  inject faults (see bench/fakestore.c)\n"
+	  " -F:         run each fault injection scenario in turn\n"
+	  " -c PATH:    clamz program to test (default ./clamz)\n"
+	  " -t DIR:     directory containing mkamz and fakestore\n"
+	  " -k:         keep the temporary directory\n",
+	  progname);
+}
+
+int main(int argc, char **argv)
+{
+  struct bench b;
+  char *tools_dir = NULL, *p;
+  struct result r;
+  int keep = 0, all_faults = 0, c, err;
+
+  memset(&b, 0, sizeof(b));
+  b.clamz = "./clamz";
+  b.num_tracks = 10;
+  b.size = 4 * 1024 * 1024;
+
+  while ((c = getopt(argc, argv, "n:s:l:b:pf:Fc:t:k")) != -1) {
+    switch (c) {
+    case 'n':
+      b.num_tracks = atoi(optarg);
+      break;
+    case 's':
+      if (parse_bench_size(optarg, &b.size)) {
+	fprintf(stderr, "%s: invalid size '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    case 'l':
+      b.latency_ms = atol(optarg);
+      break;
+    case 'b':
+      if (parse_bench_size(optarg, &b.bandwidth)) {
+	fprintf(stderr, "%s: invalid rate '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    case 'p':
+      b.plain = 1;
+      break;
+    case 'f':
+      b.faults = optarg;
+      break;
+    case 'F':
+      all_faults = 1;
+      break;
+    case 'c':
+      b.clamz = optarg;
+      break;
+    case 't':
+      b.tools_dir = optarg;
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (b.num_tracks < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (!gcry_check_version(GCRYPT_VERSION)) {
+    fprintf(stderr, "%s: libgcrypt version mismatch\n", argv[0]);
+    return 1;
+  }
+  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+  b.clamz_args = argv + optind;
+  b.num_clamz_args = argc - optind;
+
+  /* by default, look for the other programs next to this one */
+  if (!b.tools_dir) {
+    tools_dir = strdup(argv[0]);
+    if (!tools_dir) {
+      fprintf(stderr, "%s: out of memory\n", argv[0]);
+      return 1;
+    }
+    p = strrchr(tools_dir, '/');
+    if (p)
+      *p = 0;
+    else
+      strcpy(tools_dir, ".");
+    b.tools_dir = tools_dir;
+  }
+
+  strcpy(b.work_dir, "/tmp/clamz-bench-XXXXXX");
+  if (!mkdtemp(b.work_dir)) {
+    perror("mkdtemp");
+    free(tools_dir);
+    return 1;
+  }
+
+  if (all_faults) {
+    err = run_scenarios(&b);
+  }
+  else {
+    err = run_bench(&b, "run", 0, &r);
+    if (!err) {
+      print_report(&b, &r);
+      err = (r.status != 0 || r.bad != 0);
+    }
+  }
+
+  if (keep)
+    printf("files kept in %s\n", b.work_dir);
+  else
+    nftw(b.work_dir, &remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+  free(tools_dir);
+  return err;
+}
@@ -26,6 +26,14 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 
 #include <locale.h>
 #include <langinfo.h>
@@ -35,9 +43,29 @@
 
 #include "clamz.h"
 
+/* How often (in seconds) to look for new files in the watched
+   directory, if inotify is not available */
+#define WATCH_INTERVAL 2
+
+/* Space needed for each line of the progress display */
+#define PROGRESS_LINE_SIZE 256
+
+/* Labels for track metadata, in the order of the TMETA_* slots */
+static const char *const track_meta_labels[NUM_META_SLOTS] = {
+  "Album Artist:  ",
+  "Album ASIN:    ",
+  "ASIN:          ",
+  "Disc Number:   ",
+  "File Size:     ",
+  "Genre:         ",
+  "Product Type:  ",
+  "File Type:     "
+};
+
 static void print_pl_info(clamz_playlist *pl, const char* fname)
 {
   clamz_meta_list *meta;
+  int i;
 
   printf("Playlist: %s\n", fname);
   if (pl->title)
@@ -46,19 +74,21 @@ static void print_pl_info(clamz_playlist *pl, const char* fname)
     printf("* Creator:  %s\n", pl->creator);
   if (pl->image_name)
     printf("* Image:    %s\n", pl->image_name);
-  for (meta = pl->meta; meta; meta = meta->next) {
-    if (!strcmp(meta->urn, PMETA_ASIN))
-      printf("* ASIN:     %s\n", meta->value);
-    else if (!strcmp(meta->urn, PMETA_GENRE))
-      printf("* Genre:    %s\n", meta->value);
-    else
-      printf("* '%s' = %s\n", meta->urn, meta->value);
-  }
+  if (pl->meta.value[PMETA_ASIN])
+    printf("* ASIN:     %s\n", pl->meta.value[PMETA_ASIN]);
+  if (pl->meta.value[PMETA_GENRE])
+    printf("* Genre:    %s\n", pl->meta.value[PMETA_GENRE]);
+  for (i = 0; i < NUM_META_SLOTS; i++)
+    if (i != PMETA_ASIN && i != PMETA_GENRE && pl->meta.value[i])
+      printf("* '%s' = %s\n", meta_urn(i), pl->meta.value[i]);
+  for (meta = pl->meta.extra; meta; meta = meta->next)
+    printf("* '%s' = %s\n", meta->urn, meta->value ? meta->value : "");
 }
 
 static void print_tr_info(clamz_track *tr, int n)
 {
   clamz_meta_list *meta;
+  int i;
 
   printf("\n  Track %d:\n", n);
   if (tr->location)
@@ -75,26 +105,11 @@ static void print_tr_info(clamz_track *tr, int n)
     printf("  - Duration:      %s\n", tr->duration);
   if (tr->trackNum)
     printf("  - Track Number:  %s\n", tr->trackNum);
-  for (meta = tr->meta; meta; meta = meta->next) {
-    if (!strcmp(meta->urn, TMETA_ALBUM_ARTIST))
-      printf("  - Album Artist:  %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_ALBUM_ASIN))
-      printf("  - Album ASIN:    %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_ASIN))
-      printf("  - ASIN:          %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_DISC_NUM))
-      printf("  - Disc Number:   %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_FILE_SIZE))
-      printf("  - File Size:     %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_GENRE))
-      printf("  - Genre:         %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_PRODUCT_TYPE))
-      printf("  - Product Type:  %s\n", meta->value);
-    else if (!strcmp(meta->urn, TMETA_TRACK_TYPE))
-      printf("  - File Type:     %s\n", meta->value);
-    else
-      printf("  - '%s' = %s\n", meta->urn, meta->value);
-  }
+  for (i = 0; i < NUM_META_SLOTS; i++)
+    if (tr->meta.value[i])
+      printf("  - %s%s\n", track_meta_labels[i], tr->meta.value[i]);
+  for (meta = tr->meta.extra; meta; meta = meta->next)
+    printf("  - '%s' = %s\n", meta->urn, meta->value ? meta->value : "");
 }
 
 static const char *getbasename(const char *fname)
@@ -112,53 +127,43 @@ static int run_amz_file(clamz_downloader *dl,
 			FILE *amzfile,
 			const char *fname)
 {
-  char *inbuf;
-  unsigned char *xml;
-  size_t sz;
   clamz_playlist *pl;
+  FILE *backup = NULL;
   int i;
   int status, rv = 0;
+  int *statuses;
   char *logname;
   FILE *logfile;
 
-  sz = 0;
-  inbuf = NULL;
-
-  while (!feof(amzfile) && !ferror(amzfile)) {
-    if (inbuf)
-      inbuf = realloc(inbuf, (sz + 1024) * sizeof(char));
-    else
-      inbuf = malloc((sz + 1024) * sizeof(char));
-    sz += fread(&inbuf[sz], 1, 1024, amzfile);
+  if (!cfg->printonly) {
+    backup = open_backup_file(getbasename(fname));
+    if (!backup) {
+      if (amzfile != stdin)
+	fclose(amzfile);
+      return 3;
+    }
   }
 
-  if (amzfile != stdin)
-    fclose(amzfile);
-
   if (cfg->printonly && cfg->printasxml) {
-    xml = decrypt_amz_file(inbuf, sz, fname);
-    if (!xml) {
-      free(inbuf);
-      return 2;
-    }
-
-    printf("%s", xml);
-    free(xml);
-    free(inbuf);
-    return 0;
+    status = read_amz_file(NULL, stdout, fileno(amzfile), NULL, fname);
+    if (amzfile != stdin)
+      fclose(amzfile);
+    return (status ? 2 : 0);
   }
   else {
-    if (!cfg->printonly) {
-      if (write_backup_file(inbuf, sz, getbasename(fname))) {
-        free(inbuf);
-        return 3;
-      }
-    }
-
     pl = new_playlist();
 
-    if (read_amz_file(pl, inbuf, sz, fname)) {
-      free(inbuf);
+    status = read_amz_file(pl, NULL, fileno(amzfile), backup, fname);
+    if (amzfile != stdin)
+      fclose(amzfile);
+
+    if (backup && close_backup_file(backup, getbasename(fname), !status)
+	&& !status) {
+      free_playlist(pl);
+      return 3;
+    }
+
+    if (status) {
       free_playlist(pl);
       return 2;
     }
@@ -166,7 +171,7 @@ static int run_amz_file(clamz_downloader *dl,
     if (!cfg->printonly) {
       logname = get_config_file_name("logs", getbasename(fname), ".log");
       if (!logname) {
-        free(inbuf);
+        free_playlist(pl);
 	return 1;
       }
 
@@ -174,7 +179,7 @@ static int run_amz_file(clamz_downloader *dl,
       if (!logfile) {
 	perror(logname);
 	free(logname);
-        free(inbuf);
+        free_playlist(pl);
 	return 3;
       }
 
@@ -188,19 +193,38 @@ static int run_amz_file(clamz_downloader *dl,
     if (cfg->printonly || cfg->verbose)
       print_pl_info(pl, fname);
 
-    for (i = 0; i < pl->num_tracks; i++) {
-      if (cfg->printonly || cfg->verbose)
+    if (cfg->printonly) {
+      for (i = 0; i < pl->num_tracks; i++) {
         print_tr_info(pl->tracks[i], i + 1);
 
-      status = download_track(dl, pl->tracks[i]);
-      if (!rv)
-        rv = status;
-      fputc('\n', stderr);
+        status = download_track(dl, pl->tracks[i]);
+        if (!rv)
+          rv = status;
+        fputc('\n', stderr);
+      }
+    }
+    else if (pl->num_tracks > 0) {
+      /* tracks which fail are retried later, while the rest of the
+         playlist carries on */
+      if (cfg->verbose)
+        for (i = 0; i < pl->num_tracks; i++)
+          print_tr_info(pl->tracks[i], i + 1);
+
+      statuses = malloc(pl->num_tracks * sizeof(int));
+      if (!statuses) {
+        print_error("Out of memory");
+        rv = 1;
+      }
+      else {
+        rv = download_tracks(dl, pl->tracks, pl->num_tracks, statuses);
+        free(statuses);
+      }
+      if (!cfg->quiet)
+        fputc('\n', stderr);
     }
 
     set_download_log_file(dl, NULL);
 
-    free(inbuf);
     free_playlist(pl);
     if (logfile)
       fclose(logfile);
@@ -208,6 +232,235 @@ static int run_amz_file(clamz_downloader *dl,
   }
 }
 
+static volatile sig_atomic_t stop_watching;
+
+static void handle_stop_signal(int sig UNUSED)
+{
+  stop_watching = 1;
+}
+
+/* Check whether a file name looks like an AMZ file */
+static int is_amz_file_name(const char *name)
+{
+  size_t n = strlen(name);
+
+  return (n > 4 && !strcasecmp(name + n - 4, ".amz"));
+}
+
+static int is_amz_file(const struct dirent *ent)
+{
+  return is_amz_file_name(ent->d_name);
+}
+
+/* Move a file from the watched directory into one of its
+   subdirectories.  If a file of the same name is already there, it is
+   kept, and a number is added to the new file's name (before the
+   ".amz" suffix.) */
+static void move_watched_file(const clamz_config *cfg, const char *path,
+			      const char *name, const char *subdir)
+{
+  size_t len = strlen(name);
+  char *dest;
+  int i, status = -1;
+
+  dest = malloc(strlen(cfg->watch_dir) + strlen(subdir) + len + 16);
+  if (!dest) {
+    print_error("Out of memory");
+    return;
+  }
+
+  for (i = 0; i < 1000 && status; i++) {
+    if (i == 0)
+      sprintf(dest, "%s/%s/%s", cfg->watch_dir, subdir, name);
+    else
+      sprintf(dest, "%s/%s/%.*s-%d%s", cfg->watch_dir, subdir,
+	      (int) (len - 4), name, i, name + len - 4);
+
+    /* link() never replaces an existing file, unlike rename(); if
+       the filesystem doesn't support links, check first instead */
+    if (!link(path, dest)) {
+      if (unlink(path))
+	print_error("Unable to remove \"%s\": %s", path, strerror(errno));
+      status = 0;
+    }
+    else if (errno == EEXIST)
+      continue;
+    else if (errno != EPERM && errno != EMLINK && errno != ENOSYS
+	     && errno != EOPNOTSUPP)
+      break;
+    else if (!access(dest, F_OK))
+      continue;
+    else if (rename(path, dest))
+      break;
+    else
+      status = 0;
+  }
+
+  if (status) {
+    if (i >= 1000)
+      errno = EEXIST;
+    print_error("Unable to move \"%s\" to \"%s\": %s", path, dest,
+		strerror(errno));
+  }
+  free(dest);
+}
+
+/* Process a file from the watched directory, then move it into the
+   done or failed subdirectory.  N and TOTAL count the files which
+   were successful and which were processed. */
+static void run_watched_file(clamz_downloader *dl,
+			     const clamz_config *cfg,
+			     const char *name, int *n, int *total)
+{
+  char *path;
+  struct stat st;
+  FILE *amzfile;
+  int err;
+
+  path = malloc(strlen(cfg->watch_dir) + strlen(name) + 2);
+  if (!path) {
+    print_error("Out of memory");
+    return;
+  }
+
+  sprintf(path, "%s/%s", cfg->watch_dir, name);
+
+  /* ignore files that have already been moved, and directories */
+  if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+    free(path);
+    return;
+  }
+
+  amzfile = fopen(path, "rb");
+  if (!amzfile) {
+    perror(path);
+    err = 2;
+  }
+  else {
+    if (!cfg->quiet)
+      fprintf(stderr, "Processing \"%s\"\n", path);
+    err = run_amz_file(dl, cfg, amzfile, path);
+  }
+
+  (*total)++;
+  if (!err)
+    (*n)++;
+
+  move_watched_file(cfg, path, name, (err ? "failed" : "done"));
+  free(path);
+}
+
+/* Process every AMZ file currently in the watched directory */
+static void scan_watched_dir(clamz_downloader *dl, const clamz_config *cfg,
+			     int *n, int *total)
+{
+  struct dirent **ents;
+  int i, nents;
+
+  nents = scandir(cfg->watch_dir, &ents, &is_amz_file, &alphasort);
+  if (nents < 0) {
+    print_error("Unable to read %s: %s", cfg->watch_dir, strerror(errno));
+    return;
+  }
+
+  for (i = 0; i < nents; i++) {
+    if (!stop_watching)
+      run_watched_file(dl, cfg, ents[i]->d_name, n, total);
+    free(ents[i]);
+  }
+  free(ents);
+}
+
+/* Process AMZ files as they are added to cfg->watch_dir, until
+   interrupted.  N and TOTAL count the files which were successful
+   and which were processed. */
+static int watch_amz_dir(clamz_downloader *dl, const clamz_config *cfg,
+			 int *n, int *total)
+{
+  struct sigaction sa;
+  char *s;
+  int i;
+#ifdef HAVE_SYS_INOTIFY_H
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  char *p;
+  ssize_t len;
+  int fd;
+#endif
+
+  s = malloc(strlen(cfg->watch_dir) + 8);
+  if (!s) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  for (i = 0; i < 2; i++) {
+    sprintf(s, "%s/%s", cfg->watch_dir, (i ? "failed" : "done"));
+    if (mkdir(s, 0777) && errno != EEXIST) {
+      print_error("Cannot create directory %s: %s", s, strerror(errno));
+      free(s);
+      return 1;
+    }
+  }
+  free(s);
+
+#ifdef HAVE_SYS_INOTIFY_H
+  fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, cfg->watch_dir,
+				  IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    print_error("Unable to watch %s: %s", cfg->watch_dir, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+#endif
+
+  /* finish the current file before stopping */
+  sa.sa_handler = &handle_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (!cfg->quiet)
+    fprintf(stderr, "Watching \"%s\" for AMZ files\n", cfg->watch_dir);
+
+  /* pick up any files added before we started */
+  scan_watched_dir(dl, cfg, n, total);
+
+  while (!stop_watching) {
+#ifdef HAVE_SYS_INOTIFY_H
+    /* a file is only processed once it has been completely written
+       (or moved into place) */
+    len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0) {
+      print_error("Unable to watch %s: %s", cfg->watch_dir, strerror(errno));
+      break;
+    }
+
+    for (p = buf; p < buf + len && !stop_watching;
+	 p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event *) p;
+      if (ev->mask & IN_Q_OVERFLOW)
+	scan_watched_dir(dl, cfg, n, total);
+      else if (ev->len && !(ev->mask & IN_ISDIR)
+	       && is_amz_file_name(ev->name))
+	run_watched_file(dl, cfg, ev->name, n, total);
+    }
+#else
+    sleep(WATCH_INTERVAL);
+    scan_watched_dir(dl, cfg, n, total);
+#endif
+  }
+
+#ifdef HAVE_SYS_INOTIFY_H
+  close(fd);
+#endif
+  return 0;
+}
+
 /* Parse XDG user-dirs configuration file and set environment
    variables (XDG_DESKTOP_DIR, XDG_MUSIC_DIR, etc.) */
 static void set_xdg_user_dirs()
@@ -304,19 +557,31 @@ int main(int argc, char **argv)
   char buf[256];
   FILE *amzfile;
   int err = 0;
-  int i, n = 0;
+  int i, n = 0, total;
   char *str;
 
   cfg.output_dir = cfg.name_format = cfg.forbid_chars = NULL;
+  cfg.watch_dir = NULL;
+  cfg.metrics_file = NULL;
+  cfg.metrics_textfile = NULL;
   cfg.allowupper = cfg.allowutf8 = cfg.printonly = cfg.printasxml = 0;
-  cfg.verbose = cfg.quiet = cfg.resume = 0;
+  cfg.verbose = cfg.quiet = cfg.resume = cfg.direct_io = 0;
+  cfg.redownload = cfg.tag = 0;
+  cfg.save_cover = cfg.embed_cover = 0;
   cfg.maxattempts = 5;
+  cfg.jobs = 1;
+  cfg.segments = 1;
+  cfg.order = ORDER_PLAYLIST;
+  cfg.rate_limit = cfg.host_rate_limit = cfg.track_rate_limit = 0;
+  cfg.buffer_size = 1024 * 1024;
 
   /* Disable secure memory; we don't need it. */
   gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
   gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 
   setlocale(LC_ALL, "");
+  /* numbers in metrics files must be written the same way everywhere */
+  setlocale(LC_NUMERIC, "C");
   str = nl_langinfo(CODESET);
   if (!strcasecmp(str, "UTF-8") || !strcasecmp(str, "UTF8"))
     utf8locale = cfg.utf8locale = 1;
@@ -329,6 +594,9 @@ int main(int argc, char **argv)
     if (cfg.output_dir) free(cfg.output_dir);
     if (cfg.name_format) free(cfg.name_format);
     if (cfg.forbid_chars) free(cfg.forbid_chars);
+    if (cfg.watch_dir) free(cfg.watch_dir);
+    if (cfg.metrics_file) free(cfg.metrics_file);
+    if (cfg.metrics_textfile) free(cfg.metrics_textfile);
     return 1;
   }
 
@@ -359,6 +627,14 @@ int main(int argc, char **argv)
     else
       n++;
   }
+  total = argc - 1;
+
+  /* keep running, with the same downloader, as new files arrive */
+  if (cfg.watch_dir && !err)
+    err = watch_amz_dir(dl, &cfg, &n, &total);
+
+  if (cfg.verbose && !cfg.printonly)
+    print_download_stats(dl);
 
   free_downloader(dl);
 
@@ -368,10 +644,13 @@ int main(int argc, char **argv)
   if (cfg.output_dir) free(cfg.output_dir);
   if (cfg.name_format) free(cfg.name_format);
   if (cfg.forbid_chars) free(cfg.forbid_chars);
+  if (cfg.watch_dir) free(cfg.watch_dir);
+  if (cfg.metrics_file) free(cfg.metrics_file);
+  if (cfg.metrics_textfile) free(cfg.metrics_textfile);
 
   if (!cfg.quiet && !cfg.printonly)
     fprintf(stderr, "%d of %d AMZ files downloaded successfully.\n",
-	    n, argc - 1);
+	    n, total);
 
   return err;
 }
@@ -383,6 +662,7 @@ void print_error(const char *message, ...)
   char *p, *q, *r;
   va_list ap;
 
+  clear_progress();
   fprintf(stderr, "\rERROR: ");
 
   va_start(ap, message);
@@ -423,50 +703,189 @@ void print_error(const char *message, ...)
   fputc('\n', stderr);
 }
 
-void print_progress(const clamz_track *tr, const char *filename,
-		    int progress)
+/* Lines of progress display below the cursor */
+static int progress_lines;
+
+/* Erase the progress display (before printing a message) */
+void clear_progress(void)
 {
-  int i, j;
-  const char *name;
+  if (progress_lines) {
+    fputs("\r\033[J", stderr);
+    progress_lines = 0;
+  }
+}
+
+void print_message(const char *message, ...)
+{
+  va_list ap;
+
+  clear_progress();
+
+  va_start(ap, message);
+  vfprintf(stderr, message, ap);
+  va_end(ap);
+}
 
-  fputc('\r', stderr);
+/* Copy the name of a track to BUF, truncated or padded to WIDTH
+   characters */
+static char *format_name(char *buf, const clamz_track *tr,
+			 const char *filename, int width)
+{
+  int i, j, k;
+  const char *name;
 
   if (tr->title)
     name = tr->title;
   else
     name = filename;
 
-  for (i = j = 0; i < 32 && name[j]; i++) {
+  for (i = j = 0; i < width && name[j]; i++) {
     if ((unsigned char) name[j] & 0x80) {
       if (!utf8locale)
-	fputc('?', stderr);
+	*buf++ = '?';
 
+      k = 0;
       do {
-	if (utf8locale)
-	  fputc(name[j], stderr);
+	if (utf8locale && k++ < 4)
+	  *buf++ = name[j];
 	j++;
       } while (((unsigned char) name[j] & 0xc0) == 0x80);
     }
     else {
-      fputc(name[j], stderr);
+      *buf++ = name[j];
       j++;
     }
   }
 
-  for (; i < 32; i++)
-    fputc(' ', stderr);
+  for (; i < width; i++)
+    *buf++ = ' ';
+
+  return buf;
+}
+
+/* Format a number of bytes, using the same suffixes as --limit-rate */
+static char *format_size(char *buf, double n)
+{
+  if (n < 1024)
+    buf += sprintf(buf, "%.0f", n);
+  else if (n < 1024 * 1024)
+    buf += sprintf(buf, "%.1fK", n / 1024);
+  else if (n < 1024 * 1024 * 1024)
+    buf += sprintf(buf, "%.1fM", n / (1024 * 1024));
+  else
+    buf += sprintf(buf, "%.1fG", n / (1024 * 1024 * 1024));
+  return buf;
+}
+
+/* Format an estimated time remaining */
+static char *format_eta(char *buf, double have, double size, double rate)
+{
+  long s;
+
+  if (size <= 0 || rate <= 0 || (size - have) / rate >= 100 * 3600)
+    return buf + sprintf(buf, "--:--");
+
+  s = (long) ((size - have) / rate + 0.5);
+  if (s >= 3600)
+    return buf + sprintf(buf, "%ld:%02ld:%02ld",
+			 s / 3600, (s / 60) % 60, s % 60);
+  else
+    return buf + sprintf(buf, "%ld:%02ld", s / 60, s % 60);
+}
+
+/* Display progress of the tracks currently being downloaded.  On a
+   terminal, the whole display is redrawn, in a single write, each
+   time this is called; otherwise, a one-line summary is printed. */
+void print_progress(const clamz_progress *tracks, int n, int finished,
+		    int total, double received, double total_size,
+		    double rate)
+{
+  static int tty = -1;
+  const clamz_progress *pr;
+  char *buf, *p;
+  int i, lines, progress;
+
+  if (tty < 0)
+    tty = isatty(STDERR_FILENO);
+
+  buf = malloc((n + 2) * PROGRESS_LINE_SIZE);
+  if (!buf)
+    return;
+  p = buf;
+
+  if (!tty) {
+    p += sprintf(p, "Progress: %d of %d tracks finished, %d in progress, ",
+		 finished, total, n);
+    p = format_size(p, received);
+    if (total_size > 0) {
+      p += sprintf(p, " of ");
+      p = format_size(p, total_size);
+    }
+    p += sprintf(p, " received, ");
+    p = format_size(p, rate);
+    p += sprintf(p, "/s");
+    if (total_size > 0) {
+      p += sprintf(p, ", ");
+      p = format_eta(p, received, total_size, rate);
+      p += sprintf(p, " left");
+    }
+    p += sprintf(p, "\n");
+    fwrite(buf, 1, p - buf, stderr);
+    free(buf);
+    return;
+  }
+
+  lines = 0;
+  for (i = 0; i < n; i++) {
+    pr = &tracks[i];
+    *p++ = '\r';
+    p = format_name(p, pr->track, pr->filename, 28);
+
+    if (pr->size > 0) {
+      progress = (int) (100 * pr->have / pr->size);
+      if (progress > 100)
+	progress = 100;
+      p += sprintf(p, "  [%-20.*s] %3d%%  ",
+		   progress / 5, "####################", progress);
+    }
+    else {
+      p += sprintf(p, "  ...%24s", "");
+    }
 
-  if (progress >= 0) {
-    fputs("  [", stderr);
-    for (i = 0; i < (progress / 3); i++)
-      fputc('#', stderr);
-    for (; i < 33; i++)
-      fputc(' ', stderr);
-    fprintf(stderr, "]  %2d%% ", progress);
+    p = format_size(p, pr->rate);
+    p += sprintf(p, "/s  ");
+    p = format_eta(p, pr->have, pr->size, pr->rate);
+    p += sprintf(p, "\033[K\n");
+    lines++;
   }
-  else {
-    fprintf(stderr, "  ...");
+
+  if (total > 1) {
+    p += sprintf(p, "\r  %d of %d tracks finished, ", finished, total);
+    p = format_size(p, received);
+    if (total_size > 0) {
+      p += sprintf(p, " of ");
+      p = format_size(p, total_size);
+    }
+    p += sprintf(p, " received, ");
+    p = format_size(p, rate);
+    p += sprintf(p, "/s");
+    if (total_size > 0) {
+      p += sprintf(p, ", ");
+      p = format_eta(p, received, total_size, rate);
+      p += sprintf(p, " left");
+    }
+    p += sprintf(p, "\033[K\n");
+    lines++;
   }
 
+  /* erase anything left over from a larger frame, then return to the
+     top, so that messages are printed in place of the display */
+  p += sprintf(p, "\033[J");
+  if (lines)
+    p += sprintf(p, "\033[%dA", lines);
+
+  fwrite(buf, 1, p - buf, stderr);
   fflush(stderr);
+  free(buf);
+  progress_lines = lines;
 }
@@ -24,29 +24,51 @@
 # define PRINTF_ARG(n,m)
 #endif
 
-/* Known playlist metadata URNs */
+/* Known metadata URNs.  Each of these is stored in a fixed slot of
+   clamz_meta; meta_urn() gives the URN for a slot. */
 
-#define PMETA_ASIN         "http://www.amazon.com/dmusic/ASIN"
-#define PMETA_GENRE        "http://www.amazon.com/dmusic/primaryGenre"
+enum {
+  TMETA_ALBUM_ARTIST,		/* .../dmusic/albumPrimaryArtist */
+  TMETA_ALBUM_ASIN,		/* .../dmusic/albumASIN */
+  TMETA_ASIN,			/* .../dmusic/ASIN */
+  TMETA_DISC_NUM,		/* .../dmusic/discNum */
+  TMETA_FILE_SIZE,		/* .../dmusic/fileSize */
+  TMETA_GENRE,			/* .../dmusic/primaryGenre */
+  TMETA_PRODUCT_TYPE,		/* .../dmusic/productTypeName */
+  TMETA_TRACK_TYPE,		/* .../dmusic/trackType */
+  NUM_META_SLOTS
+};
 
-/* Track metadata URNs */
+/* Known playlist metadata URNs (the same URNs as for tracks) */
 
-#define TMETA_ALBUM_ARTIST "http://www.amazon.com/dmusic/albumPrimaryArtist"
-#define TMETA_ALBUM_ASIN   "http://www.amazon.com/dmusic/albumASIN"
-#define TMETA_ASIN         "http://www.amazon.com/dmusic/ASIN"
-#define TMETA_DISC_NUM     "http://www.amazon.com/dmusic/discNum"
-#define TMETA_FILE_SIZE    "http://www.amazon.com/dmusic/fileSize"
-#define TMETA_GENRE        "http://www.amazon.com/dmusic/primaryGenre"
-#define TMETA_PRODUCT_TYPE "http://www.amazon.com/dmusic/productTypeName"
-#define TMETA_TRACK_TYPE   "http://www.amazon.com/dmusic/trackType"
+#define PMETA_ASIN         TMETA_ASIN
+#define PMETA_GENRE        TMETA_GENRE
 
+/* Order in which tracks are downloaded (--order) */
 
+#define ORDER_PLAYLIST 0	/* as listed in the amz file */
+#define ORDER_SHORTEST 1	/* smallest file first */
+#define ORDER_LARGEST  2	/* largest file first */
+
+/* Limits of the amount of data buffered for each connection
+   (--buffer-size), other than zero */
+
+#define MIN_BUFFER_SIZE 4096	/* alignment required for O_DIRECT */
+#define MAX_BUFFER_SIZE (64L * 1024 * 1024)
+
+
+/* Metadata with URNs other than the known ones */
 typedef struct _clamz_meta_list {
-  char *urn;
+  const char *urn;		/* shared by all tags with the same URN */
   char *value;
   struct _clamz_meta_list *next;
 } clamz_meta_list;
 
+typedef struct _clamz_meta {
+  char *value[NUM_META_SLOTS];	/* known URNs (NULL if not present) */
+  clamz_meta_list *extra;	/* other URNs, in the order found */
+} clamz_meta;
+
 typedef struct _clamz_track {
   struct _clamz_playlist *playlist;
 
@@ -57,14 +79,18 @@ typedef struct _clamz_track {
   char *image_name;
   char *duration;
   char *trackNum;
-  clamz_meta_list *meta;
+  clamz_meta meta;
 } clamz_track;
 
+typedef struct _clamz_arena clamz_arena;
+
 typedef struct _clamz_playlist {
+  clamz_arena *arena;		/* memory used by the playlist */
+
   char *title;
   char *creator;
   char *image_name;
-  clamz_meta_list *meta;
+  clamz_meta meta;
 
   int num_tracks;
   clamz_track **tracks;
@@ -74,6 +100,9 @@ typedef struct _clamz_config {
   char *output_dir;
   char *name_format;
   char *forbid_chars;
+  char *watch_dir;
+  char *metrics_file;
+  char *metrics_textfile;
   unsigned allowupper : 1;
   unsigned allowutf8 : 1;
   unsigned utf8locale : 1;
@@ -82,39 +111,104 @@ typedef struct _clamz_config {
   unsigned verbose : 1;
   unsigned quiet : 1;
   unsigned resume : 1;
+  unsigned direct_io : 1;
+  unsigned redownload : 1;
+  unsigned tag : 1;
+  unsigned save_cover : 1;
+  unsigned embed_cover : 1;
   int maxattempts;
+  int jobs;
+  int segments;
+  int order;
+  long rate_limit;
+  long host_rate_limit;
+  long track_rate_limit;
+  long buffer_size;
 } clamz_config;
 
 typedef struct _clamz_downloader clamz_downloader;
+typedef struct _clamz_library clamz_library;
+
+typedef struct _clamz_progress {
+  const clamz_track *track;
+  const char *filename;
+  double have;			/* bytes received */
+  double size;			/* total size, or -1 if unknown */
+  double rate;			/* bytes per second */
+} clamz_progress;
+
+/* State of a base64 decoder */
+typedef struct _clamz_base64 {
+  unsigned long bits;
+  int nch;
+} clamz_base64;
+
+/* Space needed for the output of base64_decode() */
+#define BASE64_DECODED_SIZE(n) (((n) * 3 + 3) / 4 + 32)
+
+/* base64.c */
+int base64_use(const char *name);
+void base64_start(clamz_base64 *b64);
+long base64_decode(clamz_base64 *b64, unsigned char *out, const char *in,
+		   size_t len);
+
+/* State of an AMZ file being decrypted */
+typedef struct _clamz_decryptor clamz_decryptor;
+
+/* decrypt.c */
+clamz_decryptor *new_decryptor(int threads);
+void free_decryptor(clamz_decryptor *dec);
+const char *decryptor_error(const clamz_decryptor *dec);
+int decryptor_run(clamz_decryptor *dec, unsigned char *data, size_t len);
 
 /* playlist.c */
 int concatenate(char **str, const char *add, int len);
 clamz_playlist *new_playlist();
 void free_playlist(clamz_playlist *pl);
-const char *find_meta(const clamz_meta_list *meta, const char *urn);
-unsigned char *decrypt_amz_file(const char *b64data,
-                                unsigned long b64len, const char *fname);
-int read_amz_file(clamz_playlist *pl, const char *b64data,
-		  unsigned long b64len, const char *fname);
-int write_backup_file(const char *b64data, unsigned long b64len,
-		      const char *fname);
+const char *meta_urn(int slot);
+int read_amz_file(clamz_playlist *pl, FILE *xmlfile, int fd, FILE *backup,
+		  const char *fname);
+FILE *open_backup_file(const char *fname);
+int close_backup_file(FILE *f, const char *fname, int keep);
 
 /* options.c */
 char *get_config_file_name(const char *subdir, const char *name,
 			   const char *suffix);
+int parse_size(const char *s, long *value);
 int parse_args(int *argc, char **argv, clamz_config *cfg);
 
 /* vars.c */
 int expand_file_name(const clamz_config *cfg, const clamz_track *tr,
 		     char **filename, const char *format);
 
+/* library.c */
+clamz_library *open_library();
+void close_library(clamz_library *lib);
+int find_library_track(const clamz_library *lib, const char *asin,
+		       const char **filename, long long *size);
+int add_library_track(clamz_library *lib, const char *asin,
+		      const char *filename, long long size,
+		      const unsigned char *digest);
+int save_library(clamz_library *lib);
+
+/* tags.c */
+int write_track_tag(const clamz_track *tr, const char *filename,
+		    const char *image, size_t image_len,
+		    unsigned char *digest);
+
 /* download.c */
 clamz_downloader *new_downloader(const clamz_config *cfg);
 void free_downloader(clamz_downloader *dl);
 void set_download_log_file(clamz_downloader *dl, FILE *log);
 int download_track(clamz_downloader *dl, clamz_track *tr);
+int download_tracks(clamz_downloader *dl, clamz_track **tracks, int n,
+		    int *status);
+void print_download_stats(const clamz_downloader *dl);
 
 /* clamz.c */
 void print_error(const char *message, ...) PRINTF_ARG(1, 2);
-void print_progress(const clamz_track *tr, const char *filename,
-		    int progress);
+void print_message(const char *message, ...) PRINTF_ARG(1, 2);
+void clear_progress(void);
+void print_progress(const clamz_progress *tracks, int n, int finished,
+		    int total, double received, double total_size,
+		    double rate);
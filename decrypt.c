@@ -0,0 +1,303 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2011 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Decryption of encrypted AMZ files.  These use DES in CBC mode, in
+   which each block of plaintext depends only on its own ciphertext
+   block and the one before it.  So a large piece of ciphertext can be
+   split into chunks, each decrypted by a separate thread, with the
+   last ciphertext block of the previous chunk as its IV.  The threads
+   are kept for as long as the file is being read. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include <gcrypt.h>
+
+#include "clamz.h"
+
+/* Smallest amount of data worth giving to a thread */
+#define CHUNK_MIN_SIZE 65536
+
+/* Most threads to use for one piece of data */
+#define MAX_THREADS 8
+
+static const unsigned char key[8] = { 0x29, 0xAB, 0x9D, 0x18,
+				      0xB2, 0x44, 0x9E, 0x31 };
+static const unsigned char initv[8] = { 0x5E, 0x72, 0xD7, 0x9A,
+					0x11, 0xB3, 0x4F, 0xEE };
+
+/* Open a cipher handle with the AMZ key */
+static gcry_error_t open_cipher(gcry_cipher_hd_t *hd)
+{
+  gcry_error_t err;
+
+  if ((err = gcry_cipher_open(hd, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0)))
+    return err;
+
+  if ((err = gcry_cipher_setkey(*hd, key, 8))) {
+    gcry_cipher_close(*hd);
+    return err;
+  }
+
+  return 0;
+}
+
+/* Decrypt data in place, starting from the given IV */
+static gcry_error_t decrypt_chunk(gcry_cipher_hd_t hd, unsigned char *data,
+				  size_t len, const unsigned char *iv)
+{
+  gcry_error_t err;
+
+  if ((err = gcry_cipher_setiv(hd, iv, 8)))
+    return err;
+  return gcry_cipher_decrypt(hd, data, len, NULL, 0);
+}
+
+/* State of an AMZ file being decrypted */
+struct _clamz_decryptor {
+  gcry_cipher_hd_t hd;
+  unsigned char iv[8];		/* IV for the next piece of data */
+  int threads;
+  gcry_error_t err;
+
+#ifdef HAVE_PTHREAD
+  /* worker threads, started when first needed, each of which
+     decrypts one chunk of each piece, using its own cipher handle */
+  struct worker {
+    clamz_decryptor *dec;
+    pthread_t thread;
+    gcry_cipher_hd_t hd;
+    unsigned char *data;
+    size_t len;
+    unsigned char iv[8];
+    gcry_error_t err;
+    int busy;			/* chunk given but not yet decrypted */
+  } workers[MAX_THREADS - 1];
+  int num_workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;	/* signalled when chunks are given out */
+  pthread_cond_t done_cond;	/* signalled when all chunks are done */
+  int pending;			/* number of chunks not yet decrypted */
+  int quit;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+
+static void *run_worker(void *data)
+{
+  struct worker *w = data;
+  clamz_decryptor *dec = w->dec;
+
+  pthread_mutex_lock(&dec->lock);
+  for (;;) {
+    while (!w->busy && !dec->quit)
+      pthread_cond_wait(&dec->work_cond, &dec->lock);
+    if (!w->busy)
+      break;
+
+    pthread_mutex_unlock(&dec->lock);
+    w->err = decrypt_chunk(w->hd, w->data, w->len, w->iv);
+    pthread_mutex_lock(&dec->lock);
+
+    w->busy = 0;
+    if (--dec->pending == 0)
+      pthread_cond_signal(&dec->done_cond);
+  }
+  pthread_mutex_unlock(&dec->lock);
+  return NULL;
+}
+
+/* Start worker threads, so that there are (if possible) N in all */
+static void start_workers(clamz_decryptor *dec, int n)
+{
+  struct worker *w;
+
+  while (dec->num_workers < n) {
+    w = &dec->workers[dec->num_workers];
+    w->dec = dec;
+    w->busy = 0;
+    if (open_cipher(&w->hd))
+      return;
+    if (pthread_create(&w->thread, NULL, &run_worker, w)) {
+      gcry_cipher_close(w->hd);
+      return;
+    }
+    dec->num_workers++;
+  }
+}
+
+/* Stop all worker threads */
+static void stop_workers(clamz_decryptor *dec)
+{
+  int i;
+
+  pthread_mutex_lock(&dec->lock);
+  dec->quit = 1;
+  pthread_cond_broadcast(&dec->work_cond);
+  pthread_mutex_unlock(&dec->lock);
+
+  for (i = 0; i < dec->num_workers; i++) {
+    pthread_join(dec->workers[i].thread, NULL);
+    gcry_cipher_close(dec->workers[i].hd);
+  }
+  dec->num_workers = 0;
+}
+
+/* Decrypt a piece of data, splitting it between this thread and
+   NTHREADS - 1 workers */
+static gcry_error_t decrypt_parallel(clamz_decryptor *dec,
+				     unsigned char *data, size_t len,
+				     int nthreads)
+{
+  struct worker *w;
+  size_t size;
+  gcry_error_t err;
+  int i;
+
+  size = (len / nthreads) & ~(size_t) 7;
+
+  /* every IV must be copied before any of the data is decrypted */
+  pthread_mutex_lock(&dec->lock);
+  for (i = 1; i < nthreads; i++) {
+    w = &dec->workers[i - 1];
+    w->data = data + i * size;
+    w->len = (i == nthreads - 1 ? len - i * size : size);
+    memcpy(w->iv, w->data - 8, 8);
+    w->err = 0;
+    w->busy = 1;
+  }
+  dec->pending = nthreads - 1;
+  pthread_cond_broadcast(&dec->work_cond);
+  pthread_mutex_unlock(&dec->lock);
+
+  /* the first chunk is decrypted by this thread */
+  err = decrypt_chunk(dec->hd, data, size, dec->iv);
+
+  pthread_mutex_lock(&dec->lock);
+  while (dec->pending)
+    pthread_cond_wait(&dec->done_cond, &dec->lock);
+  pthread_mutex_unlock(&dec->lock);
+
+  for (i = 1; i < nthreads && !err; i++)
+    err = dec->workers[i - 1].err;
+  return err;
+}
+
+#endif /* HAVE_PTHREAD */
+
+/* Begin decrypting a new AMZ file, using up to THREADS threads (or,
+   if THREADS is zero, one for each CPU.)  Returns NULL if out of
+   memory; other errors are reported by decryptor_error(). */
+clamz_decryptor *new_decryptor(int threads)
+{
+  clamz_decryptor *dec;
+  long n;
+
+  dec = malloc(sizeof(clamz_decryptor));
+  if (!dec)
+    return NULL;
+
+  if (threads < 1) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (n > 0 ? n : 1);
+  }
+  dec->threads = (threads < MAX_THREADS ? threads : MAX_THREADS);
+  memcpy(dec->iv, initv, 8);
+
+#ifdef HAVE_PTHREAD
+  dec->num_workers = 0;
+  dec->pending = 0;
+  dec->quit = 0;
+  pthread_mutex_init(&dec->lock, NULL);
+  pthread_cond_init(&dec->work_cond, NULL);
+  pthread_cond_init(&dec->done_cond, NULL);
+#endif
+
+  if ((dec->err = open_cipher(&dec->hd)))
+    dec->hd = NULL;
+  return dec;
+}
+
+void free_decryptor(clamz_decryptor *dec)
+{
+#ifdef HAVE_PTHREAD
+  stop_workers(dec);
+  pthread_mutex_destroy(&dec->lock);
+  pthread_cond_destroy(&dec->work_cond);
+  pthread_cond_destroy(&dec->done_cond);
+#endif
+
+  if (dec->hd)
+    gcry_cipher_close(dec->hd);
+  free(dec);
+}
+
+/* Description of the first error that occurred, or NULL if none */
+const char *decryptor_error(const clamz_decryptor *dec)
+{
+  return (dec->err ? gcry_strerror(dec->err) : NULL);
+}
+
+/* Decrypt the next piece of an AMZ file, in place.  LEN must be a
+   multiple of 8.  Returns nonzero if an error occurs. */
+int decryptor_run(clamz_decryptor *dec, unsigned char *data, size_t len)
+{
+  unsigned char next_iv[8];
+  gcry_error_t err;
+  int nthreads = dec->threads;
+
+  if (dec->err)
+    return 1;
+  if (len < 8)
+    return 0;
+
+  /* the last block of ciphertext is the IV for the next piece */
+  memcpy(next_iv, data + len - 8, 8);
+
+  if ((size_t) nthreads > len / CHUNK_MIN_SIZE)
+    nthreads = len / CHUNK_MIN_SIZE;
+
+#ifdef HAVE_PTHREAD
+  if (nthreads > 1) {
+    start_workers(dec, nthreads - 1);
+    if (nthreads > dec->num_workers + 1)
+      nthreads = dec->num_workers + 1;
+  }
+
+  if (nthreads > 1)
+    err = decrypt_parallel(dec, data, len, nthreads);
+  else
+#endif /* HAVE_PTHREAD */
+    err = decrypt_chunk(dec->hd, data, len, dec->iv);
+
+  memcpy(dec->iv, next_iv, 8);
+  dec->err = err;
+  return (err != 0);
+}
@@ -20,85 +20,525 @@
 # include <config.h>
 #endif
 
+/* for O_DIRECT and fallocate */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
 #include <sys/stat.h>
 
+#if defined(HAVE_SYS_STATVFS_H) && defined(HAVE_STATVFS)
+# define USE_STATVFS
+# include <sys/statvfs.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+# define USE_EPOLL
+# include <stdint.h>
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+#endif
+
 #include <curl/curl.h>
+#include <gcrypt.h>
 
 #include "clamz.h"
 
-struct _clamz_downloader {
-  const clamz_config *cfg;
+/* Delay (in seconds) before retrying a failed transfer, which is
+   doubled after each failure up to a maximum */
+#define RETRY_DELAY 2
+#define RETRY_MAX_DELAY 60
+
+/* Size of the blocks tracked in the completed-range map of a
+   segmented transfer */
+#define MAP_BLOCK_SIZE ((curl_off_t) 1 << 20)
+
+/* How often (in seconds) to reconsider splitting a segmented transfer,
+   and the minimum amount of time (at the current per-connection rate)
+   that a new segment must be worth */
+#define SPLIT_INTERVAL 0.5
+#define SPLIT_MIN_TIME 1.0
+
+/* How often (in seconds) to sync the output file and save the
+   journal of a transfer (which is done by an I/O thread) */
+#define JOURNAL_INTERVAL 1.0
+
+/* How often (in seconds) to redraw the progress display on a
+   terminal, or to print a summary otherwise, and the time over which
+   transfer rates are averaged */
+#define PROGRESS_INTERVAL 0.1
+#define PROGRESS_LOG_INTERVAL 10.0
+#define PROGRESS_SMOOTHING 1.0
+
+/* Amount of existing data to download again, and compare with the
+   output file, when resuming a transfer */
+#define VERIFY_SIZE ((curl_off_t) 8192)
+
+/* Alignment required for O_DIRECT writes */
+#define DIRECT_ALIGN 4096
+
+/* Amount of data to read at once when hashing existing parts of an
+   output file */
+#define HASH_READ_SIZE 65536
+
+/* Name of the checksum manifest written in each output directory */
+#define MANIFEST_NAME "SHA256SUMS"
+
+/* Number of threads used for writing to disk */
+#define IO_THREADS 4
+
+/* Maximum number of tracks being tagged at once, so that some I/O
+   threads are always free for downloads */
+#define TAG_JOBS 2
+
+/* Largest cover image that will be downloaded */
+#define COVER_MAX_SIZE (16L << 20)
+
+/* Maximum number of events to handle per call to epoll_wait */
+#define MAX_EVENTS 64
+
+/* Maximum burst (in seconds' worth of data) allowed by a rate limit,
+   and how often (in seconds) to resume paused transfers and to check
+   for a new rate limit */
+#define BUCKET_DEPTH 0.5
+#define BUCKET_TICK 0.05
+#define RATE_FILE_INTERVAL 1.0
+
+/* A token bucket used to limit bandwidth */
+struct bucket {
+  long rate;			/* bytes per second, or 0 if unlimited */
+  double tokens;
+  double time;
+};
+
+/* Distribution of a quantity, for the metrics text file */
+#define MAX_BUCKETS 12
+struct histogram {
+  const char *name;
+  const char *help;
+  const double *bounds;		/* upper bound of each bucket */
+  int num_bounds;
+  long counts[MAX_BUCKETS + 1];	/* number of values in each bucket */
+  double sum;
+};
+
+/* A track whose digest is to be added to a manifest */
+struct manifest_entry {
+  char *dir;
+  char *name;
+  char hex[65];
+  struct manifest_entry *next;
+};
+
+/* Cover art for the tracks being downloaded.  Each distinct image is
+   fetched at most once per run, and kept in a cache named after its
+   SHA-256 digest. */
+struct cover {
+  char *url;
+  CURL *curl;			/* request in progress, if any */
+  unsigned done : 1;		/* fetched, or failed */
+  char *data;			/* image, or NULL if unavailable */
+  size_t len;
+  size_t size;
+  char **dirs;			/* directories in which to save it */
+  int num_dirs;
+  struct cover *next;
+  char error_buf[CURL_ERROR_SIZE];
+};
+
+/* Bandwidth limit for a particular server */
+struct host_bucket {
+  char *host;
+  struct bucket bucket;
+  struct host_bucket *next;
+};
+
+struct transfer;
+struct segment;
+
+/* A block of data to be written to the output file by an I/O
+   thread, a journal to be saved, or a finished track to be tagged */
+struct write_job {
+  struct transfer *xf;		/* or NULL for a tagging job */
+  struct segment *seg;		/* or NULL if the segment has finished */
+  char *buf;
+  size_t len;
+  curl_off_t pos;
+  int outfd;
+  int directfd;
+  int err;			/* errno value, if the write failed */
+  long num_writes;
+  int done;
+
+  /* journal to be saved */
+  char *journal;		/* contents of the journal, or NULL */
+  const char *journal_name;
+  int synced;			/* output file has been synced */
+
+  /* track to be tagged */
+  clamz_downloader *dl;
+  const clamz_track *track;
+  const struct cover *cover;	/* image to embed, or NULL */
+  char *tag_file;
+  unsigned char digest[32];
+
+  struct write_job *next;
+};
+
+/* A single HTTP request fetching part of a track */
+struct segment {
+  struct transfer *xf;
   CURL *curl;
+  curl_off_t start;		/* first byte requested */
+  curl_off_t pos;		/* next byte to be written */
+  curl_off_t end;		/* end of range, or -1 if unknown */
+  curl_off_t verify;		/* number of bytes to compare, not write */
+  unsigned started : 1;
+  unsigned stopped : 1;
+  unsigned paused : 1;
+  unsigned io_wait : 1;		/* paused until `writing' is finished */
+  long pause_seq;
+  const char *errmsg;
+
+  /* data received but not yet written to disk */
+  char *buf;
+  size_t buf_len;
+  curl_off_t buf_pos;
+  char *spare;			/* buffer to use once `buf' is written */
+  struct write_job *writing;	/* write in progress, if any */
+
+  /* response headers */
+  curl_off_t total;		/* size given in Content-Range, or -1 */
+  char etag[256];
+  char last_modified[64];
+
+  struct segment *next;
+  char error_buf[CURL_ERROR_SIZE];
+};
+
+/* A byte range which still needs to be downloaded */
+struct range {
+  curl_off_t start;
+  curl_off_t end;
+};
+
+/* State of a track being downloaded */
+struct transfer {
+  clamz_downloader *dl;
+  clamz_track *track;
+  int index;			/* position in the list of tracks */
   char *filename;
   int outfd;
-  clamz_track *track;
-  int last_progress;
-  curl_off_t startpos;
-  char error_buf[CURL_ERROR_SIZE];
+  int directfd;
+  int failures;
+  int status;
+  unsigned active : 1;
+  unsigned waiting : 1;		/* gave up its slot until retry_time */
+  unsigned nosplit : 1;
+  unsigned validating : 1;	/* resumed, and not yet known to match */
+  unsigned restart : 1;		/* existing data must be discarded */
+  unsigned journal_dirty : 1;
+  unsigned preallocated : 1;	/* disk space reserved for whole file */
+
+  curl_off_t size;		/* total size, or -1 if unknown */
+  curl_off_t expected;		/* size found by probing, or -1 */
+  curl_off_t have;		/* number of bytes received */
+  int writes_pending;
+
+  struct segment *segments;
+  int num_segments;
+  struct range *pending;
+  int num_pending;
+
+  /* bandwidth limits applying to this transfer */
+  struct bucket bucket;
+  struct bucket *host_bucket;
+
+  struct cover *cover;
+
+  /* journal of data written so far */
+  char *journal_name;
+  struct write_job *journal_job;	/* journal being saved, if any */
+  curl_off_t committed;		/* length of initial part written */
+  char etag[256];
+  char last_modified[64];
+  struct curl_slist *headers;
+
+  /* map of completed blocks (for segmented transfers) */
+  unsigned char *map;
+  long map_blocks;
+
+  /* SHA-256 of the output file, computed as data is received */
+  gcry_md_hd_t md;
+  curl_off_t hashed;		/* length of initial part hashed */
+  unsigned char digest[32];
+
+  double retry_time;
+  double split_time;
+  double journal_time;
+  curl_off_t split_have;
+
+  /* recent transfer rate, for the progress display */
+  double rate;
+  curl_off_t rate_have;
+};
+
+struct _clamz_downloader {
+  const clamz_config *cfg;
+  clamz_library *library;
+  CURLM *multi;
+  CURLSH *share;
+  CURL **idle_handles;
+  int num_idle_handles;
   FILE *log_file;
+  size_t buffer_size;
+
+  /* bandwidth limits */
+  struct bucket bucket;
+  struct host_bucket *hosts;
+  char *rate_file;
+  time_t rate_file_mtime;
+  double rate_file_time;
+  long pause_seq;
+
+  /* progress display */
+  double progress_interval;
+  double progress_time;
+  double received;
+  double rate;
+  double total_size;		/* size of the batch, or -1 if unknown */
+
+  /* connection statistics */
+  long num_requests;
+  long num_reused;
+
+  /* request metrics */
+  FILE *metrics_file;
+  long num_failed;
+  long num_retries;
+  double bytes_received;
+  struct histogram time_hist[5];
+  struct histogram speed_hist;
+
+  /* disk statistics */
+  long num_writes;
+  curl_off_t bytes_written;
+
+  /* digests of tracks finished in this batch */
+  struct manifest_entry *manifest;
+
+  /* finished tracks waiting to be tagged, and number being tagged */
+  struct write_job *tag_queue;
+  int num_tagging;
+
+  /* cover art for this batch */
+  struct cover *covers;
+  int num_covers_pending;
+
+#ifdef USE_EPOLL
+  int epfd;
+  int timerfd;
+#endif
+
+  /* I/O threads, and a pipe used to signal finished writes */
+  int io_pipe[2];
+#ifdef HAVE_PTHREAD
+  pthread_t *io_threads;
+  int num_io_threads;
+  pthread_mutex_t io_lock;
+  pthread_cond_t io_cond;
+  pthread_cond_t io_done_cond;
+  struct write_job *io_queue, *io_queue_tail;
+  struct write_job *io_done, *io_done_tail;
+  int io_quit;
+#endif
 };
 
+static int start_io_threads(clamz_downloader *dl);
+static void stop_io_threads(clamz_downloader *dl);
+static int init_metrics(clamz_downloader *dl);
+static void complete_tag(struct write_job *job);
+#ifdef USE_EPOLL
+static int watch_fd(clamz_downloader *dl, int fd);
+static int watch_socket(CURL *curl, curl_socket_t s, int what, void *data,
+			void *socketp);
+static int set_timer(CURLM *multi, long timeout_ms, void *data);
+#endif
+
 /* Initialize downloader state */
 clamz_downloader *new_downloader(const clamz_config *cfg)
 {
   clamz_downloader *dl = malloc(sizeof(clamz_downloader));
-  char *cookiejar;
-  char useragent[100];
 
   if (!dl) {
     print_error("Out of memory");
     return NULL;
   }
 
+  dl->cfg = cfg;
+  dl->library = NULL;
+  dl->multi = NULL;
+  dl->share = NULL;
+  dl->idle_handles = NULL;
+  dl->num_idle_handles = 0;
+  dl->log_file = NULL;
+  dl->num_requests = dl->num_reused = 0;
+  dl->metrics_file = NULL;
+  dl->num_failed = dl->num_retries = 0;
+  dl->bytes_received = 0;
+  dl->num_writes = 0;
+  dl->bytes_written = 0;
+  dl->manifest = NULL;
+  dl->tag_queue = NULL;
+  dl->num_tagging = 0;
+  dl->covers = NULL;
+  dl->num_covers_pending = 0;
+  dl->io_pipe[0] = dl->io_pipe[1] = -1;
+#ifdef USE_EPOLL
+  dl->epfd = dl->timerfd = -1;
+#endif
+#ifdef HAVE_PTHREAD
+  dl->io_threads = NULL;
+  dl->num_io_threads = 0;
+#endif
+
+  /* round buffer size up to a multiple of the O_DIRECT alignment */
+  dl->buffer_size = ((cfg->buffer_size + DIRECT_ALIGN - 1)
+		     & ~((size_t) DIRECT_ALIGN - 1));
+  dl->bucket.rate = cfg->rate_limit;
+  dl->bucket.tokens = dl->bucket.time = 0;
+  dl->hosts = NULL;
+  dl->rate_file = NULL;
+  dl->rate_file_mtime = 0;
+  dl->rate_file_time = 0;
+  dl->pause_seq = 0;
+  dl->progress_interval = (isatty(STDERR_FILENO) ? PROGRESS_INTERVAL
+			   : PROGRESS_LOG_INTERVAL);
+  dl->progress_time = 0;
+  dl->received = dl->rate = 0;
+
+  srand((unsigned int) time(NULL) ^ (unsigned int) getpid());
+
   if (!cfg->printonly) {
-    dl->curl = curl_easy_init();
+    dl->multi = curl_multi_init();
+    dl->share = curl_share_init();
+    dl->idle_handles = malloc(cfg->jobs * cfg->segments * sizeof(CURL *));
 
-    if (!dl->curl) {
+    if (!dl->multi || !dl->share || !dl->idle_handles) {
       print_error("Unable to initialize curl");
+      if (dl->multi)
+	curl_multi_cleanup(dl->multi);
+      if (dl->share)
+	curl_share_cleanup(dl->share);
+      free(dl->idle_handles);
       free(dl);
       return NULL;
     }
 
-    curl_easy_setopt(dl->curl, CURLOPT_ERRORBUFFER, dl->error_buf);
-    curl_easy_setopt(dl->curl, CURLOPT_NOPROGRESS, 0L);
-    curl_easy_setopt(dl->curl, CURLOPT_FAILONERROR, 1L);
-    curl_easy_setopt(dl->curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(dl->curl, CURLOPT_COOKIEFILE, "");
+    /* Share DNS results, open connections, TLS sessions and cookies
+       among all handles, so that the server's address is looked up
+       and the TLS handshake done only once per run.  All transfers
+       run in a single thread, so no locking is required. */
+    curl_share_setopt(dl->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(dl->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(dl->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(dl->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+    curl_multi_setopt(dl->multi, CURLMOPT_MAXCONNECTS,
+		      (long) cfg->jobs * cfg->segments);
+
+#ifdef USE_EPOLL
+    /* let curl tell us which sockets to watch, and when it next needs
+       to be called, rather than polling every transfer */
+    dl->epfd = epoll_create1(EPOLL_CLOEXEC);
+    dl->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (dl->epfd < 0 || dl->timerfd < 0) {
+      print_error("Unable to initialize event loop: %s", strerror(errno));
+      free_downloader(dl);
+      return NULL;
+    }
+
+    watch_fd(dl, dl->timerfd);
+    curl_multi_setopt(dl->multi, CURLMOPT_SOCKETFUNCTION, watch_socket);
+    curl_multi_setopt(dl->multi, CURLMOPT_SOCKETDATA, dl);
+    curl_multi_setopt(dl->multi, CURLMOPT_TIMERFUNCTION, set_timer);
+    curl_multi_setopt(dl->multi, CURLMOPT_TIMERDATA, dl);
+#endif
+
+    /* the I/O threads also save journals, so they are needed even
+       if nothing is buffered */
+    if (start_io_threads(dl)) {
+      free_downloader(dl);
+      return NULL;
+    }
 
-    sprintf(useragent, "Amazon MP3 Downloader (%s)", PACKAGE_STRING);
-    curl_easy_setopt(dl->curl, CURLOPT_USERAGENT, useragent);
+    dl->rate_file = get_config_file_name(NULL, "rate-limit", NULL);
 
-    cookiejar = get_config_file_name(NULL, "cookies", NULL);
-    if (cookiejar) {
-      curl_easy_setopt(dl->curl, CURLOPT_COOKIEJAR, cookiejar);
-      free(cookiejar);
+    if (init_metrics(dl)) {
+      free_downloader(dl);
+      return NULL;
     }
   }
-  else
-    dl->curl = NULL;
 
-  dl->cfg = cfg;
-  dl->filename = NULL;
-  dl->outfd = -1;
-  dl->track = NULL;
+  dl->library = open_library();
+  if (!dl->library) {
+    free_downloader(dl);
+    return NULL;
+  }
+
   return dl;
 }
 
 /* Free downloader state */
 void free_downloader(clamz_downloader *dl)
 {
-  if (dl->curl)
-    curl_easy_cleanup(dl->curl);
-  if (dl->filename)
-    free(dl->filename);
-  if (dl->outfd > -1)
-    close(dl->outfd);
+  struct host_bucket *h;
+  int i;
+
+  stop_io_threads(dl);
+
+  while ((h = dl->hosts)) {
+    dl->hosts = h->next;
+    free(h->host);
+    free(h);
+  }
+  if (dl->rate_file)
+    free(dl->rate_file);
+  if (dl->metrics_file)
+    fclose(dl->metrics_file);
+  if (dl->library)
+    close_library(dl->library);
+
+  for (i = 0; i < dl->num_idle_handles; i++)
+    curl_easy_cleanup(dl->idle_handles[i]);
+  if (dl->idle_handles)
+    free(dl->idle_handles);
+  if (dl->multi)
+    curl_multi_cleanup(dl->multi);
+  if (dl->share)
+    curl_share_cleanup(dl->share);
+
+#ifdef USE_EPOLL
+  if (dl->epfd > -1)
+    close(dl->epfd);
+  if (dl->timerfd > -1)
+    close(dl->timerfd);
+#endif
   free(dl);
 }
 
@@ -137,21 +577,99 @@ static int write_debug_info(CURL *curl UNUSED, curl_infotype type, char *text,
   return 0;
 }
 
+/* Apply logging settings to a curl handle */
+static void set_handle_log_file(clamz_downloader *dl, CURL *curl)
+{
+  if (dl->log_file) {
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, write_debug_info);
+    curl_easy_setopt(curl, CURLOPT_DEBUGDATA, dl);
+  }
+  else {
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
+  }
+}
+
 /* Write curl log to given file */
 void set_download_log_file(clamz_downloader *dl, FILE *log)
 {
+  int i;
+
   dl->log_file = log;
 
-  if (dl->curl) {
-    if (log) {
-      curl_easy_setopt(dl->curl, CURLOPT_VERBOSE, 1);
-      curl_easy_setopt(dl->curl, CURLOPT_DEBUGFUNCTION, write_debug_info);
-      curl_easy_setopt(dl->curl, CURLOPT_DEBUGDATA, dl);
-    }
-    else {
-      curl_easy_setopt(dl->curl, CURLOPT_VERBOSE, 0);
-    }
+  for (i = 0; i < dl->num_idle_handles; i++)
+    set_handle_log_file(dl, dl->idle_handles[i]);
+}
+
+/* Get a curl handle for a new transfer (reusing an idle handle if
+   possible) */
+static CURL *get_handle(clamz_downloader *dl)
+{
+  CURL *curl;
+  char *cookiejar;
+  char useragent[100];
+
+  if (dl->num_idle_handles > 0) {
+    dl->num_idle_handles--;
+    return dl->idle_handles[dl->num_idle_handles];
+  }
+
+  curl = curl_easy_init();
+  if (!curl) {
+    print_error("Unable to initialize curl");
+    return NULL;
+  }
+
+  curl_easy_setopt(curl, CURLOPT_SHARE, dl->share);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
+
+  sprintf(useragent, "Amazon MP3 Downloader (%s)", PACKAGE_STRING);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
+
+  cookiejar = get_config_file_name(NULL, "cookies", NULL);
+  if (cookiejar) {
+    curl_easy_setopt(curl, CURLOPT_COOKIEJAR, cookiejar);
+    free(cookiejar);
   }
+
+  set_handle_log_file(dl, curl);
+  return curl;
+}
+
+/* Return a curl handle to the idle list */
+static void release_handle(clamz_downloader *dl, CURL *curl)
+{
+  if (dl->num_idle_handles < dl->cfg->jobs * dl->cfg->segments)
+    dl->idle_handles[dl->num_idle_handles++] = curl;
+  else
+    curl_easy_cleanup(curl);
+}
+
+/* Display connection statistics */
+void print_download_stats(const clamz_downloader *dl)
+{
+  if (!dl->num_requests)
+    return;
+
+  fprintf(stderr, "%ld requests, %ld using an existing connection\n",
+	  dl->num_requests, dl->num_reused);
+
+  if (dl->num_writes)
+    fprintf(stderr, "%ld writes, %" CURL_FORMAT_CURL_OFF_T
+	    " bytes per write on average\n",
+	    dl->num_writes, dl->bytes_written / dl->num_writes);
+}
+
+/* Get current time in seconds */
+static double get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 /* Create parent directories if they do not already exist */
@@ -178,191 +696,3653 @@ static int create_parents(char *filename)
   return 0;
 }
 
-/* Callback for writing downloaded data to the output file */
-static size_t write_output(void *ptr, size_t size, size_t n, void *data)
+/**************** Bandwidth limiting ****************/
+
+/* Add tokens to a bucket according to the time elapsed */
+static void refill_bucket(struct bucket *b, double t)
 {
-  clamz_downloader *dl = data;
-  int r;
+  if (b->rate <= 0)
+    return;
 
-  r = write(dl->outfd, ptr, size * n);
-  if (r < 0) {
-    print_error("Error writing to %s: %s", dl->filename, strerror(errno));
-    return 0;
-  }
+  if (!b->time)
+    b->tokens = b->rate * BUCKET_TICK;
   else
-    return r;
+    b->tokens += (t - b->time) * b->rate;
+  if (b->tokens > b->rate * BUCKET_DEPTH)
+    b->tokens = b->rate * BUCKET_DEPTH;
+  b->time = t;
 }
 
-/* Callback for displaying progress of transfer */
-static int show_progress(void *data, double dltotal, double dlnow,
-			 double ultotal UNUSED, double ulnow UNUSED)
+/* Check whether a bucket has tokens available */
+static int bucket_ready(struct bucket *b, double t)
 {
-  clamz_downloader *dl = data;
-  int progress;
+  refill_bucket(b, t);
+  return (b->rate <= 0 || b->tokens > 0);
+}
 
-  if (dl->cfg->quiet)
-    return 0;
+/* Find (or create) the bucket for the server of a given URL */
+static struct bucket *get_host_bucket(clamz_downloader *dl, const char *url)
+{
+  struct host_bucket *h;
+  const char *p, *q;
 
-  if (dltotal > 0) {
-    dlnow += dl->startpos;
-    dltotal += dl->startpos;
-    progress = (int) (100 * dlnow / dltotal);
-  }
-  else {
-    progress = -1;
+  if (dl->cfg->host_rate_limit <= 0)
+    return NULL;
+
+  p = strstr(url, "://");
+  p = (p ? p + 3 : url);
+  q = p + strcspn(p, "/?#");
+
+  for (h = dl->hosts; h; h = h->next)
+    if (!strncmp(h->host, p, q - p) && !h->host[q - p])
+      return &h->bucket;
+
+  h = malloc(sizeof(struct host_bucket));
+  if (!h || !(h->host = malloc(q - p + 1))) {
+    free(h);
+    print_error("Out of memory");
+    return NULL;
   }
 
-  if (progress != dl->last_progress) {
-    dl->last_progress = progress;
-    print_progress(dl->track, dl->filename, progress);
+  memcpy(h->host, p, q - p);
+  h->host[q - p] = 0;
+  h->bucket.rate = dl->cfg->host_rate_limit;
+  h->bucket.tokens = h->bucket.time = 0;
+  h->next = dl->hosts;
+  dl->hosts = h;
+  return &h->bucket;
+}
+
+/* Check whether a segment may write LEN bytes now.  If so, take the
+   corresponding tokens from each bucket that applies to it; if not,
+   the segment is paused until the buckets are refilled. */
+static int throttle_segment(struct segment *seg, size_t len)
+{
+  struct transfer *xf = seg->xf;
+  clamz_downloader *dl = xf->dl;
+  double t;
+
+  if (dl->bucket.rate <= 0 && !xf->host_bucket && xf->bucket.rate <= 0)
+    return 0;
+
+  t = get_time();
+  if (!bucket_ready(&dl->bucket, t)
+      || (xf->host_bucket && !bucket_ready(xf->host_bucket, t))
+      || !bucket_ready(&xf->bucket, t)) {
+    seg->paused = 1;
+    seg->pause_seq = dl->pause_seq++;
+    return 1;
   }
 
+  if (dl->bucket.rate > 0)
+    dl->bucket.tokens -= len;
+  if (xf->host_bucket)
+    xf->host_bucket->tokens -= len;
+  if (xf->bucket.rate > 0)
+    xf->bucket.tokens -= len;
   return 0;
 }
 
-int download_track(clamz_downloader *dl, clamz_track *tr)
+/* Compare paused segments, so that those which have been waiting
+   longest are resumed first */
+static int compare_paused(const void *a, const void *b)
+{
+  const struct segment *sa = *(struct segment * const *) a;
+  const struct segment *sb = *(struct segment * const *) b;
+
+  return (sa->pause_seq < sb->pause_seq ? -1
+	  : sa->pause_seq > sb->pause_seq ? 1 : 0);
+}
+
+/* Resume paused segments, in the order they were paused, as long as
+   there is bandwidth available for them */
+static void resume_segments(clamz_downloader *dl, struct segment **paused,
+			    int n)
 {
+  struct segment *seg;
+  double t = get_time();
   int i;
-  char *s;
-  CURLcode err;
 
-  if (!tr->location) {
-    print_error("No URL provided for this track");
-    return 2;
+  qsort(paused, n, sizeof(struct segment *), &compare_paused);
+
+  for (i = 0; i < n; i++) {
+    seg = paused[i];
+    if (seg->xf->status) {
+      /* let the write callback abort this segment */
+      seg->paused = 0;
+      curl_easy_pause(seg->curl, CURLPAUSE_CONT);
+      continue;
+    }
+    if (seg->io_wait)
+      continue;
+    if (!bucket_ready(&dl->bucket, t))
+      break;
+    if ((seg->xf->host_bucket && !bucket_ready(seg->xf->host_bucket, t))
+	|| !bucket_ready(&seg->xf->bucket, t))
+      continue;
+
+    /* note that this may call write_output, and pause the segment
+       again, immediately */
+    seg->paused = 0;
+    curl_easy_pause(seg->curl, CURLPAUSE_CONT);
   }
+}
 
-  dl->track = tr;
+/* Check whether the global rate limit has been changed, by writing a
+   new value to ~/.clamz/rate-limit */
+static void check_rate_file(clamz_downloader *dl, double t)
+{
+  struct stat st;
+  FILE *f;
+  char buf[100];
+  long rate;
 
-  if (dl->filename)
-    free(dl->filename);
-  dl->filename = NULL;
+  if (!dl->rate_file || t < dl->rate_file_time + RATE_FILE_INTERVAL)
+    return;
+  dl->rate_file_time = t;
 
-  /* ignore output_dir if name_format is an absolute path */
-  if (dl->cfg->output_dir
-      && (!dl->cfg->name_format || dl->cfg->name_format[0] != '/')) {
-    if (expand_file_name(dl->cfg, tr, &dl->filename, dl->cfg->output_dir))
-      return 1;
-    if (expand_file_name(dl->cfg, tr, &dl->filename, "/"))
-      return 1;
-  }
+  if (stat(dl->rate_file, &st) || st.st_mtime == dl->rate_file_mtime)
+    return;
+  dl->rate_file_mtime = st.st_mtime;
 
-  if (dl->cfg->name_format) {
-    if (expand_file_name(dl->cfg, tr, &dl->filename, dl->cfg->name_format))
-      return 1;
-  }
+  f = fopen(dl->rate_file, "r");
+  if (!f)
+    return;
 
-  if (!dl->filename || !dl->filename[0]) {
-    print_error("No output filename specified");
-    return 1;
+  if (fgets(buf, sizeof(buf), f)) {
+    buf[strcspn(buf, " \t\r\n")] = 0;
+    if (!parse_size(buf, &rate) && rate != dl->bucket.rate) {
+      dl->bucket.rate = rate;
+      dl->bucket.tokens = dl->bucket.time = 0;
+      if (!dl->cfg->quiet)
+	print_message("Rate limit changed to %s\n", buf);
+    }
   }
 
-  if (!dl->cfg->resume && !access(dl->filename, F_OK)) {
-    s = malloc((strlen(dl->filename) + 10) * sizeof(char));
-    if (!s) {
-      print_error("Out of memory");
-      return 1;
-    }
+  fclose(f);
+}
 
-    i = 1;
-    do {
-      sprintf(s, "%s.%d", dl->filename, i);
-      i++;
-    } while (!access(s, F_OK));
 
-    print_error("\"%s\" already exists; renaming new file to \"%s\"",
-		dl->filename, s);
+/**************** Download journals ****************/
 
-    free(dl->filename);
-    dl->filename = s;
-  }
+/* Get the name of the journal file for a given output file */
+static char *get_journal_file_name(const char *filename)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  char cwd[4096];
+  char key[17];
+  const char *p;
 
-  if (dl->cfg->printonly) {
-    printf("  Output to \"%s\"\n", dl->filename);
-    free(dl->filename);
-    dl->filename = NULL;
-    return 0;
+  if (filename[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+    for (p = cwd; *p; p++)
+      h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+    h = (h ^ '/') * 1099511628211ULL;
   }
 
-  if (create_parents(dl->filename)) {
-    free(dl->filename);
-    dl->filename = NULL;
-    return 4;
-  }
- 
-  dl->outfd = open(dl->filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  for (p = filename; *p; p++)
+    h = (h ^ (unsigned char) *p) * 1099511628211ULL;
 
-  if (dl->outfd < 0) {
-    print_error("Unable to open \"%s\" (%s)", dl->filename, strerror(errno));
+  sprintf(key, "%016llx", h);
+  return get_config_file_name("journal", key, NULL);
+}
 
-    free(dl->filename);
-    dl->filename = NULL;
-    return 4;
-  }
+/* Check whether a given block has been downloaded */
+static int block_done(const struct transfer *xf, long b)
+{
+  return (xf->map[b / 8] >> (b % 8)) & 1;
+}
 
-  /* NOTE: there isn't any way to determine the file size before
-     starting the download.
-     - The file size declared in the amz file (TMETA_FILE_SIZE) is wrong.
-     - Amazon's servers apparently forbid HEAD requests.
-  */
+/* Get the end of a given block */
+static curl_off_t block_end(const struct transfer *xf, long b)
+{
+  curl_off_t e = (b + 1) * MAP_BLOCK_SIZE;
+  return (e < xf->size ? e : xf->size);
+}
 
-  if (!dl->cfg->quiet)
-    fprintf(stderr, "Downloading \"%s\"\n", dl->filename);
+/* Get the length of the initial part of the file which has been
+   written */
+static curl_off_t committed_length(const struct transfer *xf)
+{
+  long b;
 
-  i = 0;
-  do {
-    i++;
-    dl->last_progress = -2;
+  if (!xf->map)
+    return xf->committed;
 
-    curl_easy_setopt(dl->curl, CURLOPT_WRITEFUNCTION, write_output);
-    curl_easy_setopt(dl->curl, CURLOPT_WRITEDATA, dl);
+  for (b = 0; b < xf->map_blocks && block_done(xf, b); b++)
+    ;
+  return (b ? block_end(xf, b - 1) : 0);
+}
 
-    curl_easy_setopt(dl->curl, CURLOPT_PROGRESSFUNCTION, show_progress);
-    curl_easy_setopt(dl->curl, CURLOPT_PROGRESSDATA, dl);
+/* Get the contents of the journal for a transfer, as it stands */
+static char *format_journal(const struct transfer *xf)
+{
+  char *text, *p;
+  long i;
 
-    curl_easy_setopt(dl->curl, CURLOPT_URL, tr->location);
+  text = malloc(strlen(xf->track->location) + sizeof(xf->etag)
+		+ sizeof(xf->last_modified) + xf->map_blocks / 4 + 256);
+  if (!text)
+    return NULL;
 
-    dl->startpos = lseek(dl->outfd, (off_t) 0, SEEK_END);
-    curl_easy_setopt(dl->curl, CURLOPT_RESUME_FROM_LARGE, dl->startpos);
+  p = text;
+  p += sprintf(p, "clamz-journal 1\n");
+  p += sprintf(p, "url %s\n", xf->track->location);
+  p += sprintf(p, "size %" CURL_FORMAT_CURL_OFF_T "\n", xf->size);
+  if (xf->etag[0])
+    p += sprintf(p, "etag %s\n", xf->etag);
+  if (xf->last_modified[0])
+    p += sprintf(p, "last-modified %s\n", xf->last_modified);
+  p += sprintf(p, "committed %" CURL_FORMAT_CURL_OFF_T "\n",
+	       committed_length(xf));
 
-    err = curl_easy_perform(dl->curl);
+  if (xf->map) {
+    p += sprintf(p, "map ");
+    for (i = 0; i < (xf->map_blocks + 7) / 8; i++)
+      p += sprintf(p, "%02x", xf->map[i]);
+    p += sprintf(p, "\n");
+  }
 
-    if (!err) {
-      /* success! */
-      break;
-    }
+  return text;
+}
 
-    if (dl->startpos != 0 && err == CURLE_HTTP_RANGE_ERROR) {
-      /* assume that this means we've already downloaded the whole
-	 thing... I guess */
-      print_progress(tr, dl->filename, 100);
-      err = 0;
-      break;
-    }
+/* Write a journal file, replacing the old one atomically.  Return 0
+   if successful, or an error number.  (This may be called from an
+   I/O thread.) */
+static int write_journal(const char *name, const char *text)
+{
+  char *tmpname;
+  FILE *f;
+  int err = 0;
 
-    print_error("Error downloading file: %s", dl->error_buf);
-    if (i < dl->cfg->maxattempts)
-      sleep(2);
+  tmpname = malloc(strlen(name) + 5);
+  if (!tmpname)
+    return ENOMEM;
+  sprintf(tmpname, "%s.tmp", name);
 
-  } while (i < dl->cfg->maxattempts);
+  f = fopen(tmpname, "w");
+  if (!f) {
+    err = errno;
+    free(tmpname);
+    return err;
+  }
 
-  if (err) {
-    close(dl->outfd);
-    dl->outfd = -1;
-    free(dl->filename);
-    dl->filename = NULL;
-    return 4;
+  if (fputs(text, f) == EOF || fflush(f) || fsync(fileno(f)))
+    err = errno;
+  if (fclose(f) && !err)
+    err = errno;
+  if (!err && rename(tmpname, name))
+    err = errno;
+  if (err)
+    unlink(tmpname);
+
+  free(tmpname);
+  return err;
+}
+
+static void wait_for_journal(struct transfer *xf);
+
+/* Save the journal now.  The output file is synced first, so that
+   the journal never refers to data which has not reached the disk. */
+static int save_journal(struct transfer *xf)
+{
+  char *text;
+  int err;
+
+  wait_for_journal(xf);
+
+  if (fdatasync(xf->outfd)) {
+    print_error("Error writing to %s: %s", xf->filename, strerror(errno));
+    return 1;
   }
 
-  if (close(dl->outfd)) {
-    print_error("Error writing to %s", dl->filename);
-    dl->outfd = -1;
-    free(dl->filename);
-    dl->filename = NULL;
-    return 4;
+  text = format_journal(xf);
+  if (!text) {
+    print_error("Out of memory");
+    return 1;
   }
 
-  dl->outfd = -1;
-  free(dl->filename);
-  dl->filename = NULL;
+  err = write_journal(xf->journal_name, text);
+  free(text);
+  if (err) {
+    print_error("Unable to write %s: %s", xf->journal_name, strerror(err));
+    return 1;
+  }
+
+  xf->journal_dirty = 0;
+  return 0;
+}
+
+/* Read the journal for a partially downloaded file.  Return 0 if the
+   journal was loaded, 1 if there is no usable journal. */
+static int load_journal(struct transfer *xf)
+{
+  struct stat st;
+  FILE *f;
+  char *line = NULL, *mapstr = NULL;
+  size_t linesize = 0;
+  ssize_t n;
+  long i;
+  unsigned int v;
+  int ok = 1;
+
+  f = fopen(xf->journal_name, "r");
+  if (!f)
+    return 1;
+
+  xf->committed = -1;
+
+  if ((n = getline(&line, &linesize, f)) < 0
+      || strcmp(line, "clamz-journal 1\n"))
+    ok = 0;
+
+  while (ok && (n = getline(&line, &linesize, f)) > 0) {
+    if (line[n - 1] == '\n')
+      line[--n] = 0;
+
+    if (!strncmp(line, "size ", 5))
+      xf->size = strtoll(line + 5, NULL, 10);
+    else if (!strncmp(line, "committed ", 10))
+      xf->committed = strtoll(line + 10, NULL, 10);
+    else if (!strncmp(line, "etag ", 5) && n - 5 < (ssize_t) sizeof(xf->etag))
+      strcpy(xf->etag, line + 5);
+    else if (!strncmp(line, "last-modified ", 14)
+	     && n - 14 < (ssize_t) sizeof(xf->last_modified))
+      strcpy(xf->last_modified, line + 14);
+    else if (!strncmp(line, "map ", 4) && !mapstr)
+      mapstr = strdup(line + 4);
+  }
+
+  fclose(f);
+  free(line);
+
+  if (!ok || xf->committed < 0 || fstat(xf->outfd, &st)
+      || st.st_size < xf->committed)
+    ok = 0;
+
+  if (ok && mapstr) {
+    /* a segmented transfer: the file was extended to its full size
+       when the map was created */
+    if (xf->size <= 0 || st.st_size != xf->size)
+      ok = 0;
+    else {
+      xf->map_blocks = (xf->size + MAP_BLOCK_SIZE - 1) / MAP_BLOCK_SIZE;
+      xf->map = calloc((xf->map_blocks + 7) / 8, 1);
+      if (!xf->map || strlen(mapstr) != (size_t) (xf->map_blocks + 7) / 8 * 2)
+	ok = 0;
+      for (i = 0; ok && i < (xf->map_blocks + 7) / 8; i++) {
+	if (sscanf(mapstr + 2 * i, "%2x", &v) != 1)
+	  ok = 0;
+	xf->map[i] = v;
+      }
+    }
+  }
+
+  free(mapstr);
+
+  if (!ok) {
+    if (xf->map)
+      free(xf->map);
+    xf->map = NULL;
+    xf->map_blocks = 0;
+    xf->size = -1;
+    xf->committed = 0;
+    xf->etag[0] = xf->last_modified[0] = 0;
+    return 1;
+  }
+
+  if (xf->map) {
+    xf->have = 0;
+    for (i = 0; i < xf->map_blocks; i++)
+      if (block_done(xf, i))
+	xf->have += block_end(xf, i) - i * MAP_BLOCK_SIZE;
+  }
+  else {
+    /* discard anything after the last committed offset, which may
+       not have been completely written */
+    if (st.st_size > xf->committed && ftruncate(xf->outfd, xf->committed)) {
+      print_error("Unable to truncate \"%s\" (%s)", xf->filename,
+		  strerror(errno));
+      return 1;
+    }
+    xf->have = xf->committed;
+  }
+
+  xf->split_time = get_time();
+  xf->split_have = xf->have;
+  return 0;
+}
+
+/* Mark the bytes between FROM and TO as written */
+static void mark_written(struct transfer *xf, curl_off_t from, curl_off_t to)
+{
+  long b;
+
+  xf->journal_dirty = 1;
+
+  if (!xf->map) {
+    if (from <= xf->committed && to > xf->committed)
+      xf->committed = to;
+    return;
+  }
+
+  for (b = from / MAP_BLOCK_SIZE; b < xf->map_blocks; b++) {
+    if (block_end(xf, b) > to)
+      break;
+    if (block_end(xf, b) > from)
+      xf->map[b / 8] |= 1 << (b % 8);
+  }
+}
+
+/* Add a range to the list of data still to be downloaded */
+static int add_pending(struct transfer *xf, curl_off_t start, curl_off_t end)
+{
+  struct range *r;
+
+  r = realloc(xf->pending, (xf->num_pending + 1) * sizeof(struct range));
+  if (!r) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  xf->pending = r;
+  xf->pending[xf->num_pending].start = start;
+  xf->pending[xf->num_pending].end = end;
+  xf->num_pending++;
+  return 0;
+}
+
+/* Add all blocks not yet downloaded to the pending list */
+static int add_missing_blocks(struct transfer *xf)
+{
+  long b, c;
+
+  for (b = 0; b < xf->map_blocks; b++) {
+    if (block_done(xf, b))
+      continue;
+    for (c = b; c + 1 < xf->map_blocks && !block_done(xf, c + 1); c++)
+      ;
+    if (add_pending(xf, b * MAP_BLOCK_SIZE, block_end(xf, c)))
+      return 1;
+    b = c;
+  }
+
+  return 0;
+}
+
+/* Create a map for a transfer once its size is known.  Data before
+   the start of the first segment is assumed to be on disk already. */
+static int init_map(struct transfer *xf, curl_off_t start)
+{
+  struct stat st;
+
+  xf->map_blocks = (xf->size + MAP_BLOCK_SIZE - 1) / MAP_BLOCK_SIZE;
+  xf->map = calloc((xf->map_blocks + 7) / 8, 1);
+  if (!xf->map) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  mark_written(xf, 0, start);
+  xf->split_time = get_time();
+  xf->split_have = xf->have;
+
+  /* save the journal before extending the file, so that a partial
+     file is never mistaken for a complete one */
+  if (save_journal(xf))
+    return 1;
+
+  if (!fstat(xf->outfd, &st) && st.st_size < xf->size
+      && ftruncate(xf->outfd, xf->size)) {
+    print_error("Unable to resize \"%s\" (%s)", xf->filename,
+		strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Reserve disk space for the whole output file once its size is
+   known, so that the file is laid out in one piece rather than as it
+   happens to arrive, and so that a full disk is noticed before
+   anything is downloaded.  The length of the file is not changed. */
+static int preallocate_output(struct transfer *xf)
+{
+  xf->preallocated = 1;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  if (fallocate(xf->outfd, FALLOC_FL_KEEP_SIZE, 0, xf->size)
+      && errno == ENOSPC) {
+    print_error("Not enough disk space for \"%s\" (%.1fM needed)",
+		xf->filename, (double) xf->size / (1024 * 1024));
+    return 1;
+  }
+  /* other errors mean that the filesystem can't preallocate, which
+     doesn't matter */
+#endif
+
+  return 0;
+}
+
+/* Set the If-Range header used when resuming a transfer, so that the
+   server sends the whole file if it has changed */
+static int set_validator(struct transfer *xf)
+{
+  char *header;
+  const char *v = (xf->etag[0] ? xf->etag : xf->last_modified);
+
+  if (xf->headers)
+    curl_slist_free_all(xf->headers);
+  xf->headers = NULL;
+
+  if (!v[0])
+    return 0;
+
+  header = malloc(strlen(v) + 11);
+  if (!header) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  sprintf(header, "If-Range: %s", v);
+  xf->headers = curl_slist_append(NULL, header);
+  free(header);
+  return 0;
+}
+
+/* Discard everything downloaded so far, so that the transfer starts
+   again from the beginning */
+static int restart_transfer(struct transfer *xf)
+{
+  if (ftruncate(xf->outfd, 0)) {
+    print_error("Unable to truncate \"%s\" (%s)", xf->filename,
+		strerror(errno));
+    return 1;
+  }
+
+  if (!xf->dl->cfg->quiet)
+    print_message("Restarting download of \"%s\"\n", xf->filename);
+
+  if (xf->map)
+    free(xf->map);
+  xf->map = NULL;
+  xf->map_blocks = 0;
+  xf->size = -1;
+  xf->preallocated = 0;
+  xf->have = xf->committed = 0;
+  xf->num_pending = 0;
+  if (xf->md)
+    gcry_md_reset(xf->md);
+  xf->hashed = 0;
+  xf->etag[0] = xf->last_modified[0] = 0;
+  xf->validating = xf->restart = 0;
+  set_validator(xf);
+
+  if (xf->journal_name)
+    unlink(xf->journal_name);
+  xf->journal_dirty = 0;
+  return 0;
+}
+
+/**************** Disk I/O ****************/
+
+/* Write data at the given position in a file.  Return 0 if
+   successful, or an error number. */
+static int write_at(int fd, const char *p, size_t len, curl_off_t pos,
+		    long *num_writes)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = pwrite(fd, p, len, pos);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return errno;
+
+    (*num_writes)++;
+    p += r;
+    pos += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Write data to the output file immediately, without using the I/O
+   threads */
+static int write_now(struct transfer *xf, const char *p, size_t len,
+		     curl_off_t pos)
+{
+  int err = write_at(xf->outfd, p, len, pos, &xf->dl->num_writes);
+
+  if (err) {
+    print_error("Error writing to %s: %s", xf->filename, strerror(err));
+    return 1;
+  }
+
+  xf->dl->bytes_written += len;
+  mark_written(xf, pos, pos + len);
+  return 0;
+}
+
+/* Carry out a write job.  With O_DIRECT, the buffer always begins at
+   an aligned position, and everything except a final partial block
+   is written directly. */
+static void run_write_job(struct write_job *job)
+{
+  size_t n = 0;
+
+  if (job->tag_file) {
+    job->err = write_track_tag(job->track, job->tag_file,
+			       (job->cover ? job->cover->data : NULL),
+			       (job->cover ? job->cover->len : 0),
+			       job->digest);
+    return;
+  }
+
+  if (job->journal) {
+    if (fdatasync(job->outfd))
+      job->err = errno;
+    else {
+      job->synced = 1;
+      job->err = write_journal(job->journal_name, job->journal);
+    }
+    return;
+  }
+
+  if (job->directfd > -1) {
+    n = job->len & ~((size_t) DIRECT_ALIGN - 1);
+    if (n)
+      job->err = write_at(job->directfd, job->buf, n, job->pos,
+			  &job->num_writes);
+  }
+
+  if (!job->err && n < job->len)
+    job->err = write_at(job->outfd, job->buf + n, job->len - n,
+			job->pos + n, &job->num_writes);
+}
+
+/* Handle a write job which has finished (called from the main
+   thread) */
+static void complete_write(struct write_job *job)
+{
+  struct transfer *xf = job->xf;
+  clamz_downloader *dl;
+  struct segment *seg = job->seg;
+
+  if (job->tag_file) {
+    complete_tag(job);
+    return;
+  }
+
+  dl = xf->dl;
+  dl->num_writes += job->num_writes;
+  xf->writes_pending--;
+
+  if (job->journal) {
+    xf->journal_job = NULL;
+    if (job->err) {
+      if (!job->synced)
+	print_error("Error writing to %s: %s", xf->filename,
+		    strerror(job->err));
+      else
+	print_error("Unable to write %s: %s", job->journal_name,
+		    strerror(job->err));
+      xf->journal_dirty = 1;
+    }
+    free(job->journal);
+    free(job);
+    return;
+  }
+
+  if (job->err) {
+    if (!xf->status) {
+      print_error("Error writing to %s: %s", xf->filename,
+		  strerror(job->err));
+      xf->status = 4;
+    }
+  }
+  else {
+    dl->bytes_written += job->len;
+    mark_written(xf, job->pos, job->pos + job->len);
+  }
+
+  if (seg) {
+    /* the buffer can be reused by the segment that filled it */
+    seg->writing = NULL;
+    seg->io_wait = 0;
+    if (!seg->spare) {
+      seg->spare = job->buf;
+      job->buf = NULL;
+    }
+  }
+
+  free(job->buf);
+  free(job);
+}
+
+#ifdef HAVE_PTHREAD
+
+/* Main function of the I/O threads */
+static void *io_worker(void *data)
+{
+  clamz_downloader *dl = data;
+  struct write_job *job;
+
+  pthread_mutex_lock(&dl->io_lock);
+
+  for (;;) {
+    while (!dl->io_queue && !dl->io_quit)
+      pthread_cond_wait(&dl->io_cond, &dl->io_lock);
+    if (!dl->io_queue)
+      break;
+
+    job = dl->io_queue;
+    dl->io_queue = job->next;
+    if (!dl->io_queue)
+      dl->io_queue_tail = NULL;
+
+    pthread_mutex_unlock(&dl->io_lock);
+    run_write_job(job);
+    pthread_mutex_lock(&dl->io_lock);
+
+    job->done = 1;
+    job->next = NULL;
+    if (dl->io_done_tail)
+      dl->io_done_tail->next = job;
+    else
+      dl->io_done = job;
+    dl->io_done_tail = job;
+    pthread_cond_broadcast(&dl->io_done_cond);
+
+    /* wake up the main thread (if the pipe is full, it will wake up
+       anyway) */
+    if (write(dl->io_pipe[1], "", 1) < 0)
+      continue;
+  }
+
+  pthread_mutex_unlock(&dl->io_lock);
+  return NULL;
+}
+
+#endif /* HAVE_PTHREAD */
+
+/* Start the threads used for writing to disk.  If threads are not
+   available, writes are done by the main thread instead. */
+static int start_io_threads(clamz_downloader *dl)
+{
+#ifdef HAVE_PTHREAD
+  int i;
+
+  if (pipe(dl->io_pipe)) {
+    print_error("Unable to create pipe: %s", strerror(errno));
+    return 1;
+  }
+  fcntl(dl->io_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(dl->io_pipe[1], F_SETFL, O_NONBLOCK);
+
+  dl->io_threads = malloc(IO_THREADS * sizeof(pthread_t));
+  if (!dl->io_threads) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  pthread_mutex_init(&dl->io_lock, NULL);
+  pthread_cond_init(&dl->io_cond, NULL);
+  pthread_cond_init(&dl->io_done_cond, NULL);
+  dl->io_queue = dl->io_queue_tail = NULL;
+  dl->io_done = dl->io_done_tail = NULL;
+  dl->io_quit = 0;
+
+  for (i = 0; i < IO_THREADS; i++) {
+    if (pthread_create(&dl->io_threads[i], NULL, &io_worker, dl))
+      break;
+    dl->num_io_threads++;
+  }
+
+  if (!dl->num_io_threads) {
+    stop_io_threads(dl);
+    return 0;
+  }
+
+# ifdef USE_EPOLL
+  if (watch_fd(dl, dl->io_pipe[0]))
+    return 1;
+# endif
+#else
+  (void) dl;
+#endif
+
+  return 0;
+}
+
+/* Wait for all I/O threads to finish */
+static void stop_io_threads(clamz_downloader *dl)
+{
+#ifdef HAVE_PTHREAD
+  int i;
+
+  if (dl->io_threads) {
+    pthread_mutex_lock(&dl->io_lock);
+    dl->io_quit = 1;
+    pthread_cond_broadcast(&dl->io_cond);
+    pthread_mutex_unlock(&dl->io_lock);
+
+    for (i = 0; i < dl->num_io_threads; i++)
+      pthread_join(dl->io_threads[i], NULL);
+
+    pthread_cond_destroy(&dl->io_done_cond);
+    pthread_cond_destroy(&dl->io_cond);
+    pthread_mutex_destroy(&dl->io_lock);
+    free(dl->io_threads);
+    dl->io_threads = NULL;
+    dl->num_io_threads = 0;
+  }
+#endif
+
+  if (dl->io_pipe[0] > -1) {
+    close(dl->io_pipe[0]);
+    close(dl->io_pipe[1]);
+    dl->io_pipe[0] = dl->io_pipe[1] = -1;
+  }
+}
+
+/* Start a write job, or carry it out immediately if there are no I/O
+   threads */
+static void queue_write(clamz_downloader *dl, struct write_job *job)
+{
+  job->next = NULL;
+
+#ifdef HAVE_PTHREAD
+  if (dl->io_threads) {
+    pthread_mutex_lock(&dl->io_lock);
+    if (dl->io_queue_tail)
+      dl->io_queue_tail->next = job;
+    else
+      dl->io_queue = job;
+    dl->io_queue_tail = job;
+    pthread_cond_signal(&dl->io_cond);
+    pthread_mutex_unlock(&dl->io_lock);
+    return;
+  }
+#else
+  (void) dl;
+#endif
+
+  run_write_job(job);
+  job->done = 1;
+  complete_write(job);
+}
+
+/* Handle all write jobs which have finished */
+static void process_writes(clamz_downloader *dl)
+{
+#ifdef HAVE_PTHREAD
+  struct write_job *job, *next;
+  char buf[64];
+
+  if (!dl->io_threads)
+    return;
+
+  while (read(dl->io_pipe[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&dl->io_lock);
+  job = dl->io_done;
+  dl->io_done = dl->io_done_tail = NULL;
+  pthread_mutex_unlock(&dl->io_lock);
+
+  for (; job; job = next) {
+    next = job->next;
+    complete_write(job);
+  }
+#else
+  (void) dl;
+#endif
+}
+
+/* Wait for a segment's previous write to finish */
+static void wait_for_write(struct segment *seg)
+{
+#ifdef HAVE_PTHREAD
+  clamz_downloader *dl = seg->xf->dl;
+
+  if (!seg->writing)
+    return;
+
+  pthread_mutex_lock(&dl->io_lock);
+  while (!seg->writing->done)
+    pthread_cond_wait(&dl->io_done_cond, &dl->io_lock);
+  pthread_mutex_unlock(&dl->io_lock);
+
+  process_writes(dl);
+#else
+  (void) seg;
+#endif
+}
+
+/* Save the journal of a transfer in the background.  The journal
+   only describes writes which have already finished, and the I/O
+   thread syncs the output file before saving it.  Only one journal
+   is saved at a time; if the last one has not yet been saved, try
+   again later. */
+static int queue_journal(struct transfer *xf)
+{
+  struct write_job *job;
+
+  if (xf->journal_job)
+    return 0;
+
+  job = malloc(sizeof(struct write_job));
+  if (!job || !(job->journal = format_journal(xf))) {
+    print_error("Out of memory");
+    free(job);
+    return 1;
+  }
+
+  job->xf = xf;
+  job->seg = NULL;
+  job->buf = NULL;
+  job->len = 0;
+  job->pos = 0;
+  job->outfd = xf->outfd;
+  job->directfd = -1;
+  job->err = 0;
+  job->num_writes = 0;
+  job->done = 0;
+  job->journal_name = xf->journal_name;
+  job->synced = 0;
+  job->tag_file = NULL;
+
+  xf->journal_job = job;
+  xf->journal_dirty = 0;
+  xf->writes_pending++;
+
+  queue_write(xf->dl, job);
+  return 0;
+}
+
+/* Wait for a transfer's journal to be saved */
+static void wait_for_journal(struct transfer *xf)
+{
+#ifdef HAVE_PTHREAD
+  clamz_downloader *dl = xf->dl;
+
+  if (!xf->journal_job)
+    return;
+
+  pthread_mutex_lock(&dl->io_lock);
+  while (!xf->journal_job->done)
+    pthread_cond_wait(&dl->io_done_cond, &dl->io_lock);
+  pthread_mutex_unlock(&dl->io_lock);
+
+  process_writes(dl);
+#else
+  (void) xf;
+#endif
+}
+
+/**************** Checksums ****************/
+
+/* Add data received for a transfer to its digest.  Data is hashed as
+   it arrives if it follows on from what has already been hashed;
+   anything else (such as the later ranges of a segmented transfer) is
+   read back from the file by hash_file() when the transfer
+   finishes. */
+static void hash_output(struct transfer *xf, const char *p, size_t len,
+			curl_off_t pos)
+{
+  if (xf->md && pos == xf->hashed) {
+    gcry_md_write(xf->md, p, len);
+    xf->hashed += len;
+  }
+}
+
+/* Add the contents of the output file, from the end of the part
+   already hashed up to END, to the digest */
+static int hash_file(struct transfer *xf, curl_off_t end)
+{
+  char *buf;
+  size_t n;
+  ssize_t r;
+
+  if (xf->hashed >= end)
+    return 0;
+
+  buf = malloc(HASH_READ_SIZE);
+  if (!buf) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  while (xf->hashed < end) {
+    n = (end - xf->hashed < HASH_READ_SIZE
+	 ? (size_t) (end - xf->hashed) : HASH_READ_SIZE);
+    r = pread(xf->outfd, buf, n, xf->hashed);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      print_error("Error reading %s: %s", xf->filename,
+		  (r < 0 ? strerror(errno) : "File is truncated"));
+      free(buf);
+      return 1;
+    }
+
+    gcry_md_write(xf->md, buf, r);
+    xf->hashed += r;
+  }
+
+  free(buf);
+  return 0;
+}
+
+/* Begin computing the digest of a transfer's output file.  When
+   resuming, the part of the file already downloaded is read once
+   here, and the rest is hashed as it arrives. */
+static int start_hash(struct transfer *xf)
+{
+  gcry_error_t err;
+
+  if ((err = gcry_md_open(&xf->md, GCRY_MD_SHA256, 0))) {
+    print_error("Failed to initialize gcrypt (%s)", gcry_strerror(err));
+    xf->md = NULL;
+    return 1;
+  }
+
+  xf->hashed = 0;
+  return hash_file(xf, committed_length(xf));
+}
+
+/* Finish computing the digest of a completed transfer */
+static int finish_hash(struct transfer *xf)
+{
+  struct stat st;
+
+  if (fstat(xf->outfd, &st)) {
+    print_error("Error reading %s: %s", xf->filename, strerror(errno));
+    return 1;
+  }
+
+  if (hash_file(xf, st.st_size))
+    return 1;
+  memcpy(xf->digest, gcry_md_read(xf->md, GCRY_MD_SHA256),
+	 sizeof(xf->digest));
+  return 0;
+}
+
+/* Write the digest of a finished track to the download log, and keep
+   it to be added to the manifest of the track's directory */
+static void add_digest(clamz_downloader *dl, const char *filename,
+		       const unsigned char *digest)
+{
+  struct manifest_entry *e;
+  const char *base;
+  int i;
+
+  e = malloc(sizeof(struct manifest_entry));
+  if (!e) {
+    print_error("Out of memory");
+    return;
+  }
+
+  for (i = 0; i < 32; i++)
+    sprintf(e->hex + 2 * i, "%02x", digest[i]);
+
+  if (dl->log_file) {
+    fprintf(dl->log_file, "* SHA-256 %s  %s\n", e->hex, filename);
+    fflush(dl->log_file);
+  }
+
+  /* the directory name keeps its trailing slash, if any */
+  base = strrchr(filename, '/');
+  base = (base ? base + 1 : filename);
+  e->dir = strndup(filename, base - filename);
+  e->name = strdup(base);
+
+  /* names containing newlines can't be written to a manifest */
+  if (!e->dir || !e->name || strchr(e->name, '\n')) {
+    if (!e->dir || !e->name)
+      print_error("Out of memory");
+    free(e->dir);
+    free(e->name);
+    free(e);
+    return;
+  }
+
+  e->next = dl->manifest;
+  dl->manifest = e;
+}
+
+/* Write the manifest for a directory.  Entries for other files are
+   kept, and those for the same files are replaced. */
+static int write_manifest(const char *dir,
+			  const struct manifest_entry *entries)
+{
+  const struct manifest_entry *e;
+  char *name, *tmpname, *line = NULL;
+  size_t linesize = 0;
+  ssize_t n;
+  FILE *in, *out;
+
+  name = malloc(strlen(dir) + sizeof(MANIFEST_NAME));
+  tmpname = malloc(strlen(dir) + sizeof(MANIFEST_NAME) + 4);
+  if (!name || !tmpname) {
+    print_error("Out of memory");
+    free(name);
+    free(tmpname);
+    return 1;
+  }
+  sprintf(name, "%s%s", dir, MANIFEST_NAME);
+  sprintf(tmpname, "%s.tmp", name);
+
+  out = fopen(tmpname, "w");
+  if (!out) {
+    print_error("Unable to write %s: %s", tmpname, strerror(errno));
+    free(name);
+    free(tmpname);
+    return 1;
+  }
+
+  /* each line is a digest, a space, a space or `*', and a name */
+  if ((in = fopen(name, "r"))) {
+    while ((n = getline(&line, &linesize, in)) > 0) {
+      if (line[n - 1] == '\n')
+	line[--n] = 0;
+      for (e = entries; e; e = e->next)
+	if (n > 66 && !strcmp(line + 66, e->name))
+	  break;
+      if (!e)
+	fprintf(out, "%s\n", line);
+    }
+    fclose(in);
+    free(line);
+  }
+
+  for (e = entries; e; e = e->next)
+    fprintf(out, "%s  %s\n", e->hex, e->name);
+
+  if (fclose(out) || rename(tmpname, name)) {
+    print_error("Unable to write %s: %s", name, strerror(errno));
+    unlink(tmpname);
+    free(name);
+    free(tmpname);
+    return 1;
+  }
+
+  free(name);
+  free(tmpname);
+  return 0;
+}
+
+/* Write the digests of all tracks finished in this batch to the
+   manifests of their directories */
+static void save_manifests(clamz_downloader *dl)
+{
+  struct manifest_entry *list = NULL, *group, *e, **prev, **tail;
+  const char *dir;
+
+  /* put the entries in the order in which the tracks finished */
+  while ((e = dl->manifest)) {
+    dl->manifest = e->next;
+    e->next = list;
+    list = e;
+  }
+
+  while (list) {
+    /* gather the entries for one directory */
+    dir = list->dir;
+    group = NULL;
+    tail = &group;
+    prev = &list;
+    while ((e = *prev)) {
+      if (!strcmp(e->dir, dir)) {
+	*prev = e->next;
+	e->next = NULL;
+	*tail = e;
+	tail = &e->next;
+      }
+      else
+	prev = &e->next;
+    }
+
+    write_manifest(dir, group);
+
+    while ((e = group)) {
+      group = e->next;
+      free(e->dir);
+      free(e->name);
+      free(e);
+    }
+  }
+}
+
+/**************** Transfer metrics ****************/
+
+static const double time_bounds[] = {
+  0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+};
+
+static const double speed_bounds[] = {
+  16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864
+};
+
+#define NUM_BOUNDS(a) ((int) (sizeof(a) / sizeof((a)[0])))
+
+static void init_histogram(struct histogram *h, const char *name,
+			   const char *help, const double *bounds,
+			   int num_bounds)
+{
+  h->name = name;
+  h->help = help;
+  h->bounds = bounds;
+  h->num_bounds = num_bounds;
+  memset(h->counts, 0, sizeof(h->counts));
+  h->sum = 0;
+}
+
+/* Set up metrics, and open the metrics file if one was requested */
+static int init_metrics(clamz_downloader *dl)
+{
+  init_histogram(&dl->time_hist[0], "clamz_request_dns_seconds",
+		 "Time taken to look up the server's address",
+		 time_bounds, NUM_BOUNDS(time_bounds));
+  init_histogram(&dl->time_hist[1], "clamz_request_connect_seconds",
+		 "Time taken to establish the connection, after the lookup",
+		 time_bounds, NUM_BOUNDS(time_bounds));
+  init_histogram(&dl->time_hist[2], "clamz_request_tls_seconds",
+		 "Time taken by the TLS handshake, after connecting",
+		 time_bounds, NUM_BOUNDS(time_bounds));
+  init_histogram(&dl->time_hist[3], "clamz_request_ttfb_seconds",
+		 "Time until the first byte of the response was received",
+		 time_bounds, NUM_BOUNDS(time_bounds));
+  init_histogram(&dl->time_hist[4], "clamz_request_duration_seconds",
+		 "Total time taken by each request",
+		 time_bounds, NUM_BOUNDS(time_bounds));
+  init_histogram(&dl->speed_hist, "clamz_request_speed_bytes_per_second",
+		 "Average download rate of each successful request",
+		 speed_bounds, NUM_BOUNDS(speed_bounds));
+
+  if (dl->cfg->metrics_file) {
+    dl->metrics_file = fopen(dl->cfg->metrics_file, "a");
+    if (!dl->metrics_file) {
+      print_error("Unable to open %s: %s", dl->cfg->metrics_file,
+		  strerror(errno));
+      return 3;
+    }
+  }
+  return 0;
+}
+
+static void add_sample(struct histogram *h, double value)
+{
+  int i;
+
+  for (i = 0; i < h->num_bounds && value > h->bounds[i]; i++)
+    ;
+  h->counts[i]++;
+  h->sum += value;
+}
+
+/* Write a string as a JSON string literal */
+static void write_json_string(FILE *f, const char *str)
+{
+  const unsigned char *p;
+
+  fputc('"', f);
+  for (p = (const unsigned char *) str; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      fprintf(f, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(f, "\\u%04x", *p);
+    else
+      fputc(*p, f);
+  }
+  fputc('"', f);
+}
+
+/* Record timing information for a finished request, and append it to
+   the metrics file */
+static void record_request(struct segment *seg, CURLcode err, long code,
+			   long nconnects)
+{
+  struct transfer *xf = seg->xf;
+  clamz_downloader *dl = xf->dl;
+  FILE *f = dl->metrics_file;
+  double dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0, speed;
+  curl_off_t bytes = 0;
+  const char *asin;
+#if LIBCURL_VERSION_NUM < 0x073700
+  double size = 0;
+#endif
+
+  curl_easy_getinfo(seg->curl, CURLINFO_NAMELOOKUP_TIME, &dns);
+  curl_easy_getinfo(seg->curl, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(seg->curl, CURLINFO_APPCONNECT_TIME, &tls);
+  curl_easy_getinfo(seg->curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+  curl_easy_getinfo(seg->curl, CURLINFO_TOTAL_TIME, &total);
+#if LIBCURL_VERSION_NUM >= 0x073700
+  curl_easy_getinfo(seg->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+#else
+  curl_easy_getinfo(seg->curl, CURLINFO_SIZE_DOWNLOAD, &size);
+  bytes = (curl_off_t) size;
+#endif
+  speed = (total > 0 ? bytes / total : 0);
+
+  /* curl gives the time at which each phase ended, counted from the
+     start of the request; the connect and TLS times are recorded as
+     the length of those phases alone */
+  connect = (connect > dns ? connect - dns : 0);
+  tls = (tls > 0 && tls > dns + connect ? tls - dns - connect : 0);
+
+  if (err)
+    dl->num_failed++;
+  dl->bytes_received += bytes;
+  add_sample(&dl->time_hist[0], dns);
+  add_sample(&dl->time_hist[1], connect);
+  add_sample(&dl->time_hist[2], tls);
+  add_sample(&dl->time_hist[3], ttfb);
+  add_sample(&dl->time_hist[4], total);
+  if (!err)
+    add_sample(&dl->speed_hist, speed);
+
+  if (!f)
+    return;
+
+  fprintf(f, "{\"time\":%ld,\"file\":", (long) time(NULL));
+  write_json_string(f, xf->filename);
+  if ((asin = xf->track->meta.value[TMETA_ASIN])) {
+    fputs(",\"asin\":", f);
+    write_json_string(f, asin);
+  }
+  fprintf(f, ",\"offset\":%" CURL_FORMAT_CURL_OFF_T
+	  ",\"bytes\":%" CURL_FORMAT_CURL_OFF_T
+	  ",\"http_code\":%ld,\"result\":", seg->start, bytes, code);
+  write_json_string(f, err ? curl_easy_strerror(err) : "ok");
+  fprintf(f, ",\"retries\":%d,\"reused\":%s,\"dns\":%.6f"
+	  ",\"connect\":%.6f,\"tls\":%.6f,\"ttfb\":%.6f,\"total\":%.6f"
+	  ",\"speed\":%.0f}\n", xf->failures,
+	  (nconnects == 0 ? "true" : "false"),
+	  dns, connect, tls, ttfb, total, speed);
+  fflush(f);
+}
+
+static void write_histogram(FILE *f, const struct histogram *h)
+{
+  long n = 0;
+  int i;
+
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n",
+	  h->name, h->help, h->name);
+  for (i = 0; i < h->num_bounds; i++) {
+    n += h->counts[i];
+    fprintf(f, "%s_bucket{le=\"%g\"} %ld\n", h->name, h->bounds[i], n);
+  }
+  n += h->counts[i];
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %ld\n", h->name, n);
+  fprintf(f, "%s_sum %g\n%s_count %ld\n", h->name, h->sum, h->name, n);
+}
+
+/* Write totals and histograms to the metrics text file, in the format
+   read by the Prometheus node exporter.  The file is replaced
+   atomically, so that it is never seen half-written. */
+static void save_metrics(clamz_downloader *dl)
+{
+  const char *name = dl->cfg->metrics_textfile;
+  char *tmpname;
+  FILE *f;
+  int i;
+
+  if (!name || dl->cfg->printonly)
+    return;
+
+  tmpname = malloc(strlen(name) + 5);
+  if (!tmpname) {
+    print_error("Out of memory");
+    return;
+  }
+  sprintf(tmpname, "%s.tmp", name);
+
+  f = fopen(tmpname, "w");
+  if (!f) {
+    print_error("Unable to write %s: %s", tmpname, strerror(errno));
+    free(tmpname);
+    return;
+  }
+
+  fprintf(f, "# HELP clamz_requests_total Number of HTTP requests made\n"
+	  "# TYPE clamz_requests_total counter\n"
+	  "clamz_requests_total{result=\"ok\"} %ld\n"
+	  "clamz_requests_total{result=\"error\"} %ld\n",
+	  dl->num_requests - dl->num_failed, dl->num_failed);
+  fprintf(f, "# HELP clamz_request_retries_total Number of times a track"
+	  " was retried after an error\n"
+	  "# TYPE clamz_request_retries_total counter\n"
+	  "clamz_request_retries_total %ld\n", dl->num_retries);
+  fprintf(f, "# HELP clamz_received_bytes_total Number of bytes received\n"
+	  "# TYPE clamz_received_bytes_total counter\n"
+	  "clamz_received_bytes_total %.0f\n", dl->bytes_received);
+  fprintf(f, "# HELP clamz_last_update_timestamp_seconds Time at which"
+	  " these metrics were written\n"
+	  "# TYPE clamz_last_update_timestamp_seconds gauge\n"
+	  "clamz_last_update_timestamp_seconds %ld\n", (long) time(NULL));
+
+  for (i = 0; i < NUM_BOUNDS(dl->time_hist); i++)
+    write_histogram(f, &dl->time_hist[i]);
+  write_histogram(f, &dl->speed_hist);
+
+  if (fclose(f) || rename(tmpname, name)) {
+    print_error("Unable to write %s: %s", name, strerror(errno));
+    unlink(tmpname);
+  }
+  free(tmpname);
+}
+
+
+/**************** Transfers ****************/
+
+/* Copy the value of a header line into a fixed-size buffer */
+static void copy_header_value(char *dest, size_t size, const char *p,
+			      size_t len)
+{
+  while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == '\n'
+		     || p[len - 1] == ' '))
+    len--;
+  while (len > 0 && *p == ' ') {
+    p++;
+    len--;
+  }
+
+  if (len >= size)
+    len = 0;
+  memcpy(dest, p, len);
+  dest[len] = 0;
+}
+
+/* Callback for examining response headers */
+static size_t read_header(char *ptr, size_t size, size_t n, void *data)
+{
+  struct segment *seg = data;
+  size_t len = size * n;
+  char *p;
+
+  if (len >= 5 && !strncmp(ptr, "HTTP/", 5)) {
+    /* start of a new response (e.g. after a redirect) */
+    seg->etag[0] = seg->last_modified[0] = 0;
+    seg->total = -1;
+  }
+  else if (len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+    copy_header_value(seg->etag, sizeof(seg->etag), ptr + 5, len - 5);
+  }
+  else if (len > 14 && !strncasecmp(ptr, "Last-Modified:", 14)) {
+    copy_header_value(seg->last_modified, sizeof(seg->last_modified),
+		      ptr + 14, len - 14);
+  }
+  else if (len > 14 && !strncasecmp(ptr, "Content-Range:", 14)) {
+    p = memchr(ptr, '/', len);
+    if (p && p + 1 < ptr + len && p[1] >= '0' && p[1] <= '9')
+      seg->total = strtoll(p + 1, NULL, 10);
+  }
+
+  return len;
+}
+
+/* Called when the first data for a segment is received */
+static int begin_segment(struct segment *seg)
+{
+  struct transfer *xf = seg->xf;
+  long code = 0;
+  curl_off_t len = -1, old_size = xf->size;
+
+  seg->started = 1;
+  curl_easy_getinfo(seg->curl, CURLINFO_RESPONSE_CODE, &code);
+
+  if (seg->start > 0 && code != 206) {
+    /* the server is sending the whole file, either because it does
+       not support byte ranges, or because the file has changed */
+    if (seg->end >= 0 || xf->num_segments > 1) {
+      seg->errmsg = "Server does not support byte ranges";
+      xf->nosplit = xf->restart = 1;
+      return 1;
+    }
+
+    if (xf->writes_pending) {
+      /* can't discard the existing data until it has been written */
+      xf->restart = 1;
+      return 1;
+    }
+
+    if (restart_transfer(xf)) {
+      xf->status = 4;
+      return 1;
+    }
+    seg->start = seg->pos = seg->buf_pos = 0;
+    seg->verify = 0;
+  }
+  else if (seg->start > 0
+	   && ((seg->total >= 0 && xf->size >= 0 && seg->total != xf->size)
+	       || (seg->etag[0] && xf->etag[0] && strcmp(seg->etag, xf->etag)))) {
+    seg->errmsg = "File has changed on the server";
+    xf->restart = 1;
+    return 1;
+  }
+
+  if (!seg->verify)
+    xf->validating = 0;
+
+  if (!xf->etag[0] && seg->etag[0])
+    strcpy(xf->etag, seg->etag);
+  if (!xf->last_modified[0] && seg->last_modified[0])
+    strcpy(xf->last_modified, seg->last_modified);
+
+  if (xf->size < 0) {
+    if (seg->total >= 0)
+      xf->size = seg->total;
+    else {
+      curl_easy_getinfo(seg->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+      if (len >= 0)
+	xf->size = seg->start + len;
+    }
+  }
+
+  if (xf->size > 0 && !xf->preallocated && preallocate_output(xf)) {
+    xf->status = 4;
+    return 1;
+  }
+
+  if (old_size < 0 && xf->size > 0 && seg->end < 0
+      && xf->dl->cfg->segments > 1 && !xf->nosplit) {
+    if (init_map(xf, seg->start + seg->verify))
+      return 1;
+    seg->end = xf->size;
+  }
+
+  return 0;
+}
+
+/* Compare data received from the server with what has already been
+   written to the output file.  Return 1 if they differ. */
+static int verify_output(struct segment *seg, const char *p, size_t len)
+{
+  struct transfer *xf = seg->xf;
+  char buf[4096];
+  size_t n;
+  ssize_t r;
+  curl_off_t pos = seg->pos;
+
+  while (len > 0) {
+    n = (len < sizeof(buf) ? len : sizeof(buf));
+    r = pread(xf->outfd, buf, n, pos);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r != (ssize_t) n || memcmp(buf, p, n))
+      return 1;
+    p += n;
+    pos += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Write out a segment's buffered data.  The buffer is handed to an
+   I/O thread, and the segment carries on with a spare buffer; if the
+   previous write has not yet finished, wait for it first. */
+static int flush_segment(struct segment *seg)
+{
+  struct transfer *xf = seg->xf;
+  clamz_downloader *dl = xf->dl;
+  struct write_job *job;
+  char *buf;
+
+  if (!seg->buf_len)
+    return 0;
+
+  wait_for_write(seg);
+
+  buf = seg->spare;
+  job = malloc(sizeof(struct write_job));
+  if (!job || (!buf && posix_memalign((void **) &buf, DIRECT_ALIGN,
+				      dl->buffer_size))) {
+    print_error("Out of memory");
+    free(job);
+    return 1;
+  }
+
+  job->xf = xf;
+  job->seg = seg;
+  job->buf = seg->buf;
+  job->len = seg->buf_len;
+  job->pos = seg->buf_pos;
+  job->outfd = xf->outfd;
+  job->directfd = xf->directfd;
+  job->err = 0;
+  job->num_writes = 0;
+  job->done = 0;
+  job->journal = NULL;
+  job->tag_file = NULL;
+
+  seg->spare = NULL;
+  seg->buf = buf;
+  seg->buf_pos += seg->buf_len;
+  seg->buf_len = 0;
+  seg->writing = job;
+  xf->writes_pending++;
+
+  queue_write(dl, job);
+  return 0;
+}
+
+/* Add data to a segment's buffer, writing it out whenever the buffer
+   is full */
+static int buffer_output(struct segment *seg, const char *p, size_t len)
+{
+  struct transfer *xf = seg->xf;
+  size_t size = xf->dl->buffer_size;
+  size_t n;
+
+  if (!seg->buf) {
+    if (write_now(xf, p, len, seg->pos))
+      return 1;
+    seg->pos += len;
+    return 0;
+  }
+
+  while (len > 0) {
+    if (!seg->buf_len) {
+      seg->buf_pos = seg->pos;
+
+      if (xf->directfd > -1 && seg->buf_pos % DIRECT_ALIGN) {
+	/* write up to the next aligned position without buffering */
+	n = DIRECT_ALIGN - seg->buf_pos % DIRECT_ALIGN;
+	if (n > len)
+	  n = len;
+	if (write_now(xf, p, n, seg->buf_pos))
+	  return 1;
+	seg->pos += n;
+	p += n;
+	len -= n;
+	continue;
+      }
+    }
+
+    n = size - seg->buf_len;
+    if (n > len)
+      n = len;
+    memcpy(seg->buf + seg->buf_len, p, n);
+    seg->buf_len += n;
+    seg->pos += n;
+    p += n;
+    len -= n;
+
+    if (seg->buf_len == size && flush_segment(seg))
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Callback for writing downloaded data to the output file */
+static size_t write_output(void *ptr, size_t size, size_t n, void *data)
+{
+  struct segment *seg = data;
+  struct transfer *xf = seg->xf;
+  size_t len = size * n;
+  size_t m;
+
+  if (xf->status || xf->restart)
+    return 0;
+
+  if (seg->writing && seg->buf_len + len >= xf->dl->buffer_size) {
+    /* the buffer is full, and the last one is still being written */
+    seg->paused = seg->io_wait = 1;
+    seg->pause_seq = xf->dl->pause_seq++;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  if (throttle_segment(seg, len))
+    return CURL_WRITEFUNC_PAUSE;
+
+  if (!seg->started && begin_segment(seg))
+    return 0;
+
+  if (seg->verify > 0) {
+    m = (len < (size_t) seg->verify ? len : (size_t) seg->verify);
+    if (verify_output(seg, ptr, m)) {
+      seg->errmsg = "Existing data does not match the server's copy";
+      xf->restart = 1;
+      return 0;
+    }
+
+    seg->pos += m;
+    seg->buf_pos = seg->pos;
+    seg->verify -= m;
+    if (!seg->verify)
+      xf->validating = 0;
+
+    ptr = (char *) ptr + m;
+    len -= m;
+  }
+
+  if (seg->end >= 0 && seg->pos + (curl_off_t) len > seg->end) {
+    /* the rest of this range has been given to another segment */
+    len = seg->end - seg->pos;
+    seg->stopped = 1;
+  }
+
+  if (buffer_output(seg, ptr, len)) {
+    seg->stopped = 0;
+    return 0;
+  }
+  hash_output(xf, ptr, len, seg->pos - len);
+
+  xf->have += len;
+  return (seg->stopped ? 0 : size * n);
+}
+
+/* Callback used to abort remaining segments of a failed or restarted
+   transfer, even while no data is being received */
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int check_abort(void *data, curl_off_t dltotal UNUSED,
+		       curl_off_t dlnow UNUSED, curl_off_t ultotal UNUSED,
+		       curl_off_t ulnow UNUSED)
+#else
+static int check_abort(void *data, double dltotal UNUSED,
+		       double dlnow UNUSED, double ultotal UNUSED,
+		       double ulnow UNUSED)
+#endif
+{
+  struct segment *seg = data;
+
+  return (seg->xf->status || seg->xf->restart);
+}
+
+/**************** Output file names ****************/
+
+/* A set of file names, stored in an open-addressing hash table */
+struct name_set {
+  char **names;
+  unsigned long size;		/* number of slots (a power of 2) */
+  unsigned long count;
+};
+
+/* The files in an output directory, including those which are about
+   to be created */
+struct output_dir {
+  char *path;
+  struct name_set files;
+  struct output_dir *next;
+};
+
+/* Hash a file name (FNV-1a) */
+static unsigned long hash_name(const char *name)
+{
+  unsigned long h = 2166136261UL;
+
+  while (*name) {
+    h ^= (unsigned char) *name++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+/* Find the slot for a name: either the slot containing it, or the
+   empty slot where it would be added */
+static char **find_name(const struct name_set *set, const char *name)
+{
+  unsigned long i = hash_name(name) & (set->size - 1);
+
+  while (set->names[i] && strcmp(set->names[i], name))
+    i = (i + 1) & (set->size - 1);
+  return &set->names[i];
+}
+
+/* Check whether a set contains a name */
+static int has_name(const struct name_set *set, const char *name)
+{
+  return (set->size && *find_name(set, name));
+}
+
+/* Add a name to a set */
+static int add_name(struct name_set *set, const char *name)
+{
+  struct name_set bigger;
+  unsigned long i;
+  char **slot;
+
+  if ((set->count + 1) * 2 > set->size) {
+    bigger.size = (set->size ? set->size * 2 : 64);
+    bigger.count = set->count;
+    bigger.names = calloc(bigger.size, sizeof(char *));
+    if (!bigger.names) {
+      print_error("Out of memory");
+      return 1;
+    }
+
+    for (i = 0; i < set->size; i++)
+      if (set->names[i])
+	*find_name(&bigger, set->names[i]) = set->names[i];
+    free(set->names);
+    *set = bigger;
+  }
+
+  slot = find_name(set, name);
+  if (*slot)
+    return 0;
+  if (!(*slot = strdup(name))) {
+    print_error("Out of memory");
+    return 1;
+  }
+  set->count++;
+  return 0;
+}
+
+/* Free the contents of a set */
+static void free_names(struct name_set *set)
+{
+  unsigned long i;
+
+  for (i = 0; i < set->size; i++)
+    free(set->names[i]);
+  free(set->names);
+}
+
+/* Find the output directory for a file name.  The first time a
+   directory is seen, it is created if necessary, and the names of
+   the files it contains are read. */
+static int get_output_dir(clamz_downloader *dl, struct output_dir **dirs,
+			  char *filename, struct output_dir **dir)
+{
+  struct output_dir *d;
+  const char *slash;
+  struct dirent *ent;
+  DIR *dp;
+  size_t len;
+
+  /* the directory part of the name, including the final slash */
+  slash = strrchr(filename, '/');
+  len = (slash ? (size_t) (slash - filename) + 1 : 0);
+
+  for (d = *dirs; d; d = d->next) {
+    if (strlen(d->path) == len && !strncmp(d->path, filename, len)) {
+      *dir = d;
+      return 0;
+    }
+  }
+
+  d = malloc(sizeof(struct output_dir));
+  if (!d || !(d->path = malloc(len + 1))) {
+    print_error("Out of memory");
+    free(d);
+    return 1;
+  }
+  memcpy(d->path, filename, len);
+  d->path[len] = 0;
+  d->files.names = NULL;
+  d->files.size = d->files.count = 0;
+  d->next = *dirs;
+  *dirs = d;
+
+  if (!dl->cfg->printonly && create_parents(filename))
+    return 4;
+
+  if ((dp = opendir(len ? d->path : "."))) {
+    while ((ent = readdir(dp))) {
+      if (add_name(&d->files, ent->d_name)) {
+	closedir(dp);
+	return 1;
+      }
+    }
+    closedir(dp);
+  }
+
+  *dir = d;
+  return 0;
+}
+
+/* Determine the output filename for a track.  Return 0 if the track
+   is to be downloaded, -1 if it is already in the library, or an
+   error code. */
+static int plan_output(struct transfer *xf, struct output_dir **dirs)
+{
+  clamz_downloader *dl = xf->dl;
+  clamz_track *tr = xf->track;
+  struct output_dir *dir;
+  const char *oldname;
+  long long oldsize;
+  struct stat st;
+  size_t base;
+  int i, status;
+  char *s;
+
+  if (!tr->location) {
+    print_error("No URL provided for this track");
+    return 2;
+  }
+
+  /* skip tracks which have been downloaded before, as long as the
+     file is still where we left it */
+  if (!dl->cfg->redownload
+      && !find_library_track(dl->library, tr->meta.value[TMETA_ASIN],
+			     &oldname, &oldsize)
+      && !stat(oldname, &st) && S_ISREG(st.st_mode)
+      && st.st_size == oldsize) {
+    if (dl->cfg->printonly)
+      printf("  Already downloaded to \"%s\"\n", oldname);
+    else if (!dl->cfg->quiet)
+      print_message("Already downloaded \"%s\"\n", oldname);
+    return -1;
+  }
+
+  /* ignore output_dir if name_format is an absolute path */
+  if (dl->cfg->output_dir
+      && (!dl->cfg->name_format || dl->cfg->name_format[0] != '/')) {
+    if (expand_file_name(dl->cfg, tr, &xf->filename, dl->cfg->output_dir))
+      return 1;
+    if (expand_file_name(dl->cfg, tr, &xf->filename, "/"))
+      return 1;
+  }
+
+  if (dl->cfg->name_format) {
+    if (expand_file_name(dl->cfg, tr, &xf->filename, dl->cfg->name_format))
+      return 1;
+  }
+
+  if (!xf->filename || !xf->filename[0]) {
+    print_error("No output filename specified");
+    return 1;
+  }
+
+  if ((status = get_output_dir(dl, dirs, xf->filename, &dir)))
+    return status;
+  base = strlen(dir->path);
+
+  if (!dl->cfg->resume && has_name(&dir->files, xf->filename + base)) {
+    s = malloc((strlen(xf->filename) + 10) * sizeof(char));
+    if (!s) {
+      print_error("Out of memory");
+      return 1;
+    }
+
+    i = 1;
+    do {
+      sprintf(s, "%s.%d", xf->filename, i);
+      i++;
+    } while (has_name(&dir->files, s + base));
+
+    print_error("\"%s\" already exists; renaming new file to \"%s\"",
+		xf->filename, s);
+
+    free(xf->filename);
+    xf->filename = s;
+  }
+
+  /* reserve the name, so that no other track in this batch uses it */
+  if (add_name(&dir->files, xf->filename + base))
+    return 1;
+
+  return 0;
+}
+
+#ifdef USE_STATVFS
+
+/* Space needed on one filesystem */
+struct fs_space {
+  dev_t dev;
+  char *path;
+  long long need;
+  long long avail;
+};
+
+/* Check that there is enough free space for a batch of tracks, so
+   that a full disk is reported before starting rather than halfway
+   through.  Unless the sizes have been probed, only the sizes
+   declared in the amz file are known; they are not exact, but are
+   close enough for this.  Tracks whose filesystem is too full are
+   failed. */
+static void check_free_space(struct transfer *xfs, int n)
+{
+  struct transfer *xf;
+  struct fs_space *fs;
+  struct statvfs vfs;
+  struct stat st;
+  const char *value, *slash;
+  char *dir;
+  long long size;
+  int *fsidx, nfs = 0, i, j;
+
+  if (n < 1 || xfs[0].dl->cfg->printonly)
+    return;
+
+  fs = malloc(n * sizeof(struct fs_space));
+  fsidx = malloc(n * sizeof(int));
+  if (!fs || !fsidx) {
+    free(fs);
+    free(fsidx);
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    xf = &xfs[i];
+    fsidx[i] = -1;
+    if (xf->status)
+      continue;
+
+    if (xf->expected >= 0)
+      size = xf->expected;
+    else if ((value = xf->track->meta.value[TMETA_FILE_SIZE]))
+      size = strtoll(value, NULL, 10);
+    else
+      continue;
+
+    /* when resuming, part of the file is already there */
+    if (xf->dl->cfg->resume && !stat(xf->filename, &st))
+      size -= st.st_size;
+    if (size <= 0)
+      continue;
+
+    slash = strrchr(xf->filename, '/');
+    if (slash)
+      dir = strndup(xf->filename, slash + 1 - xf->filename);
+    else
+      dir = strdup(".");
+    if (!dir || stat(dir, &st)) {
+      free(dir);
+      continue;
+    }
+
+    for (j = 0; j < nfs; j++)
+      if (fs[j].dev == st.st_dev)
+	break;
+
+    if (j == nfs) {
+      if (statvfs(dir, &vfs)) {
+	free(dir);
+	continue;
+      }
+      fs[j].dev = st.st_dev;
+      fs[j].path = dir;
+      fs[j].need = 0;
+      fs[j].avail = (long long) vfs.f_bavail * vfs.f_frsize;
+      nfs++;
+    }
+    else
+      free(dir);
+
+    fs[j].need += size;
+    fsidx[i] = j;
+  }
+
+  for (j = 0; j < nfs; j++) {
+    if (fs[j].need > fs[j].avail) {
+      print_error("Not enough disk space in \"%s\""
+		  " (%.1fM needed, %.1fM available)", fs[j].path,
+		  (double) fs[j].need / (1024 * 1024),
+		  (double) fs[j].avail / (1024 * 1024));
+
+      for (i = 0; i < n; i++)
+	if (fsidx[i] == j)
+	  xfs[i].status = 4;
+    }
+    free(fs[j].path);
+  }
+
+  free(fs);
+  free(fsidx);
+}
+
+#endif /* USE_STATVFS */
+
+/* Choose output filenames for a batch of tracks.  Each output
+   directory is created and listed once, rather than checking for
+   each file separately. */
+static void plan_outputs(struct transfer *xfs, int n)
+{
+  struct output_dir *dirs = NULL, *d;
+  int i;
+
+  for (i = 0; i < n; i++)
+    xfs[i].status = plan_output(&xfs[i], &dirs);
+
+  while ((d = dirs)) {
+    dirs = d->next;
+    free_names(&d->files);
+    free(d->path);
+    free(d);
+  }
+}
+
+/* Open the output file, whose name has been chosen by
+   plan_outputs().  Return 0 if the transfer is ready to start, -1 if
+   there is nothing to download (--info mode), or an error code. */
+static int open_transfer(struct transfer *xf)
+{
+  clamz_downloader *dl = xf->dl;
+  clamz_track *tr = xf->track;
+
+  if (dl->cfg->printonly) {
+    printf("  Output to \"%s\"\n", xf->filename);
+    return -1;
+  }
+
+  /* the file is also read, to check existing data when resuming */
+  xf->outfd = open(xf->filename, O_RDWR | O_CREAT, 0666);
+
+  if (xf->outfd < 0) {
+    print_error("Unable to open \"%s\" (%s)", xf->filename, strerror(errno));
+    return 4;
+  }
+
+  if (dl->cfg->direct_io) {
+#ifdef O_DIRECT
+    xf->directfd = open(xf->filename, O_WRONLY | O_DIRECT);
+#endif
+    if (xf->directfd < 0 && dl->cfg->verbose)
+      print_message("Direct I/O is not available for \"%s\"\n",
+		    xf->filename);
+  }
+
+  xf->journal_name = get_journal_file_name(xf->filename);
+  if (!xf->journal_name)
+    return 4;
+
+  /* NOTE: there isn't any way to determine the file size before
+     starting the download.
+     - The file size declared in the amz file (TMETA_FILE_SIZE) is wrong.
+     - Amazon's servers apparently forbid HEAD requests.
+     Segmented transfers therefore begin with a single request, and
+     are split once the size is known.
+  */
+
+  if (dl->cfg->resume && !load_journal(xf)) {
+    if (xf->map ? add_missing_blocks(xf) : add_pending(xf, xf->have, -1))
+      return 4;
+    if (set_validator(xf))
+      return 4;
+    xf->validating = 1;
+  }
+  else {
+    unlink(xf->journal_name);
+
+    /* without a journal, all we can do is assume that the existing
+       part of the file is correct, and check the end of it */
+    xf->have = lseek(xf->outfd, (off_t) 0, SEEK_END);
+    if (xf->have < 0)
+      xf->have = 0;
+    xf->committed = xf->have;
+    xf->validating = (xf->have > 0);
+    if (add_pending(xf, xf->have, -1))
+      return 4;
+  }
+
+  /* when tagging, the digest is computed once the tags are written */
+  if (!dl->cfg->tag && start_hash(xf))
+    return 4;
+
+  xf->bucket.rate = dl->cfg->track_rate_limit;
+  xf->bucket.tokens = xf->bucket.time = 0;
+  xf->host_bucket = get_host_bucket(dl, tr->location);
+
+  if (!dl->cfg->quiet)
+    print_message("Downloading \"%s\"\n", xf->filename);
+
+  return 0;
+}
+
+/* Start a request for the given range of a transfer */
+static int start_segment(struct transfer *xf, curl_off_t start,
+			 curl_off_t end)
+{
+  clamz_downloader *dl = xf->dl;
+  struct segment *seg;
+  char range[100];
+
+  seg = malloc(sizeof(struct segment));
+  if (!seg) {
+    print_error("Out of memory");
+    return 4;
+  }
+
+  if (!(seg->curl = get_handle(dl))) {
+    free(seg);
+    return 4;
+  }
+
+  seg->xf = xf;
+  seg->start = seg->pos = start;
+  seg->end = end;
+  seg->verify = 0;
+  seg->total = -1;
+  seg->etag[0] = seg->last_modified[0] = 0;
+  seg->started = seg->stopped = seg->paused = 0;
+  seg->pause_seq = 0;
+  seg->errmsg = NULL;
+  seg->error_buf[0] = 0;
+  seg->buf = seg->spare = NULL;
+  seg->writing = NULL;
+  seg->io_wait = 0;
+  seg->buf_len = 0;
+  seg->buf_pos = start;
+
+  if (end < 0 && start > 0) {
+    /* download some of the existing data again, to make sure it
+       matches */
+    seg->verify = (start < VERIFY_SIZE ? start : VERIFY_SIZE);
+    seg->start = seg->pos = seg->buf_pos = start - seg->verify;
+  }
+
+  if (dl->buffer_size
+      && posix_memalign((void **) &seg->buf, DIRECT_ALIGN, dl->buffer_size)) {
+    print_error("Out of memory");
+    release_handle(dl, seg->curl);
+    free(seg);
+    return 4;
+  }
+
+  curl_easy_setopt(seg->curl, CURLOPT_ERRORBUFFER, seg->error_buf);
+
+  curl_easy_setopt(seg->curl, CURLOPT_WRITEFUNCTION, write_output);
+  curl_easy_setopt(seg->curl, CURLOPT_WRITEDATA, seg);
+
+  curl_easy_setopt(seg->curl, CURLOPT_HEADERFUNCTION, read_header);
+  curl_easy_setopt(seg->curl, CURLOPT_HEADERDATA, seg);
+  curl_easy_setopt(seg->curl, CURLOPT_HTTPHEADER, xf->headers);
+
+  curl_easy_setopt(seg->curl, CURLOPT_NOPROGRESS, 0L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+  curl_easy_setopt(seg->curl, CURLOPT_XFERINFOFUNCTION, check_abort);
+  curl_easy_setopt(seg->curl, CURLOPT_XFERINFODATA, seg);
+#else
+  curl_easy_setopt(seg->curl, CURLOPT_PROGRESSFUNCTION, check_abort);
+  curl_easy_setopt(seg->curl, CURLOPT_PROGRESSDATA, seg);
+#endif
+
+  curl_easy_setopt(seg->curl, CURLOPT_PRIVATE, seg);
+  curl_easy_setopt(seg->curl, CURLOPT_URL, xf->track->location);
+
+  if (seg->start == 0 && end < 0) {
+    curl_easy_setopt(seg->curl, CURLOPT_RANGE, NULL);
+  }
+  else {
+    if (end < 0)
+      sprintf(range, "%" CURL_FORMAT_CURL_OFF_T "-", seg->start);
+    else
+      sprintf(range, "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T,
+	      start, end - 1);
+    curl_easy_setopt(seg->curl, CURLOPT_RANGE, range);
+  }
+
+  if (curl_multi_add_handle(dl->multi, seg->curl)) {
+    print_error("Unable to start transfer");
+    release_handle(dl, seg->curl);
+    free(seg->buf);
+    free(seg);
+    return 4;
+  }
+
+  seg->next = xf->segments;
+  xf->segments = seg;
+  xf->num_segments++;
+  return 0;
+}
+
+/* Start requests for pending ranges, and split existing segments if
+   the transfer would benefit from more connections */
+static void schedule_segments(struct transfer *xf, double t)
+{
+  const clamz_config *cfg = xf->dl->cfg;
+  struct segment *seg, *largest;
+  curl_off_t mid, end;
+  double rate;
+  int max_segments = ((xf->map && !xf->validating) ? cfg->segments : 1);
+
+  if (xf->restart && !xf->num_segments && !xf->writes_pending) {
+    if (restart_transfer(xf) || add_pending(xf, 0, -1))
+      xf->status = 4;
+  }
+
+  if (xf->status || xf->retry_time > t)
+    return;
+  xf->retry_time = 0;
+
+  if (xf->map && t >= xf->split_time + SPLIT_INTERVAL) {
+    /* per-connection transfer rate since the last check */
+    rate = (xf->have - xf->split_have) / (t - xf->split_time)
+      / (xf->num_segments ? xf->num_segments : 1);
+    xf->split_time = t;
+    xf->split_have = xf->have;
+
+    largest = NULL;
+    if (!xf->nosplit && !xf->num_pending
+	&& xf->num_segments > 0 && xf->num_segments < max_segments)
+      for (seg = xf->segments; seg; seg = seg->next)
+	if (seg->end >= 0
+	    && (!largest
+		|| seg->end - seg->pos > largest->end - largest->pos))
+	  largest = seg;
+
+    if (largest) {
+      /* give the second half of the largest segment to a new
+	 connection, if it is large enough to be worth it */
+      mid = largest->pos + (largest->end - largest->pos) / 2;
+      mid = ((mid + MAP_BLOCK_SIZE - 1) / MAP_BLOCK_SIZE) * MAP_BLOCK_SIZE;
+      end = largest->end;
+
+      if (end - mid >= MAP_BLOCK_SIZE && end - mid >= rate * SPLIT_MIN_TIME
+	  && !add_pending(xf, mid, end))
+	largest->end = mid;
+    }
+  }
+
+  while (xf->num_pending > 0 && xf->num_segments < max_segments) {
+    /* existing data must be on disk before it can be verified */
+    if (xf->pending[0].end < 0 && xf->writes_pending)
+      break;
+
+    if (start_segment(xf, xf->pending[0].start, xf->pending[0].end)) {
+      xf->status = 4;
+      return;
+    }
+    xf->num_pending--;
+    memmove(&xf->pending[0], &xf->pending[1],
+	    xf->num_pending * sizeof(struct range));
+  }
+}
+
+/* Check whether an error is likely to be temporary, so that the
+   request is worth retrying */
+static int error_is_transient(CURLcode err, long code)
+{
+  switch (err) {
+  case CURLE_HTTP_RETURNED_ERROR:
+    /* server errors, request timeouts and rate limiting; other client
+       errors (such as 403 for an expired link, or 404) are permanent */
+    return (code >= 500 || code == 408 || code == 429);
+
+  case CURLE_COULDNT_RESOLVE_PROXY:
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+/* Get the time (in seconds) to wait before retrying a transfer that
+   has failed N times.  The delay doubles with each failure, and is
+   randomized so that transfers which failed together do not all
+   retry at once. */
+static double retry_delay(int n)
+{
+  double d = RETRY_DELAY;
+
+  while (--n > 0 && d < RETRY_MAX_DELAY)
+    d *= 2;
+  if (d > RETRY_MAX_DELAY)
+    d = RETRY_MAX_DELAY;
+
+  return d * (0.5 + 0.5 * rand() / RAND_MAX);
+}
+
+/* Handle a request that has completed (successfully or not) */
+static void segment_done(struct segment *seg, CURLcode err)
+{
+  struct transfer *xf = seg->xf;
+  clamz_downloader *dl = xf->dl;
+  struct segment **sp;
+  long nconnects = 0, code = 0;
+  double delay;
+
+  /* count requests that were able to use an existing connection */
+  dl->num_requests++;
+  if (!curl_easy_getinfo(seg->curl, CURLINFO_NUM_CONNECTS, &nconnects)
+      && nconnects == 0)
+    dl->num_reused++;
+
+  curl_easy_getinfo(seg->curl, CURLINFO_RESPONSE_CODE, &code);
+
+  if (err == CURLE_WRITE_ERROR && seg->stopped)
+    err = 0;
+
+  record_request(seg, err, code, nconnects);
+
+  curl_multi_remove_handle(dl->multi, seg->curl);
+  release_handle(dl, seg->curl);
+
+  for (sp = &xf->segments; *sp != seg; sp = &(*sp)->next)
+    ;
+  *sp = seg->next;
+  xf->num_segments--;
+
+  if (flush_segment(seg))
+    xf->status = 4;
+  if (seg->writing)
+    seg->writing->seg = NULL;
+
+  if (seg->start > 0 && code == 416 && !xf->restart
+      && ++xf->failures < dl->cfg->maxattempts) {
+    /* the server's copy is shorter than the part we already have, or
+       than the size it reported earlier */
+    xf->restart = 1;
+  }
+
+  if (xf->restart) {
+    /* any errors are due to aborting the transfer */
+    err = 0;
+    seg->end = -1;
+  }
+
+  if (!err && seg->end >= 0 && seg->pos < seg->end) {
+    /* server sent less than we asked for */
+    if (add_pending(xf, seg->pos, seg->end))
+      xf->status = 4;
+  }
+
+  if (err && !xf->status) {
+    if (seg->errmsg)
+      print_error("Error downloading \"%s\": %s", xf->filename,
+		  seg->errmsg);
+    else if (seg->error_buf[0])
+      print_error("Error downloading \"%s\": %s", xf->filename,
+		  seg->error_buf);
+    else
+      print_error("Error downloading \"%s\": %s", xf->filename,
+		  curl_easy_strerror(err));
+
+    if (!error_is_transient(err, code)) {
+      if (code == 403)
+	print_error("The download link has probably expired; try"
+		    " downloading a new AMZ file");
+      xf->status = 4;
+    }
+    else {
+      xf->failures++;
+      if (xf->failures >= dl->cfg->maxattempts
+	  || add_pending(xf, seg->pos, seg->end))
+	xf->status = 4;
+      else if (!xf->retry_time) {
+	dl->num_retries++;
+	delay = retry_delay(xf->failures);
+	xf->retry_time = get_time() + delay;
+	if (!dl->cfg->quiet)
+	  print_message("Retrying \"%s\" in %.0f seconds\n",
+			xf->filename, delay);
+      }
+    }
+  }
+
+  free(seg->buf);
+  free(seg->spare);
+  free(seg);
+}
+
+/* Release resources associated with a transfer */
+static void finish_transfer(struct transfer *xf)
+{
+  /* a failed transfer's journal must be saved while the output file
+     is still open, since the file is synced first */
+  if (xf->journal_name && xf->status && xf->outfd > -1
+      && (xf->map || xf->committed > 0))
+    save_journal(xf);
+
+  if (xf->directfd > -1) {
+    if (close(xf->directfd) && !xf->status) {
+      print_error("Error writing to %s", xf->filename);
+      xf->status = 4;
+    }
+    xf->directfd = -1;
+  }
+
+  if (xf->outfd > -1) {
+    if (close(xf->outfd) && !xf->status) {
+      print_error("Error writing to %s", xf->filename);
+      xf->status = 4;
+    }
+    xf->outfd = -1;
+  }
+
+  if (xf->journal_name) {
+    if (!xf->status)
+      unlink(xf->journal_name);
+    free(xf->journal_name);
+    xf->journal_name = NULL;
+  }
+
+  if (xf->headers)
+    curl_slist_free_all(xf->headers);
+  xf->headers = NULL;
+
+  if (xf->map)
+    free(xf->map);
+  xf->map = NULL;
+
+  if (xf->md)
+    gcry_md_close(xf->md);
+  xf->md = NULL;
+
+  if (xf->pending)
+    free(xf->pending);
+  xf->pending = NULL;
+  xf->num_pending = 0;
+
+  if (xf->filename)
+    free(xf->filename);
+  xf->filename = NULL;
+}
+
+/* Add a finished track to the library */
+static void record_track(clamz_downloader *dl, const clamz_track *tr,
+			 const char *filename, const unsigned char *digest)
+{
+  struct stat st;
+  char *path;
+
+  if (stat(filename, &st))
+    return;
+
+  path = realpath(filename, NULL);
+  add_library_track(dl->library, tr->meta.value[TMETA_ASIN],
+		    (path ? path : filename), (long long) st.st_size, digest);
+  free(path);
+}
+
+/**************** Tagging ****************/
+
+/* Hand queued tracks to the I/O threads, up to TAG_JOBS at a time.
+   Tracks whose cover art is still being fetched are left waiting. */
+static void start_tags(clamz_downloader *dl)
+{
+  struct write_job *job, **prev = &dl->tag_queue;
+
+  while ((job = *prev) && dl->num_tagging < TAG_JOBS) {
+    if (job->cover && !job->cover->done) {
+      prev = &job->next;
+      continue;
+    }
+
+    *prev = job->next;
+    dl->num_tagging++;
+    queue_write(dl, job);
+  }
+}
+
+/* Queue a finished track to have its tags written.  The track is
+   added to the library and manifest once that is done, since its
+   contents (and digest) will have changed. */
+static int queue_tag(struct transfer *xf)
+{
+  clamz_downloader *dl = xf->dl;
+  struct write_job *job, **prev;
+
+  job = malloc(sizeof(struct write_job));
+  if (!job || !(job->tag_file = strdup(xf->filename))) {
+    print_error("Out of memory");
+    free(job);
+    return 1;
+  }
+
+  job->xf = NULL;
+  job->seg = NULL;
+  job->buf = NULL;
+  job->journal = NULL;
+  job->err = 0;
+  job->done = 0;
+  job->dl = dl;
+  job->track = xf->track;
+  job->cover = (dl->cfg->embed_cover ? xf->cover : NULL);
+  job->next = NULL;
+
+  for (prev = &dl->tag_queue; *prev; prev = &(*prev)->next)
+    ;
+  *prev = job;
+
+  start_tags(dl);
+  return 0;
+}
+
+/* Handle a tagging job which has finished (called from the main
+   thread) */
+static void complete_tag(struct write_job *job)
+{
+  clamz_downloader *dl = job->dl;
+
+  dl->num_tagging--;
+
+  if (job->err) {
+    print_error("Unable to write tags to \"%s\" (%s)", job->tag_file,
+		strerror(job->err));
+    record_track(dl, job->track, job->tag_file, NULL);
+  }
+  else {
+    if (dl->cfg->verbose)
+      print_message("Tagged \"%s\"\n", job->tag_file);
+    add_digest(dl, job->tag_file, job->digest);
+    record_track(dl, job->track, job->tag_file, job->digest);
+  }
+
+  free(job->tag_file);
+  free(job);
+  start_tags(dl);
+}
+
+/* Wait until all queued tracks have been tagged */
+static void wait_for_tags(clamz_downloader *dl)
+{
+#ifdef HAVE_PTHREAD
+  while (dl->num_tagging > 0) {
+    pthread_mutex_lock(&dl->io_lock);
+    while (!dl->io_done)
+      pthread_cond_wait(&dl->io_done_cond, &dl->io_lock);
+    pthread_mutex_unlock(&dl->io_lock);
+
+    process_writes(dl);
+  }
+#else
+  (void) dl;
+#endif
+}
+
+
+/**************** Cover art ****************/
+
+/* Get the URL of the cover image for a track */
+static const char *get_cover_url(const clamz_track *tr)
+{
+  if (tr->image_name && tr->image_name[0])
+    return tr->image_name;
+  if (tr->playlist && tr->playlist->image_name && tr->playlist->image_name[0])
+    return tr->playlist->image_name;
+  return NULL;
+}
+
+/* Get the file name suffix for an image */
+static const char *get_image_suffix(const char *data, size_t len)
+{
+  if (len >= 8 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8))
+    return ".png";
+  return ".jpg";
+}
+
+/* Get the name of the cache entry for an image URL, which is a
+   symbolic link to the image itself */
+static char *get_cover_link_name(const char *url)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  char key[21];
+  const char *p;
+
+  for (p = url; *p; p++)
+    h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+
+  sprintf(key, "url-%016llx", h);
+  return get_config_file_name("covers", key, NULL);
+}
+
+/* Compute the SHA-256 digest of a buffer, in hexadecimal */
+static void hash_buffer(char *hex, const char *data, size_t len)
+{
+  unsigned char digest[32];
+  int i;
+
+  gcry_md_hash_buffer(GCRY_MD_SHA256, digest, data, len);
+  for (i = 0; i < 32; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+/* Read an image from the cache.  The image is only used if its
+   digest still matches its name.  Return 0 if successful. */
+static int load_cover(struct cover *cv)
+{
+  char *link, *name = NULL, target[100], hex[65];
+  struct stat st;
+  ssize_t n;
+  FILE *f = NULL;
+
+  link = get_cover_link_name(cv->url);
+  if (!link)
+    return 1;
+
+  n = readlink(link, target, sizeof(target) - 1);
+  free(link);
+  if (n < 64)
+    return 1;
+  target[n] = 0;
+
+  name = get_config_file_name("covers", target, NULL);
+  if (name)
+    f = fopen(name, "rb");
+  free(name);
+  if (!f)
+    return 1;
+
+  if (!fstat(fileno(f), &st) && st.st_size > 0
+      && st.st_size <= COVER_MAX_SIZE
+      && (cv->data = malloc(st.st_size))) {
+    cv->len = fread(cv->data, 1, st.st_size, f);
+    hash_buffer(hex, cv->data, cv->len);
+    if (cv->len != (size_t) st.st_size || strncmp(hex, target, 64)) {
+      free(cv->data);
+      cv->data = NULL;
+    }
+  }
+
+  fclose(f);
+  return (cv->data == NULL);
+}
+
+/* Write an image to a file, through a temporary file */
+static int write_cover_file(const char *name, const char *data, size_t len)
+{
+  char *tmpname;
+  FILE *f;
+  int err;
+
+  tmpname = malloc(strlen(name) + 5);
+  if (!tmpname) {
+    print_error("Out of memory");
+    return 1;
+  }
+  sprintf(tmpname, "%s.tmp", name);
+
+  f = fopen(tmpname, "wb");
+  err = !f;
+  if (f) {
+    if (fwrite(data, 1, len, f) != len)
+      err = 1;
+    if (fclose(f))
+      err = 1;
+  }
+
+  if (err || rename(tmpname, name)) {
+    print_error("Unable to write %s: %s", name, strerror(errno));
+    unlink(tmpname);
+    free(tmpname);
+    return 1;
+  }
+
+  free(tmpname);
+  return 0;
+}
+
+/* Add a downloaded image to the cache, and link its URL to it */
+static void store_cover(const struct cover *cv)
+{
+  char hex[65], base[70], *name, *link, *tmpname;
+
+  hash_buffer(hex, cv->data, cv->len);
+  sprintf(base, "%s%s", hex, get_image_suffix(cv->data, cv->len));
+
+  name = get_config_file_name("covers", base, NULL);
+  if (!name)
+    return;
+  if (access(name, F_OK) && write_cover_file(name, cv->data, cv->len)) {
+    free(name);
+    return;
+  }
+  free(name);
+
+  /* replace the link atomically, in case the image has changed */
+  link = get_cover_link_name(cv->url);
+  if (!link)
+    return;
+  tmpname = malloc(strlen(link) + 5);
+  if (!tmpname) {
+    print_error("Out of memory");
+    free(link);
+    return;
+  }
+
+  sprintf(tmpname, "%s.tmp", link);
+  unlink(tmpname);
+  if (symlink(base, tmpname) || rename(tmpname, link)) {
+    print_error("Unable to write %s: %s", link, strerror(errno));
+    unlink(tmpname);
+  }
+
+  free(link);
+  free(tmpname);
+}
+
+/* Callback for receiving an image */
+static size_t read_cover(void *ptr, size_t size, size_t n, void *data)
+{
+  struct cover *cv = data;
+  size_t len = size * n;
+  char *p;
+
+  if (cv->len + len > (size_t) COVER_MAX_SIZE)
+    return 0;
+
+  if (cv->len + len > cv->size) {
+    p = realloc(cv->data, 2 * (cv->len + len));
+    if (!p)
+      return 0;
+    cv->data = p;
+    cv->size = 2 * (cv->len + len);
+  }
+
+  memcpy(cv->data + cv->len, ptr, len);
+  cv->len += len;
+  return len;
+}
+
+/* Find or start fetching the cover art for a track.  Return NULL if
+   there is none. */
+static struct cover *get_cover(clamz_downloader *dl, const clamz_track *tr)
+{
+  const char *url = get_cover_url(tr);
+  struct cover *cv;
+
+  if (!url)
+    return NULL;
+
+  for (cv = dl->covers; cv; cv = cv->next)
+    if (!strcmp(cv->url, url))
+      return cv;
+
+  cv = malloc(sizeof(struct cover));
+  if (!cv || !(cv->url = strdup(url))) {
+    print_error("Out of memory");
+    free(cv);
+    return NULL;
+  }
+
+  cv->curl = NULL;
+  cv->done = 0;
+  cv->data = NULL;
+  cv->len = cv->size = 0;
+  cv->dirs = NULL;
+  cv->num_dirs = 0;
+  cv->error_buf[0] = 0;
+  cv->next = dl->covers;
+  dl->covers = cv;
+
+  if (!load_cover(cv)) {
+    cv->done = 1;
+    return cv;
+  }
+
+  if (!(cv->curl = get_handle(dl))) {
+    cv->done = 1;
+    return cv;
+  }
+
+  curl_easy_setopt(cv->curl, CURLOPT_ERRORBUFFER, cv->error_buf);
+  curl_easy_setopt(cv->curl, CURLOPT_WRITEFUNCTION, read_cover);
+  curl_easy_setopt(cv->curl, CURLOPT_WRITEDATA, cv);
+  curl_easy_setopt(cv->curl, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(cv->curl, CURLOPT_HEADERDATA, NULL);
+  curl_easy_setopt(cv->curl, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(cv->curl, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(cv->curl, CURLOPT_RANGE, NULL);
+  curl_easy_setopt(cv->curl, CURLOPT_PRIVATE, cv);
+  curl_easy_setopt(cv->curl, CURLOPT_URL, cv->url);
+
+  if (curl_multi_add_handle(dl->multi, cv->curl)) {
+    print_error("Unable to start transfer");
+    release_handle(dl, cv->curl);
+    cv->curl = NULL;
+    cv->done = 1;
+    return cv;
+  }
+
+  dl->num_covers_pending++;
+  return cv;
+}
+
+/* Find the cover being fetched by a curl handle */
+static struct cover *find_cover(clamz_downloader *dl, CURL *curl)
+{
+  struct cover *cv;
+
+  for (cv = dl->covers; cv; cv = cv->next)
+    if (cv->curl == curl)
+      return cv;
+  return NULL;
+}
+
+/* Handle a cover image request that has completed */
+static void cover_done(clamz_downloader *dl, struct cover *cv, CURLcode err)
+{
+  curl_multi_remove_handle(dl->multi, cv->curl);
+  release_handle(dl, cv->curl);
+  cv->curl = NULL;
+  cv->done = 1;
+  dl->num_covers_pending--;
+
+  if (err || !cv->len) {
+    print_error("Unable to download cover art %s: %s", cv->url,
+		(cv->error_buf[0] ? cv->error_buf : curl_easy_strerror(err)));
+    free(cv->data);
+    cv->data = NULL;
+  }
+  else
+    store_cover(cv);
+
+  /* tracks waiting for this image can now be tagged */
+  start_tags(dl);
+}
+
+/* Remember to save a track's cover art in its directory */
+static int add_cover_dir(struct cover *cv, const char *filename)
+{
+  const char *base = strrchr(filename, '/');
+  size_t n = (base ? (size_t) (base + 1 - filename) : 0);
+  char **dirs;
+  int i;
+
+  for (i = 0; i < cv->num_dirs; i++)
+    if (strlen(cv->dirs[i]) == n && !strncmp(cv->dirs[i], filename, n))
+      return 0;
+
+  dirs = realloc(cv->dirs, (cv->num_dirs + 1) * sizeof(char *));
+  if (!dirs || !(dirs[cv->num_dirs] = strndup(filename, n))) {
+    print_error("Out of memory");
+    if (dirs)
+      cv->dirs = dirs;
+    return 1;
+  }
+  cv->dirs = dirs;
+  cv->num_dirs++;
+  return 0;
+}
+
+/* Save cover art next to the tracks of this batch, unless the
+   directories already have some, and free the covers */
+static void save_covers(clamz_downloader *dl)
+{
+  struct cover *cv;
+  struct stat st;
+  char *name;
+  int i;
+
+  while ((cv = dl->covers)) {
+    dl->covers = cv->next;
+
+    for (i = 0; i < cv->num_dirs && cv->data; i++) {
+      name = malloc(strlen(cv->dirs[i]) + 10);
+      if (!name) {
+	print_error("Out of memory");
+	break;
+      }
+
+      sprintf(name, "%scover%s", cv->dirs[i],
+	      get_image_suffix(cv->data, cv->len));
+      if (stat(name, &st))
+	write_cover_file(name, cv->data, cv->len);
+      free(name);
+    }
+
+    for (i = 0; i < cv->num_dirs; i++)
+      free(cv->dirs[i]);
+    free(cv->dirs);
+    free(cv->data);
+    free(cv->url);
+    free(cv);
+  }
+}
+
+/* Check whether a transfer has finished.  Return 1 if so. */
+static int transfer_finished(struct transfer *xf)
+{
+  const clamz_config *cfg = xf->dl->cfg;
+  long b;
+
+  if (xf->num_segments > 0 || xf->writes_pending > 0)
+    return 0;
+  if (!xf->status && xf->num_pending > 0)
+    return 0;
+
+  if (!xf->status && xf->map) {
+    for (b = 0; b < xf->map_blocks; b++)
+      if (!block_done(xf, b))
+	break;
+
+    if (b < xf->map_blocks) {
+      /* shouldn't happen, but try again if it does */
+      xf->failures++;
+      if (xf->failures >= cfg->maxattempts || add_missing_blocks(xf)) {
+	print_error("Incomplete download of \"%s\"", xf->filename);
+	xf->status = 4;
+      }
+      else
+	return 0;
+    }
+  }
+
+  if (!xf->status && !cfg->tag && finish_hash(xf))
+    xf->status = 4;
+
+  if (!xf->status && !cfg->quiet)
+    print_message("Finished \"%s\"\n", xf->filename);
+
+  if (!xf->status && cfg->tag) {
+    if (queue_tag(xf))
+      xf->status = 4;
+  }
+  else if (!xf->status) {
+    add_digest(xf->dl, xf->filename, xf->digest);
+    record_track(xf->dl, xf->track, xf->filename, xf->digest);
+  }
+
+  if (!xf->status && cfg->save_cover && xf->cover)
+    add_cover_dir(xf->cover, xf->filename);
+
+  finish_transfer(xf);
+  return 1;
+}
+
+/* Update the transfer rates, and display the progress of all tracks
+   being downloaded */
+static void show_progress(clamz_downloader *dl, struct transfer *xfs,
+			  int next, int n, clamz_progress *pr, double t)
+{
+  struct transfer *xf;
+  double dt = t - dl->progress_time, received = 0;
+  int i, k = 0, finished = 0;
+
+  for (i = 0; i < next; i++) {
+    xf = &xfs[i];
+    received += xf->have;
+    if (!xf->active) {
+      finished++;
+      continue;
+    }
+
+    if (xf->have < xf->rate_have)
+      xf->rate_have = 0;	/* restarted */
+    if (dt > 0)
+      xf->rate += (((xf->have - xf->rate_have) / dt - xf->rate)
+		   * dt / (dt + PROGRESS_SMOOTHING));
+    xf->rate_have = xf->have;
+
+    if (xf->waiting || k >= dl->cfg->jobs)
+      continue;
+    pr[k].track = xf->track;
+    pr[k].filename = xf->filename;
+    pr[k].have = xf->have;
+    pr[k].size = xf->size;
+    pr[k].rate = xf->rate;
+    k++;
+  }
+
+  if (dt > 0 && received >= dl->received)
+    dl->rate += (((received - dl->received) / dt - dl->rate)
+		 * dt / (dt + PROGRESS_SMOOTHING));
+  dl->received = received;
+  dl->progress_time = t;
+
+  print_progress(pr, k, finished, n, received, dl->total_size, dl->rate);
+}
+
+/**************** Event loop ****************/
+
+#ifdef USE_EPOLL
+
+/* Add a file descriptor to the set watched by epoll */
+static int watch_fd(clamz_downloader *dl, int fd)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+
+  if (epoll_ctl(dl->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    print_error("Unable to initialize event loop: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/* Callback for updating the set of sockets watched by epoll */
+static int watch_socket(CURL *curl UNUSED, curl_socket_t s, int what,
+			void *data, void *socketp UNUSED)
+{
+  clamz_downloader *dl = data;
+  struct epoll_event ev;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(dl->epfd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  if (what & CURL_POLL_IN)
+    ev.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT)
+    ev.events |= EPOLLOUT;
+  ev.data.fd = s;
+
+  if (epoll_ctl(dl->epfd, EPOLL_CTL_MOD, s, &ev) && errno == ENOENT)
+    epoll_ctl(dl->epfd, EPOLL_CTL_ADD, s, &ev);
+  return 0;
+}
+
+/* Callback for setting the time at which curl next needs to be
+   called */
+static int set_timer(CURLM *multi UNUSED, long timeout_ms, void *data)
+{
+  clamz_downloader *dl = data;
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (timeout_ms > 0) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  }
+  else if (timeout_ms == 0) {
+    /* a zero value would disarm the timer */
+    its.it_value.tv_nsec = 1;
+  }
+
+  timerfd_settime(dl->timerfd, 0, &its, NULL);
+  return 0;
+}
+
+/* Wait until WAKE for network activity, curl timeouts, or finished
+   writes, and let curl handle whatever happened */
+static void wait_for_events(clamz_downloader *dl, double wake,
+			    int idle UNUSED)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int timeout = (int) ((wake - get_time()) * 1000);
+  int i, n, fd, mask, running;
+  uint64_t count;
+
+  n = epoll_wait(dl->epfd, events, MAX_EVENTS, (timeout > 0 ? timeout : 0));
+
+  for (i = 0; i < n; i++) {
+    fd = events[i].data.fd;
+
+    if (fd == dl->timerfd) {
+      if (read(dl->timerfd, &count, sizeof(count)) > 0)
+	curl_multi_socket_action(dl->multi, CURL_SOCKET_TIMEOUT, 0,
+				 &running);
+    }
+    else if (fd != dl->io_pipe[0]) {
+      mask = 0;
+      if (events[i].events & EPOLLIN)
+	mask |= CURL_CSELECT_IN;
+      if (events[i].events & EPOLLOUT)
+	mask |= CURL_CSELECT_OUT;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+	mask |= CURL_CSELECT_ERR;
+      curl_multi_socket_action(dl->multi, fd, mask, &running);
+    }
+  }
+}
+
+#else /* ! USE_EPOLL */
+
+/* Wait until WAKE for network activity or finished writes, and let
+   curl handle whatever happened.  IDLE is nonzero if every request is
+   paused. */
+static void wait_for_events(clamz_downloader *dl, double wake, int idle)
+{
+  struct curl_waitfd wfd;
+  struct pollfd pfd;
+  int timeout = (int) ((wake - get_time()) * 1000);
+  int running;
+
+  if (timeout < 0)
+    timeout = 0;
+
+  if (idle) {
+    /* curl_multi_wait returns at once if every request is paused */
+    pfd.fd = dl->io_pipe[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, timeout);
+  }
+  else {
+    wfd.fd = dl->io_pipe[0];
+    wfd.events = CURL_WAIT_POLLIN;
+    wfd.revents = 0;
+    curl_multi_wait(dl->multi, &wfd, (wfd.fd > -1 ? 1 : 0), timeout, NULL);
+  }
+
+  curl_multi_perform(dl->multi, &running);
+}
+
+#endif /* ! USE_EPOLL */
+
+/**************** Size probes ****************/
+
+/* A request for the first byte of a track, made to learn its size
+   before downloading anything */
+struct probe {
+  struct transfer *xf;
+  CURL *curl;
+  curl_off_t total;		/* size given by the server, or -1 */
+  char error_buf[CURL_ERROR_SIZE];
+  struct probe *next;
+};
+
+/* Callback for examining probe response headers */
+static size_t read_probe_header(char *ptr, size_t size, size_t n, void *data)
+{
+  struct probe *pb = data;
+  size_t len = size * n;
+  char *p;
+
+  if (len >= 5 && !strncmp(ptr, "HTTP/", 5)) {
+    pb->total = -1;
+  }
+  else if (len > 14 && !strncasecmp(ptr, "Content-Range:", 14)) {
+    p = memchr(ptr, '/', len);
+    if (p && p + 1 < ptr + len && p[1] >= '0' && p[1] <= '9')
+      pb->total = strtoll(p + 1, NULL, 10);
+  }
+
+  return len;
+}
+
+/* Callback for receiving the body of a probe response.  If the server
+   ignored the range and is sending the whole file, its size is known
+   from the headers, so stop there. */
+static size_t read_probe(void *ptr UNUSED, size_t size, size_t n, void *data)
+{
+  struct probe *pb = data;
+  curl_off_t len = -1;
+  long code = 0;
+
+  curl_easy_getinfo(pb->curl, CURLINFO_RESPONSE_CODE, &code);
+  if (code == 206)
+    return size * n;
+
+  curl_easy_getinfo(pb->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+  pb->total = len;
+  return 0;
+}
+
+/* Start a probe for the size of a track */
+static struct probe *start_probe(clamz_downloader *dl, struct transfer *xf)
+{
+  struct probe *pb;
+
+  pb = malloc(sizeof(struct probe));
+  if (!pb) {
+    print_error("Out of memory");
+    return NULL;
+  }
+
+  if (!(pb->curl = get_handle(dl))) {
+    free(pb);
+    return NULL;
+  }
+
+  pb->xf = xf;
+  pb->total = -1;
+  pb->error_buf[0] = 0;
+
+  curl_easy_setopt(pb->curl, CURLOPT_ERRORBUFFER, pb->error_buf);
+  curl_easy_setopt(pb->curl, CURLOPT_WRITEFUNCTION, read_probe);
+  curl_easy_setopt(pb->curl, CURLOPT_WRITEDATA, pb);
+  curl_easy_setopt(pb->curl, CURLOPT_HEADERFUNCTION, read_probe_header);
+  curl_easy_setopt(pb->curl, CURLOPT_HEADERDATA, pb);
+  curl_easy_setopt(pb->curl, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(pb->curl, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(pb->curl, CURLOPT_RANGE, "0-0");
+  curl_easy_setopt(pb->curl, CURLOPT_PRIVATE, pb);
+  curl_easy_setopt(pb->curl, CURLOPT_URL, xf->track->location);
+
+  if (curl_multi_add_handle(dl->multi, pb->curl)) {
+    print_error("Unable to start transfer");
+    release_handle(dl, pb->curl);
+    free(pb);
+    return NULL;
+  }
+
+  return pb;
+}
+
+/* Handle a probe that has completed.  A track whose size can't be
+   found is simply downloaded last. */
+static void probe_done(clamz_downloader *dl, struct probe *pb, CURLcode err)
+{
+  curl_multi_remove_handle(dl->multi, pb->curl);
+  release_handle(dl, pb->curl);
+
+  if ((!err || err == CURLE_WRITE_ERROR) && pb->total >= 0)
+    pb->xf->expected = pb->total;
+  else if (dl->cfg->verbose)
+    print_message("Unable to find the size of \"%s\": %s\n",
+		  pb->xf->filename,
+		  (pb->error_buf[0] ? pb->error_buf : curl_easy_strerror(err)));
+}
+
+/* Find the size of each track, by asking for its first byte.  HEAD
+   requests are forbidden, but ranges are not.  As many probes run at
+   once as there will be connections downloading the tracks. */
+static void probe_sizes(clamz_downloader *dl, struct transfer *xfs, int n)
+{
+  struct probe *probes = NULL, *pb, **pp;
+  struct cover *cover;
+  CURLMsg *msg;
+  int next = 0, pending = 0, msgs;
+  int max = dl->cfg->jobs * dl->cfg->segments;
+
+  while (next < n || pending > 0) {
+    while (next < n && pending < max) {
+      if (!xfs[next].status && (pb = start_probe(dl, &xfs[next]))) {
+	pb->next = probes;
+	probes = pb;
+	pending++;
+      }
+      next++;
+    }
+
+    if (!pending)
+      break;
+
+    wait_for_events(dl, get_time() + 1, 0);
+
+    while ((msg = curl_multi_info_read(dl->multi, &msgs))) {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+
+      if ((cover = find_cover(dl, msg->easy_handle))) {
+	cover_done(dl, cover, msg->data.result);
+	continue;
+      }
+
+      for (pp = &probes; *pp; pp = &(*pp)->next) {
+	if ((*pp)->curl == msg->easy_handle) {
+	  pb = *pp;
+	  *pp = pb->next;
+	  probe_done(dl, pb, msg->data.result);
+	  free(pb);
+	  pending--;
+	  break;
+	}
+      }
+    }
+  }
+}
+
+/* Compare the sizes of two tracks; tracks of unknown size come last,
+   and otherwise the order of the playlist is kept */
+static int compare_sizes(const struct transfer *x, const struct transfer *y,
+			 int largest)
+{
+  if ((x->expected < 0) != (y->expected < 0))
+    return (x->expected < 0 ? 1 : -1);
+  if (x->expected != y->expected)
+    return ((x->expected < y->expected) != largest ? -1 : 1);
+  return x->index - y->index;
+}
+
+static int compare_shortest(const void *a, const void *b)
+{
+  return compare_sizes(a, b, 0);
+}
+
+static int compare_largest(const void *a, const void *b)
+{
+  return compare_sizes(a, b, 1);
+}
+
+/* Download a list of tracks, running up to cfg->jobs transfers at
+   once.  The result for each track is stored in status[]. */
+int download_tracks(clamz_downloader *dl, clamz_track **tracks, int n,
+		    int *status)
+{
+  struct transfer *xfs;
+  struct transfer *xf;
+  struct segment *seg;
+  struct segment **paused;
+  struct cover *cover;
+  clamz_progress *progress;
+  CURLMsg *msg;
+  int next = 0, first = 0, active = 0, remaining = n;
+  int i, k, msgs, running, npaused;
+  double t, wake;
+
+  xfs = malloc(n * sizeof(struct transfer));
+  paused = malloc(dl->cfg->jobs * dl->cfg->segments
+		  * sizeof(struct segment *));
+  progress = malloc(dl->cfg->jobs * sizeof(clamz_progress));
+  if (!xfs || !paused || !progress) {
+    print_error("Out of memory");
+    free(xfs);
+    free(paused);
+    free(progress);
+    return 1;
+  }
+
+  for (i = 0; i < n; i++) {
+    xf = &xfs[i];
+    xf->dl = dl;
+    xf->track = tracks[i];
+    xf->index = i;
+    xf->filename = NULL;
+    xf->outfd = -1;
+    xf->directfd = -1;
+    xf->failures = 0;
+    xf->status = 0;
+    xf->active = xf->waiting = xf->nosplit = xf->journal_dirty = 0;
+    xf->validating = xf->restart = xf->preallocated = 0;
+    xf->size = xf->expected = -1;
+    xf->have = 0;
+    xf->writes_pending = 0;
+    xf->segments = NULL;
+    xf->num_segments = 0;
+    xf->pending = NULL;
+    xf->num_pending = 0;
+    xf->journal_name = NULL;
+    xf->journal_job = NULL;
+    xf->committed = 0;
+    xf->etag[0] = xf->last_modified[0] = 0;
+    xf->headers = NULL;
+    xf->map = NULL;
+    xf->map_blocks = 0;
+    xf->md = NULL;
+    xf->hashed = 0;
+    xf->retry_time = xf->split_time = xf->journal_time = 0;
+    xf->split_have = 0;
+    xf->rate = 0;
+    xf->rate_have = 0;
+    xf->bucket.rate = 0;
+    xf->host_bucket = NULL;
+    xf->cover = NULL;
+    status[i] = 0;
+  }
+
+  plan_outputs(xfs, n);
+
+  /* start fetching cover art, alongside the tracks themselves */
+  if (!dl->cfg->printonly && (dl->cfg->save_cover || dl->cfg->embed_cover))
+    for (i = 0; i < n; i++)
+      if (!xfs[i].status)
+	xfs[i].cover = get_cover(dl, tracks[i]);
+
+  /* find out how big the tracks are, and put them in order */
+  if (!dl->cfg->printonly && dl->cfg->order != ORDER_PLAYLIST) {
+    probe_sizes(dl, xfs, n);
+    qsort(xfs, n, sizeof(struct transfer),
+	  (dl->cfg->order == ORDER_LARGEST
+	   ? compare_largest : compare_shortest));
+  }
+
+#ifdef USE_STATVFS
+  check_free_space(xfs, n);
+#endif
+
+  /* the total size is known if every track has been probed */
+  dl->total_size = 0;
+  for (i = k = 0; i < n; i++) {
+    if (xfs[i].status)
+      continue;
+    if (xfs[i].expected < 0) {
+      dl->total_size = -1;
+      break;
+    }
+    dl->total_size += xfs[i].expected;
+    k++;
+  }
+
+  if (dl->total_size > 0 && !dl->cfg->quiet)
+    print_message("%d %s to download, %.1fM in total\n", k,
+		  (k == 1 ? "track" : "tracks"),
+		  dl->total_size / (1024 * 1024));
+
+  dl->progress_time = get_time();
+  dl->received = dl->rate = 0;
+
+  while (remaining > 0 || dl->num_covers_pending > 0) {
+    /* start new transfers */
+    while (next < n && active < dl->cfg->jobs) {
+      xf = &xfs[next];
+      if (!xf->status)
+	xf->status = open_transfer(xf);
+      if (xf->status < 0)
+	xf->status = 0;
+      else if (!xf->status) {
+	xf->active = 1;
+	active++;
+      }
+
+      if (!xf->active) {
+	finish_transfer(xf);
+	status[xf->index] = xf->status;
+	remaining--;
+      }
+      next++;
+    }
+
+    t = get_time();
+    wake = t + 1;
+    running = npaused = 0;
+    check_rate_file(dl, t);
+
+    while (first < next && !xfs[first].active)
+      first++;
+
+    for (i = first; i < next; i++) {
+      xf = &xfs[i];
+      if (!xf->active)
+	continue;
+
+      if (xf->waiting) {
+	/* a failed transfer goes to the back of the queue, and starts
+	   again once no new tracks are waiting for a slot */
+	if (xf->retry_time > t) {
+	  if (xf->retry_time < wake)
+	    wake = xf->retry_time;
+	  continue;
+	}
+	if (active >= dl->cfg->jobs)
+	  continue;
+	xf->waiting = 0;
+	active++;
+      }
+
+      schedule_segments(xf, t);
+
+      if (xf->journal_dirty && t >= xf->journal_time + JOURNAL_INTERVAL) {
+	queue_journal(xf);
+	xf->journal_time = t;
+      }
+
+      if (transfer_finished(xf)) {
+	xf->active = 0;
+	status[xf->index] = xf->status;
+	active--;
+	remaining--;
+	continue;
+      }
+
+      if (xf->retry_time > t && !xf->num_segments) {
+	/* let another track use this slot until it is time to retry */
+	xf->waiting = 1;
+	active--;
+      }
+
+      if (xf->retry_time && xf->retry_time < wake)
+	wake = xf->retry_time;
+      if (xf->map && !xf->nosplit && xf->num_segments > 0
+	  && xf->num_segments < dl->cfg->segments
+	  && xf->split_time + SPLIT_INTERVAL < wake)
+	wake = xf->split_time + SPLIT_INTERVAL;
+      running += xf->num_segments;
+
+      for (seg = xf->segments; seg; seg = seg->next)
+	if (seg->paused)
+	  paused[npaused++] = seg;
+    }
+
+    if (npaused > 0) {
+      resume_segments(dl, paused, npaused);
+      if (t + BUCKET_TICK < wake)
+	wake = t + BUCKET_TICK;
+
+      for (i = npaused = 0; i < next; i++)
+	for (seg = xfs[i].segments; seg; seg = seg->next)
+	  if (seg->paused)
+	    npaused++;
+    }
+
+    if (remaining == 0 && !dl->num_covers_pending)
+      break;
+
+    if (!dl->cfg->quiet) {
+      if (t >= dl->progress_time + dl->progress_interval)
+	show_progress(dl, xfs, next, n, progress, t);
+      if (dl->progress_time + dl->progress_interval < wake)
+	wake = dl->progress_time + dl->progress_interval;
+    }
+
+    if (next < n && active < dl->cfg->jobs)
+      continue;
+
+    /* if every request is paused, there is nothing to do but wait
+       for the next retry, or for bandwidth to become available */
+    wait_for_events(dl, wake,
+		    (running == npaused && !dl->num_covers_pending));
+    process_writes(dl);
+
+    while ((msg = curl_multi_info_read(dl->multi, &msgs))) {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+
+      if ((cover = find_cover(dl, msg->easy_handle))) {
+	cover_done(dl, cover, msg->data.result);
+	continue;
+      }
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &seg);
+      segment_done(seg, msg->data.result);
+    }
+  }
+
+  clear_progress();
+  wait_for_tags(dl);
+  save_covers(dl);
+  save_metrics(dl);
+  if (!dl->cfg->printonly) {
+    save_manifests(dl);
+    save_library(dl->library);
+  }
+  free(xfs);
+  free(paused);
+  free(progress);
+
+  for (i = 0; i < n; i++)
+    if (status[i])
+      return status[i];
   return 0;
 }
+
+/* Download a single track */
+int download_track(clamz_downloader *dl, clamz_track *tr)
+{
+  int status;
+
+  return download_tracks(dl, &tr, 1, &status);
+}
@@ -0,0 +1,593 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "clamz.h"
+
+/* The library index records every track that has been downloaded,
+   so that it need not be downloaded again.  It is a hash table,
+   keyed by ASIN, which is mapped into memory and searched in place,
+   so that looking up a track costs the same however large the
+   library is.  The file is written in the machine's native byte
+   order, and is simply started afresh if it cannot be used.
+
+   Tracks downloaded during a run are kept in a list until the index
+   is saved.  Their file names are then appended to the string area,
+   and their slots filled in place, so saving costs the same however
+   large the library is.  Only when the table becomes half full is the
+   whole file rewritten (with twice as many slots) and renamed into
+   place.  Changes are made while holding a lock on a separate file,
+   so that several processes can share the index. */
+
+#define LIBRARY_MAGIC "clamzlib"
+#define LIBRARY_VERSION 1
+
+/* Maximum length of an ASIN, plus one */
+#define ASIN_SIZE 16
+
+/* Minimum number of slots in the hash table */
+#define MIN_SLOTS 64
+
+struct library_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_slots;		/* size of hash table (a power of 2) */
+  uint32_t num_entries;
+  uint32_t reserved;
+  uint64_t strings_size;	/* total length of file names */
+};
+
+struct library_slot {
+  char asin[ASIN_SIZE];		/* NUL-padded, or empty if slot is free */
+  uint64_t size;
+  uint64_t name_offset;		/* offset of file name in string area */
+  unsigned char digest[32];	/* SHA-256 of file, or zero if unknown */
+};
+
+/* A track downloaded during this run */
+struct library_track {
+  char asin[ASIN_SIZE];
+  char *filename;
+  uint64_t size;
+  unsigned char digest[32];	/* or zero if unknown */
+  struct library_track *next;
+};
+
+struct _clamz_library {
+  char *filename;
+
+  /* contents of the index file */
+  void *map;
+  size_t map_size;
+  const struct library_slot *slots;
+  uint32_t num_slots;
+  uint32_t num_entries;
+  const char *strings;
+  uint64_t strings_size;
+
+  struct library_track *added;
+};
+
+/* Hash an ASIN (FNV-1a) */
+static uint32_t hash_asin(const char *asin)
+{
+  uint32_t h = 2166136261U;
+
+  while (*asin) {
+    h ^= (unsigned char) *asin++;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+/* Find the slot for an ASIN: either the slot containing it, or the
+   empty slot where it would be added.  Return NULL if the table is
+   full. */
+static const struct library_slot *find_slot(const struct library_slot *slots,
+					    uint32_t num_slots,
+					    const char *asin)
+{
+  uint32_t i, j;
+
+  i = hash_asin(asin) & (num_slots - 1);
+  for (j = 0; j < num_slots; j++) {
+    if (!slots[i].asin[0] || !strncmp(slots[i].asin, asin, ASIN_SIZE))
+      return &slots[i];
+    i = (i + 1) & (num_slots - 1);
+  }
+  return NULL;
+}
+
+/* Size of the header and hash table */
+static uint64_t table_size(const struct library_header *hdr)
+{
+  return (sizeof(struct library_header)
+	  + (uint64_t) hdr->num_slots * sizeof(struct library_slot));
+}
+
+/* Size of the valid part of the index file.  The file may be longer
+   than this, if a process was interrupted while adding to it. */
+static uint64_t library_size(const struct library_header *hdr)
+{
+  return table_size(hdr) + hdr->strings_size;
+}
+
+/* Check that an index file header is valid.  Return 0 if so. */
+static int check_header(const struct library_header *hdr,
+			uint64_t file_size)
+{
+  return (memcmp(hdr->magic, LIBRARY_MAGIC, 8)
+	  || hdr->version != LIBRARY_VERSION
+	  || hdr->num_slots < MIN_SLOTS
+	  || (hdr->num_slots & (hdr->num_slots - 1))
+	  || hdr->num_entries >= hdr->num_slots
+	  || file_size < library_size(hdr));
+}
+
+/* Unmap the index file */
+static void unmap_library(clamz_library *lib)
+{
+  if (lib->map)
+    munmap(lib->map, lib->map_size);
+  lib->map = NULL;
+  lib->map_size = 0;
+  lib->slots = NULL;
+  lib->num_slots = lib->num_entries = 0;
+  lib->strings = NULL;
+  lib->strings_size = 0;
+}
+
+/* Map the index file into memory.  A missing or invalid file is
+   treated as an empty library. */
+static void map_library(clamz_library *lib)
+{
+  const struct library_header *hdr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  unmap_library(lib);
+
+  fd = open(lib->filename, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      print_error("Unable to read %s: %s", lib->filename, strerror(errno));
+    return;
+  }
+
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct library_header)) {
+    print_error("Ignoring invalid library index %s", lib->filename);
+    close(fd);
+    return;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    print_error("Unable to read %s: %s", lib->filename, strerror(errno));
+    return;
+  }
+
+  hdr = map;
+  if (check_header(hdr, st.st_size)
+      || (hdr->strings_size > 0
+	  && ((const char *) map)[library_size(hdr) - 1] != 0)) {
+    print_error("Ignoring invalid library index %s", lib->filename);
+    munmap(map, st.st_size);
+    return;
+  }
+
+  lib->map = map;
+  lib->map_size = st.st_size;
+  lib->slots = (const struct library_slot *) (hdr + 1);
+  lib->num_slots = hdr->num_slots;
+  lib->num_entries = hdr->num_entries;
+  lib->strings = (const char *) (lib->slots + hdr->num_slots);
+  lib->strings_size = hdr->strings_size;
+}
+
+/* Lock the library index, either to read it (TYPE = F_RDLCK) or to
+   change it (TYPE = F_WRLCK.)  Return a file descriptor to be closed
+   to release the lock, or -1 if an error occurs. */
+static int lock_library(const clamz_library *lib, int type)
+{
+  struct flock fl;
+  char *lockname;
+  int fd;
+
+  lockname = malloc(strlen(lib->filename) + 6);
+  if (!lockname) {
+    print_error("Out of memory");
+    return -1;
+  }
+  sprintf(lockname, "%s.lock", lib->filename);
+
+  fd = open(lockname, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    print_error("Unable to open %s: %s", lockname, strerror(errno));
+    free(lockname);
+    return -1;
+  }
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+  while (fcntl(fd, F_SETLKW, &fl)) {
+    if (errno != EINTR) {
+      print_error("Unable to lock %s: %s", lockname, strerror(errno));
+      close(fd);
+      free(lockname);
+      return -1;
+    }
+  }
+
+  free(lockname);
+  return fd;
+}
+
+/* Open the library index */
+clamz_library *open_library()
+{
+  clamz_library *lib = malloc(sizeof(clamz_library));
+  int lockfd;
+
+  if (!lib) {
+    print_error("Out of memory");
+    return NULL;
+  }
+
+  lib->map = NULL;
+  lib->added = NULL;
+  lib->filename = get_config_file_name(NULL, "library", NULL);
+  if (!lib->filename) {
+    free(lib);
+    return NULL;
+  }
+
+  /* the lock only guards against reading the file while another
+     process is adding to it */
+  lockfd = lock_library(lib, F_RDLCK);
+  map_library(lib);
+  if (lockfd >= 0)
+    close(lockfd);
+  return lib;
+}
+
+/* Free tracks added during this run */
+static void free_added(clamz_library *lib)
+{
+  struct library_track *t;
+
+  while ((t = lib->added)) {
+    lib->added = t->next;
+    free(t->filename);
+    free(t);
+  }
+}
+
+/* Close the library index, discarding any unsaved changes */
+void close_library(clamz_library *lib)
+{
+  unmap_library(lib);
+  free_added(lib);
+  free(lib->filename);
+  free(lib);
+}
+
+/* Look up a track in the library.  Return 0 if it has been
+   downloaded before, 1 if not. */
+int find_library_track(const clamz_library *lib, const char *asin,
+		       const char **filename, long long *size)
+{
+  const struct library_track *t;
+  const struct library_slot *slot;
+
+  if (!asin || !asin[0] || strlen(asin) >= ASIN_SIZE)
+    return 1;
+
+  for (t = lib->added; t; t = t->next) {
+    if (!strcmp(t->asin, asin)) {
+      *filename = t->filename;
+      *size = t->size;
+      return 0;
+    }
+  }
+
+  if (!lib->num_slots)
+    return 1;
+
+  slot = find_slot(lib->slots, lib->num_slots, asin);
+  if (!slot || !slot->asin[0] || slot->name_offset >= lib->strings_size)
+    return 1;
+
+  *filename = lib->strings + slot->name_offset;
+  *size = slot->size;
+  return 0;
+}
+
+/* Record a downloaded track, and its SHA-256 digest if known.  The
+   change is not written to disk until save_library() is called. */
+int add_library_track(clamz_library *lib, const char *asin,
+		      const char *filename, long long size,
+		      const unsigned char *digest)
+{
+  struct library_track *t, **prev;
+
+  if (!asin || !asin[0] || strlen(asin) >= ASIN_SIZE)
+    return 0;
+
+  for (prev = &lib->added; (t = *prev); prev = &t->next) {
+    if (!strcmp(t->asin, asin)) {
+      *prev = t->next;
+      free(t->filename);
+      free(t);
+      break;
+    }
+  }
+
+  t = malloc(sizeof(struct library_track));
+  if (!t || !(t->filename = strdup(filename))) {
+    print_error("Out of memory");
+    free(t);
+    return 1;
+  }
+
+  strcpy(t->asin, asin);
+  t->size = size;
+  if (digest)
+    memcpy(t->digest, digest, sizeof(t->digest));
+  else
+    memset(t->digest, 0, sizeof(t->digest));
+  t->next = lib->added;
+  lib->added = t;
+  return 0;
+}
+
+/* Add an entry to a new hash table.  Entries already present take
+   precedence. */
+static void insert_slot(struct library_slot *slots, uint32_t num_slots,
+			uint32_t *num_entries, const char *asin,
+			const char *filename, uint64_t size,
+			const unsigned char *digest, char *strings,
+			uint64_t *strings_size)
+{
+  struct library_slot *slot;
+  size_t n;
+
+  slot = (struct library_slot *) find_slot(slots, num_slots, asin);
+  if (!slot || slot->asin[0])
+    return;
+
+  strcpy(slot->asin, asin);
+  slot->size = size;
+  slot->name_offset = *strings_size;
+  if (digest)
+    memcpy(slot->digest, digest, sizeof(slot->digest));
+
+  n = strlen(filename) + 1;
+  memcpy(strings + *strings_size, filename, n);
+  *strings_size += n;
+  (*num_entries)++;
+}
+
+/* Write a new library index, including any tracks added during this
+   run.  Return 0 if successful. */
+static int rewrite_library(clamz_library *lib)
+{
+  struct library_header hdr;
+  struct library_slot *slots;
+  const struct library_slot *old;
+  const struct library_track *t;
+  char *strings, *tmpname;
+  uint64_t max_strings;
+  uint32_t num_slots, max_entries, i;
+  FILE *f;
+
+  /* pick up anything saved by another process in the meantime */
+  map_library(lib);
+
+  max_entries = lib->num_entries;
+  max_strings = lib->strings_size;
+  for (t = lib->added; t; t = t->next) {
+    max_entries++;
+    max_strings += strlen(t->filename) + 1;
+  }
+
+  num_slots = MIN_SLOTS;
+  while (num_slots < 2 * max_entries)
+    num_slots *= 2;
+
+  slots = calloc(num_slots, sizeof(struct library_slot));
+  strings = malloc(max_strings);
+  tmpname = malloc(strlen(lib->filename) + 5);
+  if (!slots || !strings || !tmpname) {
+    print_error("Out of memory");
+    free(slots);
+    free(strings);
+    free(tmpname);
+    return 1;
+  }
+
+  memcpy(hdr.magic, LIBRARY_MAGIC, 8);
+  hdr.version = LIBRARY_VERSION;
+  hdr.num_slots = num_slots;
+  hdr.num_entries = 0;
+  hdr.reserved = 0;
+  hdr.strings_size = 0;
+
+  /* newer entries first, so that they replace older ones */
+  for (t = lib->added; t; t = t->next)
+    insert_slot(slots, num_slots, &hdr.num_entries, t->asin, t->filename,
+		t->size, t->digest, strings, &hdr.strings_size);
+
+  for (i = 0; i < lib->num_slots; i++) {
+    old = &lib->slots[i];
+    if (old->asin[0] && memchr(old->asin, 0, ASIN_SIZE)
+	&& old->name_offset < lib->strings_size)
+      insert_slot(slots, num_slots, &hdr.num_entries, old->asin,
+		  lib->strings + old->name_offset, old->size, old->digest,
+		  strings, &hdr.strings_size);
+  }
+
+  sprintf(tmpname, "%s.tmp", lib->filename);
+  f = fopen(tmpname, "wb");
+  if (f) {
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(slots, sizeof(struct library_slot), num_slots, f);
+    fwrite(strings, 1, hdr.strings_size, f);
+    if (ferror(f)) {
+      fclose(f);
+      f = NULL;
+    }
+    else if (fclose(f))
+      f = NULL;
+  }
+
+  if (!f || rename(tmpname, lib->filename)) {
+    print_error("Unable to write %s: %s", lib->filename, strerror(errno));
+    unlink(tmpname);
+    free(slots);
+    free(strings);
+    free(tmpname);
+    return 3;
+  }
+
+  free(slots);
+  free(strings);
+  free(tmpname);
+  return 0;
+}
+
+/* Add the tracks downloaded during this run to the existing index
+   file, in place.  Return 0 if successful, -1 if the file must be
+   rewritten instead (because it is missing, invalid or too full), or
+   a positive value if an error occurs. */
+static int update_library(clamz_library *lib)
+{
+  struct library_header hdr, *mhdr;
+  struct library_slot *slots, *slot;
+  const struct library_track *t;
+  struct stat st;
+  uint64_t end, tsize;
+  uint32_t n = 0;
+  size_t len;
+  void *map;
+  int fd, ok = 1;
+
+  for (t = lib->added; t; t = t->next)
+    n++;
+
+  fd = open(lib->filename, O_RDWR);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &st)
+      || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+      || check_header(&hdr, st.st_size)
+      || (uint64_t) hdr.num_entries + n > hdr.num_slots / 2) {
+    close(fd);
+    return -1;
+  }
+
+  /* write the file names first, so that no slot ever refers to a
+     name which has not reached the disk */
+  end = library_size(&hdr);
+  for (t = lib->added; t && ok; t = t->next) {
+    len = strlen(t->filename) + 1;
+    if (pwrite(fd, t->filename, len, end) != (ssize_t) len)
+      ok = 0;
+    end += len;
+  }
+
+  tsize = table_size(&hdr);
+  if (ok && fdatasync(fd))
+    ok = 0;
+  if (ok && (map = mmap(NULL, tsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0)) == MAP_FAILED)
+    ok = 0;
+
+  if (ok) {
+    mhdr = map;
+    slots = (struct library_slot *) (mhdr + 1);
+    end = hdr.strings_size;
+
+    /* fill in each slot's other fields before its ASIN, so that
+       other processes never see a half-written entry */
+    for (t = lib->added; t; t = t->next) {
+      slot = (struct library_slot *) find_slot(slots, hdr.num_slots,
+					       t->asin);
+      slot->size = t->size;
+      slot->name_offset = end;
+      memcpy(slot->digest, t->digest, sizeof(slot->digest));
+      if (!slot->asin[0]) {
+	strncpy(slot->asin, t->asin, ASIN_SIZE);
+	mhdr->num_entries++;
+      }
+      end += strlen(t->filename) + 1;
+    }
+    mhdr->strings_size = end;
+
+    if (msync(map, tsize, MS_SYNC))
+      ok = 0;
+    munmap(map, tsize);
+  }
+
+  if (!ok)
+    print_error("Unable to write %s: %s", lib->filename, strerror(errno));
+  close(fd);
+  return (ok ? 0 : 3);
+}
+
+/* Save any tracks added during this run to the library index.  Return
+   0 if successful. */
+int save_library(clamz_library *lib)
+{
+  int lockfd, status;
+
+  if (!lib->added)
+    return 0;
+
+  if ((lockfd = lock_library(lib, F_WRLCK)) < 0)
+    return 3;
+
+  status = update_library(lib);
+  if (status < 0)
+    status = rewrite_library(lib);
+
+  if (!status) {
+    free_added(lib);
+    map_library(lib);
+  }
+
+  close(lockfd);
+  return status;
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -127,6 +128,88 @@ static void remove_forbidden_chars(clamz_config *cfg, const char *delset)
   }
 }
 
+/* Parse a positive integer argument */
+static int parse_count(const char *s, int *value)
+{
+  char *end;
+  long n;
+
+  n = strtol(s, &end, 10);
+  if (end == s || *end || n < 1 || n > 1000) {
+    print_error("Invalid number '%s'", s);
+    return 1;
+  }
+
+  *value = n;
+  return 0;
+}
+
+/* Parse the name of a download order */
+static int parse_order(const char *s, int *value)
+{
+  if (!strcasecmp(s, "playlist"))
+    *value = ORDER_PLAYLIST;
+  else if (!strcasecmp(s, "shortest"))
+    *value = ORDER_SHORTEST;
+  else if (!strcasecmp(s, "largest"))
+    *value = ORDER_LARGEST;
+  else {
+    print_error("Invalid order '%s'", s);
+    return 1;
+  }
+  return 0;
+}
+
+/* Parse a size in bytes, or a transfer rate in bytes per second, with
+   an optional K, M or G suffix */
+int parse_size(const char *s, long *value)
+{
+  char *end;
+  double n;
+
+  n = strtod(s, &end);
+  if (*end == 'k' || *end == 'K') {
+    n *= 1024;
+    end++;
+  }
+  else if (*end == 'm' || *end == 'M') {
+    n *= 1024 * 1024;
+    end++;
+  }
+  else if (*end == 'g' || *end == 'G') {
+    n *= 1024 * 1024 * 1024;
+    end++;
+  }
+
+  if (end == s || *end || n < 0 || n > 1e12 || n > LONG_MAX) {
+    print_error("Invalid size '%s'", s);
+    return 1;
+  }
+
+  *value = (long) n;
+  return 0;
+}
+
+/* Parse the size of the buffer used for each connection.  Each
+   segment of each job may have two buffers of this size, so it is
+   kept to a sensible range. */
+static int parse_buffer_size(const char *s, long *value)
+{
+  long n;
+
+  if (parse_size(s, &n))
+    return 1;
+
+  if (n != 0 && (n < MIN_BUFFER_SIZE || n > MAX_BUFFER_SIZE)) {
+    print_error("Invalid buffer size '%s' (must be 0, or from 4K to 64M)",
+		s);
+    return 1;
+  }
+
+  *value = n;
+  return 0;
+}
+
 static void delchar(char *p)
 {
   while (p[0]) {
@@ -203,6 +286,35 @@ static int read_user_config(clamz_config *cfg)
     "## The set of ASCII characters which are disallowed.  (Control\n"
     "## characters and slashes are always disallowed.)\n"
     "ForbidChars      \"!\\\"$*:;<>?\\\\`|~\"\n"
+    "\n"
+    "## Number of tracks to download at once.\n"
+    "# Jobs            4\n"
+    "\n"
+    "## Maximum number of connections to use for a single track.\n"
+    "# Segments        4\n"
+    "\n"
+    "## Maximum download rate, in bytes per second (a suffix of K, M\n"
+    "## or G may be used.)  This may be changed while clamz is running\n"
+    "## by writing a new rate to ~/.clamz/rate-limit.\n"
+    "# RateLimit       500K\n"
+    "\n"
+    "## Amount of data to collect before writing to disk.\n"
+    "# BufferSize      1M\n"
+    "\n"
+    "## File to which a line describing each HTTP request is appended.\n"
+    "# MetricsFile     /var/log/clamz/requests.jsonl\n"
+    "\n"
+    "## File to which totals are written, for the Prometheus node\n"
+    "## exporter's textfile collector.\n"
+    "# MetricsTextfile /var/lib/node_exporter/textfile/clamz.prom\n"
+    "\n"
+    "## Set to True to write ID3 tags to downloaded tracks.\n"
+    "# WriteTags       True\n"
+    "\n"
+    "## Set to True to save cover art as cover.jpg in each album's\n"
+    "## directory, or to add it to the tags of each track.\n"
+    "# SaveCover       True\n"
+    "# EmbedCover      True\n"
     "\n";
 
   char *cfgname;
@@ -272,6 +384,64 @@ static int read_user_config(clamz_config *cfg)
       else
 	cfg->allowupper = 0;
     }
+    else if ((p = checkcmd(buf, "Jobs"))) {
+      if (parse_count(p, &cfg->jobs))
+	print_error("Invalid setting on line %d of '%s'", linenum, cfgname);
+    }
+    else if ((p = checkcmd(buf, "Segments"))) {
+      if (parse_count(p, &cfg->segments))
+	print_error("Invalid setting on line %d of '%s'", linenum, cfgname);
+    }
+    else if ((p = checkcmd(buf, "Order"))) {
+      if (parse_order(p, &cfg->order))
+	print_error("Invalid setting on line %d of '%s'", linenum, cfgname);
+    }
+    else if ((p = checkcmd(buf, "RateLimit"))) {
+      if (parse_size(p, &cfg->rate_limit))
+	print_error("Invalid setting on line %d of '%s'", linenum, cfgname);
+    }
+    else if ((p = checkcmd(buf, "BufferSize"))) {
+      if (parse_buffer_size(p, &cfg->buffer_size))
+	print_error("Invalid setting on line %d of '%s'", linenum, cfgname);
+    }
+    else if ((p = checkcmd(buf, "MetricsFile"))) {
+      if (cfg->metrics_file)
+	free(cfg->metrics_file);
+      cfg->metrics_file = strdup(p);
+
+      if (!cfg->metrics_file) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if ((p = checkcmd(buf, "MetricsTextfile"))) {
+      if (cfg->metrics_textfile)
+	free(cfg->metrics_textfile);
+      cfg->metrics_textfile = strdup(p);
+
+      if (!cfg->metrics_textfile) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if ((p = checkcmd(buf, "WriteTags"))) {
+      if (*p == 't' || *p == 'T')
+	cfg->tag = 1;
+      else
+	cfg->tag = 0;
+    }
+    else if ((p = checkcmd(buf, "SaveCover"))) {
+      if (*p == 't' || *p == 'T')
+	cfg->save_cover = 1;
+      else
+	cfg->save_cover = 0;
+    }
+    else if ((p = checkcmd(buf, "EmbedCover"))) {
+      if (*p == 't' || *p == 'T')
+	cfg->embed_cover = 1;
+      else
+	cfg->embed_cover = 0;
+    }
     else if ((p = checkcmd(buf, "AllowUTF8"))) {
       if (*p == 't' || *p == 'T')
 	cfg->allowutf8 = 1;
@@ -296,6 +466,26 @@ static void print_usage(const char* progname)
 	  " -d, --output-dir=DIR:    write output to directory DIR (may also\n"
 	  "                          contain variables)\n"
 	  " -r, --resume:            resume a partial download\n"
+	  " --redownload:            download tracks even if they have been\n"
+	  "                          downloaded before\n"
+	  " --tag:                   write ID3 tags to downloaded tracks\n"
+	  " --no-tag:                don't write ID3 tags (overrides the\n"
+	  "                          WriteTags setting)\n"
+	  " --save-cover:            save cover art in each album's directory\n"
+	  " --embed-cover:           add cover art to each track's tags\n"
+	  " -j, --jobs=N:            download up to N tracks at once\n"
+	  " --segments=N:            use up to N connections for each track\n"
+	  " --order=ORDER:           download tracks in the given order\n"
+	  "                          (playlist, shortest or largest)\n"
+	  " --limit-rate=RATE:       limit total download rate (bytes/second)\n"
+	  " --limit-rate-host=RATE:  limit download rate from each server\n"
+	  " --limit-rate-track=RATE: limit download rate of each track\n"
+	  " --buffer-size=SIZE:      write to disk in blocks of SIZE bytes\n"
+	  " --direct-io:             bypass the page cache when writing\n"
+	  " --watch=DIR:             keep running, and download AMZ files as\n"
+	  "                          they are added to DIR\n"
+	  " --metrics=FILE:          append timing of each request to FILE\n"
+	  " --metrics-textfile=FILE: write totals to FILE for Prometheus\n"
 	  " -i, --info:              show info about AMZ-files; do not download\n"
 	  "                          any tracks\n"
           " -x, --xml:               output XML data from AMZ-files; do not download\n"
@@ -397,6 +587,24 @@ int parse_args(int *argc, char **argv, clamz_config *cfg)
 	cfg->resume = 1;
 	break;
 
+      case 'j':
+	if (argv[i][2]) {
+	  if (parse_count(&argv[i][2], &cfg->jobs))
+	    return 1;
+	}
+	else if (i == *argc - 1) {
+	  fprintf(stderr, "%s: %s: requires argument\n",
+		  argv[0], argv[i]);
+	  print_usage(argv[0]);
+	  return 1;
+	}
+	else {
+	  i++;
+	  if (parse_count(argv[i], &cfg->jobs))
+	    return 1;
+	}
+	break;
+
       case 'i':
 	cfg->printonly = 1;
 	break;
@@ -499,6 +707,111 @@ int parse_args(int *argc, char **argv, clamz_config *cfg)
 	return 1;
       }
     }
+    else if (!strcasecmp(argv[i], "--jobs")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_count(argv[i], &cfg->jobs))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--jobs=", 7)) {
+      if (parse_count(argv[i] + 7, &cfg->jobs))
+	return 1;
+    }
+    else if (!strcasecmp(argv[i], "--segments")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_count(argv[i], &cfg->segments))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--segments=", 11)) {
+      if (parse_count(argv[i] + 11, &cfg->segments))
+	return 1;
+    }
+    else if (!strcasecmp(argv[i], "--order")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_order(argv[i], &cfg->order))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--order=", 8)) {
+      if (parse_order(argv[i] + 8, &cfg->order))
+	return 1;
+    }
+    else if (!strcasecmp(argv[i], "--limit-rate")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_size(argv[i], &cfg->rate_limit))
+	return 1;
+    }
+    else if (!strcasecmp(argv[i], "--limit-rate-host")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_size(argv[i], &cfg->host_rate_limit))
+	return 1;
+    }
+    else if (!strcasecmp(argv[i], "--limit-rate-track")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_size(argv[i], &cfg->track_rate_limit))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--limit-rate=", 13)) {
+      if (parse_size(argv[i] + 13, &cfg->rate_limit))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--limit-rate-host=", 18)) {
+      if (parse_size(argv[i] + 18, &cfg->host_rate_limit))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--limit-rate-track=", 19)) {
+      if (parse_size(argv[i] + 19, &cfg->track_rate_limit))
+	return 1;
+    }
+    else if (!strcasecmp(argv[i], "--buffer-size")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (parse_buffer_size(argv[i], &cfg->buffer_size))
+	return 1;
+    }
+    else if (!strncasecmp(argv[i], "--buffer-size=", 14)) {
+      if (parse_buffer_size(argv[i] + 14, &cfg->buffer_size))
+	return 1;
+    }
     else if (!strcasecmp(argv[i], "--allow-chars")) {
       if (i == *argc - 1) {
 	fprintf(stderr, "%s: %s: requires argument\n",
@@ -536,8 +849,101 @@ int parse_args(int *argc, char **argv, clamz_config *cfg)
       cfg->allowutf8 = 1;
     else if (!strcasecmp(argv[i], "--ascii-filenames"))
       cfg->allowutf8 = 0;
+    else if (!strcasecmp(argv[i], "--watch")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (cfg->watch_dir)
+	free(cfg->watch_dir);
+      cfg->watch_dir = strdup(argv[i]);
+
+      if (!cfg->watch_dir) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if (!strncasecmp(argv[i], "--watch=", 8)) {
+      if (cfg->watch_dir)
+	free(cfg->watch_dir);
+      cfg->watch_dir = strdup(argv[i] + 8);
+
+      if (!cfg->watch_dir) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if (!strcasecmp(argv[i], "--metrics")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (cfg->metrics_file)
+	free(cfg->metrics_file);
+      cfg->metrics_file = strdup(argv[i]);
+
+      if (!cfg->metrics_file) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if (!strncasecmp(argv[i], "--metrics=", 10)) {
+      if (cfg->metrics_file)
+	free(cfg->metrics_file);
+      cfg->metrics_file = strdup(argv[i] + 10);
+
+      if (!cfg->metrics_file) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if (!strcasecmp(argv[i], "--metrics-textfile")) {
+      if (i == *argc - 1) {
+	fprintf(stderr, "%s: %s: requires argument\n",
+		argv[0], argv[i]);
+	print_usage(argv[0]);
+	return 1;
+      }
+      i++;
+      if (cfg->metrics_textfile)
+	free(cfg->metrics_textfile);
+      cfg->metrics_textfile = strdup(argv[i]);
+
+      if (!cfg->metrics_textfile) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
+    else if (!strncasecmp(argv[i], "--metrics-textfile=", 19)) {
+      if (cfg->metrics_textfile)
+	free(cfg->metrics_textfile);
+      cfg->metrics_textfile = strdup(argv[i] + 19);
+
+      if (!cfg->metrics_textfile) {
+	print_error("Out of memory");
+	return 1;
+      }
+    }
     else if (!strcasecmp(argv[i], "--resume"))
       cfg->resume = 1;
+    else if (!strcasecmp(argv[i], "--redownload"))
+      cfg->redownload = 1;
+    else if (!strcasecmp(argv[i], "--tag"))
+      cfg->tag = 1;
+    else if (!strcasecmp(argv[i], "--no-tag"))
+      cfg->tag = 0;
+    else if (!strcasecmp(argv[i], "--save-cover"))
+      cfg->save_cover = 1;
+    else if (!strcasecmp(argv[i], "--embed-cover"))
+      cfg->embed_cover = 1;
+    else if (!strcasecmp(argv[i], "--direct-io"))
+      cfg->direct_io = 1;
     else if (!strcasecmp(argv[i], "--info"))
       cfg->printonly = 1;
     else if (!strcasecmp(argv[i], "--xml"))
@@ -567,6 +973,10 @@ int parse_args(int *argc, char **argv, clamz_config *cfg)
     }
   }
 
+  /* cover art is embedded while writing the tags */
+  if (cfg->embed_cover)
+    cfg->tag = 1;
+
   *argc = nfilenames + 1;
   return 0;
 }
@@ -22,65 +22,193 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include <expat.h>
-#include <gcrypt.h>
 
 #include "clamz.h"
 
-/* Create a new empty playlist */
-clamz_playlist *new_playlist()
+/**************** Playlist memory ****************/
+
+/* All of the memory used by a playlist (its tracks, their metadata,
+   and all of the strings) is carved from a list of large blocks, so
+   that parsing needs few calls to malloc(), and the whole playlist
+   can be freed at once. */
+
+/* Size of each block allocated for a playlist */
+#define ARENA_BLOCK_SIZE 65536
+
+/* Alignment of structures allocated from a block */
+#define ARENA_ALIGN (sizeof(double) > sizeof(void *) \
+		     ? sizeof(double) : sizeof(void *))
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_block {
+  struct arena_block *next;
+};
+
+struct _clamz_arena {
+  struct arena_block *blocks;	/* most recent block first */
+  char *data;			/* start of current block's data */
+  size_t used;
+  size_t size;
+
+  /* most recently allocated string, which can be extended in place
+     as long as nothing else has been allocated since */
+  char *last;
+  size_t last_len;
+};
+
+/* Allocate space from an arena, aligned to ALIGN bytes (a power of
+   two, no more than ARENA_ALIGN) */
+static void *arena_alloc(clamz_arena *a, size_t size, size_t align)
 {
-  clamz_playlist *pl = malloc(sizeof(clamz_playlist));
+  struct arena_block *blk;
+  size_t n, offset;
 
-  if (!pl) {
+  offset = (a->used + align - 1) & ~(align - 1);
+
+  if (!a->data || offset + size > a->size) {
+    /* a string being built may need copying many times, so give an
+       oversized request plenty of space to grow */
+    n = (size > ARENA_BLOCK_SIZE / 4 ? size * 2 : ARENA_BLOCK_SIZE);
+    blk = malloc(ARENA_ROUND(sizeof(struct arena_block)) + n);
+    if (!blk)
+      return NULL;
+
+    blk->next = a->blocks;
+    a->blocks = blk;
+    a->data = (char *) blk + ARENA_ROUND(sizeof(struct arena_block));
+    a->size = n;
+    offset = 0;
+  }
+
+  a->used = offset + size;
+  a->last = NULL;
+  return a->data + offset;
+}
+
+/* Append characters onto the end of a string allocated from an arena
+   (or NULL.)  The most recently allocated string is extended in
+   place; any other string is copied first. */
+static int arena_append(clamz_arena *a, char **str, const char *add,
+			size_t len)
+{
+  size_t n;
+  char *p;
+
+  if (*str && *str == a->last && a->used + len <= a->size) {
+    memcpy(*str + a->last_len, add, len);
+    a->last_len += len;
+    (*str)[a->last_len] = 0;
+    a->used += len;
+    return 0;
+  }
+
+  if (!*str)
+    n = 0;
+  else if (*str == a->last)
+    n = a->last_len;
+  else
+    n = strlen(*str);
+
+  p = arena_alloc(a, n + len + 1, 1);
+  if (!p) {
     print_error("Out of memory");
-    return NULL;
+    return 1;
   }
 
-  pl->title = pl->creator = pl->image_name = NULL;
-  pl->meta = NULL;
-  pl->num_tracks = 0;
-  pl->tracks = NULL;
+  if (n)
+    memcpy(p, *str, n);
+  memcpy(p + n, add, len);
+  p[n + len] = 0;
 
-  return pl;
+  *str = a->last = p;
+  a->last_len = n + len;
+  return 0;
 }
 
-/* Add a metadata tag to the given list. */
-static clamz_meta_list *add_meta(clamz_meta_list **mptr)
+/* Free an arena and everything allocated from it */
+static void free_arena(clamz_arena *a)
 {
-  clamz_meta_list *m = malloc(sizeof(clamz_meta_list));
+  struct arena_block *blk;
 
-  if (!m) {
+  while (a->blocks) {
+    blk = a->blocks;
+    a->blocks = blk->next;
+    free(blk);
+  }
+  free(a);
+}
+
+/* Initialize a set of metadata to be empty */
+static void init_meta(clamz_meta *meta)
+{
+  int i;
+
+  for (i = 0; i < NUM_META_SLOTS; i++)
+    meta->value[i] = NULL;
+  meta->extra = NULL;
+}
+
+/* Create a new empty playlist */
+clamz_playlist *new_playlist()
+{
+  clamz_arena *a;
+  clamz_playlist *pl;
+
+  a = malloc(sizeof(clamz_arena));
+  if (!a) {
     print_error("Out of memory");
     return NULL;
   }
 
-  m->urn = m->value = NULL;
-  m->next = *mptr;
-  *mptr = m;
-  return m;
+  a->blocks = NULL;
+  a->data = a->last = NULL;
+  a->used = a->size = a->last_len = 0;
+
+  pl = arena_alloc(a, sizeof(clamz_playlist), ARENA_ALIGN);
+  if (!pl) {
+    print_error("Out of memory");
+    free_arena(a);
+    return NULL;
+  }
+
+  pl->arena = a;
+  pl->title = pl->creator = pl->image_name = NULL;
+  init_meta(&pl->meta);
+  pl->num_tracks = 0;
+  pl->tracks = NULL;
+
+  return pl;
 }
 
-/* Add a track to the given playlist. */
-static clamz_track *add_track(clamz_playlist *pl)
+/* Add a track to the given playlist.  The track array is kept in the
+   arena as well, doubling in size as needed; *SPACE is the number of
+   tracks it has room for. */
+static clamz_track *add_track(clamz_playlist *pl, int *space)
 {
   clamz_track *tr;
   clamz_track **ar;
 
-  if (pl->tracks)
-    ar = realloc(pl->tracks, (pl->num_tracks + 1) * sizeof(clamz_track *));
-  else
-    ar = malloc(sizeof(clamz_track *));
-  if (!ar) {
-    print_error("Out of memory");
-    return NULL;
+  if (pl->num_tracks >= *space) {
+    *space = (pl->num_tracks + 1) * 2;
+    ar = arena_alloc(pl->arena, *space * sizeof(clamz_track *),
+		     ARENA_ALIGN);
+    if (!ar) {
+      print_error("Out of memory");
+      return NULL;
+    }
+    if (pl->num_tracks)
+      memcpy(ar, pl->tracks, pl->num_tracks * sizeof(clamz_track *));
+    pl->tracks = ar;
   }
-  pl->tracks = ar;
 
-  tr = malloc(sizeof(clamz_track));
+  tr = arena_alloc(pl->arena, sizeof(clamz_track), ARENA_ALIGN);
   if (!tr) {
     print_error("Out of memory");
     return NULL;
@@ -92,70 +220,34 @@ static clamz_track *add_track(clamz_playlist *pl)
   tr->playlist = pl;
   tr->location = tr->creator = tr->album = tr->title
     = tr->image_name = tr->duration = tr->trackNum = NULL;
-  tr->meta = NULL;
+  init_meta(&tr->meta);
 
   return tr;
 }
 
-/* Free a metadata list. */
-static void free_meta_list(clamz_meta_list *meta)
-{
-  clamz_meta_list *m;
-
-  while (meta) {
-    if (meta->urn) free(meta->urn);
-    if (meta->value) free(meta->value);
-    m = meta;
-    meta = meta->next;
-    free(m);
-  }
-}
-
-/* Free a track and associated data */
-static void free_track(clamz_track *tr)
-{
-  if (tr) {
-    if (tr->location) free(tr->location);
-    if (tr->creator) free(tr->creator);
-    if (tr->album) free(tr->album);
-    if (tr->title) free(tr->title);
-    if (tr->image_name) free(tr->image_name);
-    if (tr->duration) free(tr->duration);
-    if (tr->trackNum) free(tr->trackNum);
-    free_meta_list(tr->meta);
-    free(tr);
-  }
-}
-
 /* Free an entire playlist */
 void free_playlist(clamz_playlist *pl)
 {
-  int i;
-
-  if (pl) {
-    if (pl->title) free(pl->title);
-    if (pl->creator) free(pl->creator);
-    if (pl->image_name) free(pl->image_name);
-    free_meta_list(pl->meta);
-
-    for (i = 0; i < pl->num_tracks; i++)
-      free_track(pl->tracks[i]);
-    if (pl->tracks) free(pl->tracks);
-
-    free(pl);
-  }
+  if (pl)
+    free_arena(pl->arena);
 }
 
-/* Search for a given metavalue key (URN) */
-const char *find_meta(const clamz_meta_list *meta, const char *urn)
-{
-  while (meta) {
-    if (meta->urn && !strcmp(meta->urn, urn))
-      return meta->value;
-    meta = meta->next;
-  }
+/* URNs of the known metadata slots */
+static const char *const meta_urns[NUM_META_SLOTS] = {
+  "http://www.amazon.com/dmusic/albumPrimaryArtist",
+  "http://www.amazon.com/dmusic/albumASIN",
+  "http://www.amazon.com/dmusic/ASIN",
+  "http://www.amazon.com/dmusic/discNum",
+  "http://www.amazon.com/dmusic/fileSize",
+  "http://www.amazon.com/dmusic/primaryGenre",
+  "http://www.amazon.com/dmusic/productTypeName",
+  "http://www.amazon.com/dmusic/trackType"
+};
 
-  return NULL;
+/* Get the URN for a metadata slot */
+const char *meta_urn(int slot)
+{
+  return meta_urns[slot];
 }
 
 
@@ -178,12 +270,27 @@ enum {
   
 #define MAX_DEPTH 1024
 
+/* A metadata URN seen while parsing, and the slot in which it is
+   stored (or -1 if it is not one of the known URNs) */
+struct urn_entry {
+  const char *urn;
+  int slot;
+};
+
 struct parseinfo {
   const char *filename;
   XML_Parser parser;
   clamz_playlist *playlist;
   clamz_track *track;
-  clamz_meta_list *meta;
+  int in_meta;
+  char **meta_value;		/* NULL if the meta tag has no URN */
+  int track_space;
+
+  /* hash table of URNs; each URN is only stored once per playlist */
+  struct urn_entry *urns;
+  unsigned int urns_size;	/* a power of two */
+  unsigned int urns_count;
+
   int stackdepth;
   int stack[MAX_DEPTH];
 };
@@ -215,6 +322,132 @@ int concatenate(char **str, const char *add, int len)
   }
 }
 
+static unsigned int hash_urn(const char *urn)
+{
+  unsigned int h = 2166136261U;
+
+  while (*urn)
+    h = (h ^ (unsigned char) *urn++) * 16777619U;
+  return h;
+}
+
+/* Find the entry for a URN in the hash table, or the empty entry
+   where it belongs */
+static struct urn_entry *lookup_urn(struct urn_entry *urns,
+				    unsigned int size, const char *urn)
+{
+  unsigned int i = hash_urn(urn) & (size - 1);
+
+  while (urns[i].urn && strcmp(urns[i].urn, urn))
+    i = (i + 1) & (size - 1);
+  return &urns[i];
+}
+
+/* Add a URN to the hash table, unless it is there already.  Returns
+   NULL if out of memory. */
+static struct urn_entry *intern_urn(struct parseinfo *pi, const char *urn,
+				    int slot)
+{
+  struct urn_entry *e, *urns;
+  unsigned int i, size;
+  char *copy = NULL;
+
+  e = lookup_urn(pi->urns, pi->urns_size, urn);
+  if (e->urn)
+    return e;
+
+  /* keep the table no more than half full */
+  if ((pi->urns_count + 1) * 2 > pi->urns_size) {
+    size = pi->urns_size * 2;
+    urns = calloc(size, sizeof(struct urn_entry));
+    if (!urns) {
+      print_error("Out of memory");
+      return NULL;
+    }
+
+    for (i = 0; i < pi->urns_size; i++)
+      if (pi->urns[i].urn)
+	*lookup_urn(urns, size, pi->urns[i].urn) = pi->urns[i];
+
+    free(pi->urns);
+    pi->urns = urns;
+    pi->urns_size = size;
+    e = lookup_urn(urns, size, urn);
+  }
+
+  if (slot >= 0)
+    e->urn = urn;
+  else {
+    if (arena_append(pi->playlist->arena, &copy, urn, strlen(urn)))
+      return NULL;
+    e->urn = copy;
+  }
+
+  e->slot = slot;
+  pi->urns_count++;
+  return e;
+}
+
+/* Set up the URN table, containing all of the known URNs */
+static int init_urns(struct parseinfo *pi)
+{
+  int i;
+
+  pi->urns_size = 32;
+  pi->urns_count = 0;
+  pi->urns = calloc(pi->urns_size, sizeof(struct urn_entry));
+  if (!pi->urns) {
+    print_error("Out of memory");
+    return 1;
+  }
+
+  for (i = 0; i < NUM_META_SLOTS; i++)
+    intern_urn(pi, meta_urns[i], i);
+  return 0;
+}
+
+/* Add a metadata tag to a track or playlist, and return the location
+   where its value should be stored */
+static char **add_meta(struct parseinfo *pi, clamz_meta *meta,
+		       const char *urn)
+{
+  struct urn_entry *e;
+  clamz_meta_list *m, **mptr;
+
+  if (!(e = intern_urn(pi, urn, -1)))
+    return NULL;
+
+  /* if a known URN appears more than once, the last value wins */
+  if (e->slot >= 0) {
+    meta->value[e->slot] = NULL;
+    return &meta->value[e->slot];
+  }
+
+  m = arena_alloc(pi->playlist->arena, sizeof(clamz_meta_list), ARENA_ALIGN);
+  if (!m) {
+    print_error("Out of memory");
+    return NULL;
+  }
+
+  m->urn = e->urn;
+  m->value = NULL;
+  m->next = NULL;
+
+  for (mptr = &meta->extra; *mptr; mptr = &(*mptr)->next)
+    ;
+  *mptr = m;
+  return &m->value;
+}
+
+/* Append characters onto the end of a string in the playlist being
+   parsed */
+static void append_text(struct parseinfo *pi, char **str, const char *add,
+			int len)
+{
+  if (arena_append(pi->playlist->arena, str, add, len))
+    XML_StopParser(pi->parser, 0);
+}
+
 /* Parser callback for a start tag */
 static void handle_start_tag(void *data, const XML_Char *name,
 			     const XML_Char **atts)
@@ -241,25 +474,24 @@ static void handle_start_tag(void *data, const XML_Char *name,
   else if (!strcmp(name, "location"))
     pi->stack[pi->stackdepth] = LOCATION;
   else if (!strcmp(name, "meta")) {
-    if (pi->meta) {
+    if (pi->in_meta) {
       pi->stack[pi->stackdepth] = UNKNOWN_TAG;
     }
     else {
       pi->stack[pi->stackdepth] = META;
-
-      if (pi->track)
-	pi->meta = add_meta(&pi->track->meta);
-      else
-	pi->meta = add_meta(&pi->playlist->meta);
-
-      if (pi->meta) {
-	while (atts && atts[0]) {
-	  if (!strcmp(atts[0], "rel")) {
-	    pi->meta->urn = strdup(atts[1]);
-	    break;
-	  }
-	  atts += 2;
+      pi->in_meta = 1;
+      pi->meta_value = NULL;
+
+      while (atts && atts[0]) {
+	if (!strcmp(atts[0], "rel")) {
+	  pi->meta_value = add_meta(pi, (pi->track
+					 ? &pi->track->meta
+					 : &pi->playlist->meta), atts[1]);
+	  if (!pi->meta_value)
+	    XML_StopParser(pi->parser, 0);
+	  break;
 	}
+	atts += 2;
       }
     }
   }
@@ -273,7 +505,7 @@ static void handle_start_tag(void *data, const XML_Char *name,
     }
     else {
       pi->stack[pi->stackdepth] = TRACK;
-      pi->track = add_track(pi->playlist);
+      pi->track = add_track(pi->playlist, &pi->track_space);
     }
   }
   else if (!strcmp(name, "tracklist"))
@@ -289,8 +521,10 @@ static void handle_end_tag(void *data, const XML_Char *name UNUSED)
 {
   struct parseinfo *pi = data;
 
-  if (pi->stack[pi->stackdepth] == META)
-    pi->meta = NULL;
+  if (pi->stack[pi->stackdepth] == META) {
+    pi->in_meta = 0;
+    pi->meta_value = NULL;
+  }
   else if (pi->stack[pi->stackdepth] == TRACK)
     pi->track = NULL;
 
@@ -305,298 +539,415 @@ static void handle_chars(void* data, const XML_Char* s, int len)
   switch (pi->stack[pi->stackdepth]) {
   case ALBUM:
     if (pi->track)
-      concatenate(&pi->track->album, s, len);
+      append_text(pi, &pi->track->album, s, len);
     break;
 
   case CREATOR:
     if (pi->track)
-      concatenate(&pi->track->creator, s, len);
+      append_text(pi, &pi->track->creator, s, len);
     else
-      concatenate(&pi->playlist->creator, s, len);
+      append_text(pi, &pi->playlist->creator, s, len);
     break;
 
   case DURATION:
     if (pi->track)
-      concatenate(&pi->track->duration, s, len);
+      append_text(pi, &pi->track->duration, s, len);
     break;
 
   case IMAGE:
     if (pi->track)
-      concatenate(&pi->track->image_name, s, len);
+      append_text(pi, &pi->track->image_name, s, len);
     else
-      concatenate(&pi->playlist->image_name, s, len);
+      append_text(pi, &pi->playlist->image_name, s, len);
     break;
 
   case LOCATION:
     if (pi->track)
-      concatenate(&pi->track->location, s, len);
+      append_text(pi, &pi->track->location, s, len);
     break;
 
   case META:
-    if (pi->meta)
-      concatenate(&pi->meta->value, s, len);
+    if (pi->meta_value)
+      append_text(pi, pi->meta_value, s, len);
     break;
 
   case TITLE:
     if (pi->track)
-      concatenate(&pi->track->title, s, len);
+      append_text(pi, &pi->track->title, s, len);
     else
-      concatenate(&pi->playlist->title, s, len);
+      append_text(pi, &pi->playlist->title, s, len);
     break;
 
   case TRACKNUM:
     if (pi->track)
-      concatenate(&pi->track->trackNum, s, len);
+      append_text(pi, &pi->track->trackNum, s, len);
     break;
   }
 }
 
-/* Decode base64 data */
-static unsigned char *base64_decode(unsigned long *output_len,
-				    const char *input_buf,
-				    unsigned long input_len,
-				    const char *fname)
-{
-  unsigned char *result;
-  unsigned long len, i;
-  unsigned int bits = 0;
-  int nch = 4;
+/* Size of each piece read from an AMZ file */
+#define AMZ_READ_SIZE (1024 * 1024)
 
-  result = malloc(((input_len * 3 + 3) / 4) * sizeof(char));
-  if (!result) {
-    print_error("Out of memory");
-    return NULL;
-  }
+/* Whether an AMZ file is encrypted, once known */
+enum { AMZ_UNKNOWN, AMZ_PLAIN, AMZ_ENCRYPTED };
 
-  for (len = i = 0; i < input_len; i++) {
-    if (input_buf[i] >= 'A' && input_buf[i] <= 'Z')
-      bits |= (input_buf[i] - 'A');
-    else if (input_buf[i] >= 'a' && input_buf[i] <= 'z')
-      bits |= (input_buf[i] - 'a' + 26);
-    else if (input_buf[i] >= '0' && input_buf[i] <= '9')
-      bits |= (input_buf[i] - '0' + 52);
-    else if (input_buf[i] == '+')
-      bits |= 62;
-    else if (input_buf[i] == '/')
-      bits |= 63;
-    else if (input_buf[i] <= ' ' || input_buf[i] == '=')
-      continue;
-    else {
-      print_error("Invalid base64 data in AMZ file '%s'", fname);
-      free(result);
-      return NULL;
-    }
+/* State of an AMZ file being read.  The file is decoded, decrypted
+   and parsed a piece at a time, so the whole file is never held in
+   memory. */
+struct amz_reader {
+  const char *filename;
+  XML_Parser parser;		/* NULL if only printing the XML */
+  FILE *xmlfile;
+  int format;
+
+  clamz_base64 b64;
+
+  /* decryption */
+  clamz_decryptor *dec;
+  unsigned char block[8];	/* partial block not yet decrypted */
+  int block_len;
+
+  /* data held back until more arrives: the start of the file, until
+     it is known whether it is encrypted, and otherwise any control
+     characters at the end of what has been decrypted so far, which
+     are discarded if they turn out to be padding */
+  char *held;
+  size_t held_len;
+  size_t held_size;
+
+  unsigned char *buf;		/* decoded data */
+};
 
-    switch (--nch) {
-    case 0:
-      nch = 4;
-      result[len++] = bits & 0xff;
-      break;
+/* Report an XML parser error */
+static void xml_error(struct amz_reader *rd)
+{
+  int xerr = XML_GetErrorCode(rd->parser);
 
-    case 1:
-      result[len++] = (bits >> 2) & 0xff;
-      break;
+  if (xerr != XML_ERROR_ABORTED) {
+    print_error("Invalid XML (%s) in %s, line %d, column %d",
+		XML_ErrorString(xerr), rd->filename,
+		(int) XML_GetCurrentLineNumber(rd->parser),
+		(int) XML_GetCurrentColumnNumber(rd->parser));
+  }
+}
 
-    case 2:
-      result[len++] = (bits >> 4) & 0xff;
-      break;
-    }
+/* Pass decrypted XML to the parser, or print it */
+static int output_xml(struct amz_reader *rd, const char *data, size_t len)
+{
+  if (!len)
+    return 0;
 
-    bits <<= 6;
+  if (!rd->parser) {
+    fwrite(data, 1, len, rd->xmlfile);
+    return 0;
   }
 
-  *output_len = len;
-  return result;
+  if (!XML_Parse(rd->parser, data, len, 0)) {
+    xml_error(rd);
+    return 1;
+  }
+  return 0;
 }
 
-/* Decrypt an AMZ file */
-unsigned char *decrypt_amz_file(const char *b64data,
-                                unsigned long b64len, const char *fname)
+/* Add data to the held-back buffer */
+static int hold_data(struct amz_reader *rd, const char *data, size_t len)
 {
-  static const unsigned char key[8] = { 0x29, 0xAB, 0x9D, 0x18,
-					0xB2, 0x44, 0x9E, 0x31 };
-  static const unsigned char initv[8] = { 0x5E, 0x72, 0xD7, 0x9A,
-					  0x11, 0xB3, 0x4F, 0xEE };
-  gcry_cipher_hd_t hd;
-  gcry_error_t err;
-  unsigned char *unpacked, *decrypted;
-  unsigned long unpacked_len;
-  unsigned long i;
-
-  /* Some AMZ files are encrypted (and base64-encoded), while others
-     are just plain XML.  Check if the start of the file looks like
-     XML */
-  i = 0;
-  while (i < b64len && (b64data[i] <= ' ' || b64data[i] > '~'))
-    i++;
-
-  if (i < b64len && b64data[i] == '<') {
-    /* assume file is not encrypted */
-    decrypted = malloc(b64len + 1);
-    if (!decrypted) {
+  char *p;
+
+  if (rd->held_len + len > rd->held_size) {
+    p = realloc(rd->held, rd->held_len + len + 64);
+    if (!p) {
       print_error("Out of memory");
-      return NULL;
+      return 1;
     }
-    memcpy(decrypted, b64data, b64len);
-    decrypted[b64len] = 0;
-    return decrypted;
+    rd->held = p;
+    rd->held_size = rd->held_len + len + 64;
   }
 
-  unpacked = base64_decode(&unpacked_len, b64data, b64len, fname);
-  if (!unpacked)
-    return NULL;
+  memcpy(rd->held + rd->held_len, data, len);
+  rd->held_len += len;
+  return 0;
+}
+
+/* Pass on decrypted data, except for any control characters at the
+   end.  The files usually seem to be padded with 00 and/or 08 bytes;
+   either way, expat doesn't like them. */
+static int output_decrypted(struct amz_reader *rd, const unsigned char *data,
+			    size_t len)
+{
+  size_t i;
 
-  if (unpacked_len % 8) {
-    fprintf(stderr, "WARNING: length = %ld mod 8, discarding excess bytes\n",
-	    (unpacked_len % 8));
-    unpacked_len -= (unpacked_len % 8);
+  for (i = len; i > 0; i--)
+    if (data[i - 1] == '\n' || data[i - 1] == '\r' || data[i - 1] >= ' ')
+      break;
+
+  if (i > 0) {
+    if (output_xml(rd, rd->held, rd->held_len)
+	|| output_xml(rd, (const char *) data, i))
+      return 1;
+    rd->held_len = 0;
   }
 
-  decrypted = malloc(unpacked_len+1);
-  decrypted[unpacked_len] = 0; /* guard */
+  return hold_data(rd, (const char *) data + i, len - i);
+}
 
-  if (!decrypted) {
+/* Set up decryption of an AMZ file */
+static int start_decryption(struct amz_reader *rd)
+{
+  rd->buf = malloc(BASE64_DECODED_SIZE(AMZ_READ_SIZE) + sizeof(rd->block));
+  rd->dec = new_decryptor(0);
+  if (!rd->buf || !rd->dec) {
     print_error("Out of memory");
-    free(unpacked);
-    return NULL;
+    return 1;
   }
 
-  if ((err = gcry_cipher_open(&hd, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0))) {
-    print_error("Failed to initialize gcrypt (%s)", gcry_strerror(err));
-    free(decrypted);
-    free(unpacked);
-    return NULL;
+  if (decryptor_error(rd->dec)) {
+    print_error("Failed to initialize gcrypt (%s)", decryptor_error(rd->dec));
+    return 1;
   }
 
-  if ((err = gcry_cipher_setkey(hd, key, 8))) {
-    print_error("Failed to set key (%s)", gcry_strerror(err));
-    gcry_cipher_close(hd);
-    free(decrypted);
-    free(unpacked);
-    return NULL;
-  }
-  
-  if ((err = gcry_cipher_setiv(hd, initv, 8))) {
-    print_error("Failed to set IV (%s)", gcry_strerror(err));
-    gcry_cipher_close(hd);
-    free(decrypted);
-    free(unpacked);
-    return NULL;
-  }
+  return 0;
+}
 
-  if ((err = gcry_cipher_decrypt(hd, decrypted, unpacked_len,
-				 unpacked, unpacked_len))) {
-    print_error("Unable to decrypt AMZ file '%s' (%s)", fname,
-		gcry_strerror(err));
-    gcry_cipher_close(hd);
-    free(decrypted);
-    free(unpacked);
-    return NULL;
+/* Decode and decrypt a piece of an encrypted AMZ file.  Since the
+   cipher is used in CBC mode, each complete block can be decrypted as
+   soon as it arrives, and a large piece can be split between several
+   threads. */
+static int decrypt_data(struct amz_reader *rd, const char *input_buf,
+			size_t input_len)
+{
+  unsigned char *result = rd->buf;
+  size_t len, n;
+  long k;
+
+  /* start with the partial block left over from last time */
+  memcpy(result, rd->block, rd->block_len);
+  len = rd->block_len;
+
+  k = base64_decode(&rd->b64, result + len, input_buf, input_len);
+  if (k < 0) {
+    print_error("Invalid base64 data in AMZ file '%s'", rd->filename);
+    return 1;
   }
+  len += k;
+
+  n = len - len % 8;
+  rd->block_len = len - n;
+  memcpy(rd->block, result + n, rd->block_len);
 
-  free(unpacked);
+  if (decryptor_run(rd->dec, result, n)) {
+    print_error("Unable to decrypt AMZ file '%s' (%s)", rd->filename,
+		decryptor_error(rd->dec));
+    return 1;
+  }
 
-  gcry_cipher_close(hd);
+  return output_decrypted(rd, result, n);
+}
 
-  /* Remove any garbage characters from the end -- the files usually
-     seem to be padded with 00 and/or 08 bytes; either way, expat
-     doesn't like them. */
-  for (i = unpacked_len; i > 0; i--) {
-    if (decrypted[i - 1] == '\n' || decrypted[i] == '\r'
-	|| decrypted[i - 1] >= ' ') {
-      break;
+/* Process a piece of an AMZ file */
+static int process_amz_data(struct amz_reader *rd, const char *data,
+			    size_t len)
+{
+  size_t i;
+
+  if (rd->format == AMZ_UNKNOWN) {
+    /* Some AMZ files are encrypted (and base64-encoded), while others
+       are just plain XML.  Check if the start of the file looks like
+       XML */
+    for (i = 0; i < len; i++)
+      if (data[i] > ' ' && data[i] <= '~')
+	break;
+
+    if (i == len)
+      return hold_data(rd, data, len);
+
+    if (data[i] == '<') {
+      /* assume file is not encrypted */
+      rd->format = AMZ_PLAIN;
+      if (output_xml(rd, rd->held, rd->held_len))
+	return 1;
     }
+    else {
+      rd->format = AMZ_ENCRYPTED;
+      if (start_decryption(rd))
+	return 1;
+    }
+    rd->held_len = 0;
   }
-  decrypted[i] = 0;
 
-  return decrypted;
+  if (rd->format == AMZ_PLAIN)
+    return output_xml(rd, data, len);
+  else
+    return decrypt_data(rd, data, len);
 }
 
-/* Read data from an AMZ file */
-int read_amz_file(clamz_playlist *pl, const char *b64data,
-		  unsigned long b64len, const char *fname)
+/* Finish reading an AMZ file */
+static int finish_amz_data(struct amz_reader *rd)
 {
-  struct parseinfo pi;
-  unsigned char *decrypted, *xml;
-  unsigned long decrypted_len;
-  int xerr;
+  if (rd->block_len)
+    fprintf(stderr, "WARNING: length = %d mod 8, discarding excess bytes\n",
+	    rd->block_len);
 
-  decrypted = decrypt_amz_file(b64data, b64len, fname);
-  if (!decrypted)
+  if (rd->parser && !XML_Parse(rd->parser, "", 0, 1)) {
+    xml_error(rd);
     return 1;
-  decrypted_len = strlen((char*) decrypted);
+  }
+  return 0;
+}
 
-  pi.parser = XML_ParserCreate(NULL);
-  if (!pi.parser) {
-    print_error("Failed to initialize expat");
-    free(decrypted);
+/* Read an AMZ file from FD, a piece at a time, as it arrives.  The
+   XML is parsed into PL; or, if PL is NULL, it is written to XMLFILE
+   instead.  If BACKUP is not NULL, the original data is copied to
+   it. */
+int read_amz_file(clamz_playlist *pl, FILE *xmlfile, int fd, FILE *backup,
+		  const char *fname)
+{
+  struct amz_reader rd;
+  struct parseinfo pi;
+  char *buf;
+  ssize_t n;
+  int status = 0;
+
+  rd.filename = fname;
+  rd.parser = NULL;
+  rd.xmlfile = xmlfile;
+  rd.format = AMZ_UNKNOWN;
+  base64_start(&rd.b64);
+  rd.dec = NULL;
+  rd.block_len = 0;
+  rd.held = NULL;
+  rd.held_len = rd.held_size = 0;
+  rd.buf = NULL;
+
+  buf = malloc(AMZ_READ_SIZE);
+  if (!buf) {
+    print_error("Out of memory");
     return 1;
   }
 
-  XML_SetElementHandler(pi.parser, &handle_start_tag, &handle_end_tag);
-  XML_SetCharacterDataHandler(pi.parser, &handle_chars);
-  XML_SetUserData(pi.parser, &pi);
+  pi.urns = NULL;
+  if (pl) {
+    pi.parser = rd.parser = XML_ParserCreate(NULL);
+    if (!pi.parser) {
+      print_error("Failed to initialize expat");
+      free(buf);
+      return 1;
+    }
+
+    XML_SetElementHandler(pi.parser, &handle_start_tag, &handle_end_tag);
+    XML_SetCharacterDataHandler(pi.parser, &handle_chars);
+    XML_SetUserData(pi.parser, &pi);
+
+    pi.filename = fname;
+    pi.playlist = pl;
+    pi.track = NULL;
+    pi.in_meta = 0;
+    pi.meta_value = NULL;
+    pi.track_space = 0;
+    pi.stackdepth = 0;
+
+    if (init_urns(&pi)) {
+      XML_ParserFree(pi.parser);
+      free(buf);
+      return 1;
+    }
+  }
 
-  pi.filename = fname;
-  pi.playlist = pl;
-  pi.track = NULL;
-  pi.meta = NULL;
-  pi.stackdepth = 0;
+  /* read whatever is available, so that input from a pipe is
+     processed as soon as it arrives */
+  while ((n = read(fd, buf, AMZ_READ_SIZE)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      print_error("Unable to read AMZ file '%s' (%s)", fname,
+		  strerror(errno));
+      status = 1;
+      break;
+    }
 
-  /* copy decrypted data into XML parser buffer */
-  xml = XML_GetBuffer(pi.parser, decrypted_len);
-  memcpy(xml, decrypted, decrypted_len);
+    if (backup && fwrite(buf, 1, n, backup) != (size_t) n) {
+      print_error("Unable to write backup of AMZ file '%s' (%s)", fname,
+		  strerror(errno));
+      status = 1;
+      break;
+    }
 
-  if (!XML_ParseBuffer(pi.parser, decrypted_len, 1)) {
-    xerr = XML_GetErrorCode(pi.parser);
-    if (xerr != XML_ERROR_ABORTED) {
-      print_error("Invalid XML (%s) in %s, line %d, column %d",
-		  XML_ErrorString(xerr), fname,
-		  (int) XML_GetCurrentLineNumber(pi.parser),
-		  (int) XML_GetCurrentColumnNumber(pi.parser));
+    if (process_amz_data(&rd, buf, n)) {
+      status = 1;
+      break;
     }
-    free(decrypted);
-    XML_ParserFree(pi.parser);
-    return 1;
   }
 
-  free(decrypted);
-  XML_ParserFree(pi.parser);
-  return 0;
+  if (!status)
+    status = finish_amz_data(&rd);
+
+  if (rd.parser)
+    XML_ParserFree(rd.parser);
+  free(pi.urns);
+  if (rd.dec)
+    free_decryptor(rd.dec);
+  free(rd.held);
+  free(rd.buf);
+  free(buf);
+  return status;
 }
 
-/* Save a backup amz file */
-int write_backup_file(const char* b64data, unsigned long b64len,
-		      const char* fname)
+/* Open a file to save a backup copy of an AMZ file.  The copy is
+   written to a temporary file, so that an earlier backup is only
+   replaced once the new one is complete. */
+FILE *open_backup_file(const char *fname)
 {
   char *name;
   FILE *f;
 
-  name = get_config_file_name("amzfiles", fname, NULL);
+  name = get_config_file_name("amzfiles", fname, ".tmp");
 
   if (!name) {
     print_error("Unable to open configuration directory");
-    return 1;
+    return NULL;
   }
 
   f = fopen(name, "wb");
-  if (!f) {
+  if (!f)
     perror(name);
-    free(name);
-    return 1;
-  }
 
   free(name);
+  return f;
+}
 
-  if (fwrite(b64data, 1, b64len, f) < b64len) {
-    print_error("Unable to write backup file");
+/* Close a backup file opened by open_backup_file(), and, if KEEP is
+   nonzero, move it into place; otherwise, delete it */
+int close_backup_file(FILE *f, const char *fname, int keep)
+{
+  char *name, *tmpname;
+  int status = 0;
+
+  name = get_config_file_name("amzfiles", fname, NULL);
+  tmpname = get_config_file_name("amzfiles", fname, ".tmp");
+  if (!name || !tmpname) {
     fclose(f);
+    free(name);
+    free(tmpname);
     return 1;
   }
-  if (fclose(f)) {
-    print_error("Unable to write backup file");
-    return 1;
+
+  if (fclose(f) && keep) {
+    print_error("Unable to write backup file %s (%s)", tmpname,
+		strerror(errno));
+    keep = 0;
+    status = 1;
   }
 
-  return 0;
+  if (keep && rename(tmpname, name)) {
+    print_error("Unable to rename %s to %s (%s)", tmpname, name,
+		strerror(errno));
+    status = 1;
+  }
+
+  if (!keep || status)
+    unlink(tmpname);
+
+  free(name);
+  free(tmpname);
+  return status;
 }
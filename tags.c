@@ -0,0 +1,503 @@
+/*
+ * clamz - Command-line downloader for the Amazon.com MP3 store
+ * Copyright (c) 2008-2010 Benjamin Moody
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+
+#include "clamz.h"
+
+/* Tagging is done by the downloader's I/O threads, so nothing here
+   may print messages or touch shared state; errors are returned as
+   errno values instead.
+
+   The ID3v2 tag at the start of the file is replaced by one holding
+   the metadata from the AMZ file.  Frames of the existing tag which
+   clamz has no value for (comments, or pictures when no cover is
+   embedded, and so on) are kept.
+   If the new tag fits in the space used by the old one, it is written
+   in place; otherwise the file is copied with the new tag, leaving
+   some padding so that it can be changed again cheaply. */
+
+/* Padding to leave after a tag when the file must be rewritten */
+#define TAG_PADDING 2048
+
+/* Amount of data to copy or hash at once */
+#define COPY_SIZE 65536
+
+/* A tag being built */
+struct id3_buf {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+  int version;			/* 3 for ID3v2.3, 4 for ID3v2.4 */
+};
+
+/* Make room for N more bytes in a tag buffer */
+static int grow_buf(struct id3_buf *b, size_t n)
+{
+  unsigned char *p;
+  size_t size = (b->size ? b->size : 1024);
+
+  if (b->len + n <= b->size)
+    return 0;
+
+  while (size < b->len + n)
+    size *= 2;
+  p = realloc(b->data, size);
+  if (!p)
+    return ENOMEM;
+  b->data = p;
+  b->size = size;
+  return 0;
+}
+
+/* Store a 28-bit "synchsafe" integer (7 bits per byte) */
+static void put_synchsafe(unsigned char *p, unsigned long n)
+{
+  p[0] = (n >> 21) & 0x7f;
+  p[1] = (n >> 14) & 0x7f;
+  p[2] = (n >> 7) & 0x7f;
+  p[3] = n & 0x7f;
+}
+
+static unsigned long get_synchsafe(const unsigned char *p)
+{
+  return (((unsigned long) (p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14)
+	  | ((p[2] & 0x7f) << 7) | (p[3] & 0x7f));
+}
+
+/* Get the size of a frame, from its header */
+static unsigned long get_frame_size(const unsigned char *p, int version)
+{
+  if (version == 4)
+    return get_synchsafe(p + 4);
+  return (((unsigned long) p[4] << 24) | ((unsigned long) p[5] << 16)
+	  | (p[6] << 8) | p[7]);
+}
+
+/* Add a frame header to a tag buffer */
+static int begin_frame(struct id3_buf *b, const char *id, size_t size)
+{
+  unsigned char *p;
+
+  if (grow_buf(b, 10 + size))
+    return ENOMEM;
+
+  p = b->data + b->len;
+  memcpy(p, id, 4);
+  if (b->version == 4)
+    put_synchsafe(p + 4, size);
+  else {
+    p[4] = (size >> 24) & 0xff;
+    p[5] = (size >> 16) & 0xff;
+    p[6] = (size >> 8) & 0xff;
+    p[7] = size & 0xff;
+  }
+  p[8] = p[9] = 0;
+  b->len += 10;
+  return 0;
+}
+
+/* Convert a UTF-8 string to UTF-16 (little-endian) */
+static size_t utf8_to_utf16(unsigned char *out, const char *s)
+{
+  const unsigned char *p = (const unsigned char *) s;
+  unsigned long c;
+  size_t n = 0;
+  int k;
+
+  while (*p) {
+    if (*p < 0x80) {
+      c = *p++;
+      k = 0;
+    }
+    else if ((*p & 0xe0) == 0xc0) {
+      c = *p++ & 0x1f;
+      k = 1;
+    }
+    else if ((*p & 0xf0) == 0xe0) {
+      c = *p++ & 0x0f;
+      k = 2;
+    }
+    else if ((*p & 0xf8) == 0xf0) {
+      c = *p++ & 0x07;
+      k = 3;
+    }
+    else {
+      p++;
+      continue;
+    }
+
+    while (k-- > 0 && (*p & 0xc0) == 0x80)
+      c = (c << 6) | (*p++ & 0x3f);
+
+    if (c >= 0x10000) {
+      c -= 0x10000;
+      out[n++] = (0xd800 | (c >> 10)) & 0xff;
+      out[n++] = (0xd800 | (c >> 10)) >> 8;
+      c = 0xdc00 | (c & 0x3ff);
+    }
+    out[n++] = c & 0xff;
+    out[n++] = (c >> 8) & 0xff;
+  }
+
+  return n;
+}
+
+/* Check whether a string is plain ASCII */
+static int is_ascii(const char *s)
+{
+  while (*s)
+    if (*s++ & 0x80)
+      return 0;
+  return 1;
+}
+
+/* Add a text frame, with an optional description (for TXXX) */
+static int add_text_frame(struct id3_buf *b, const char *id,
+			  const char *desc, const char *value)
+{
+  unsigned char *p;
+  size_t n;
+
+  if (!value || !value[0])
+    return 0;
+
+  /* UTF-8 is not allowed in ID3v2.3, so use UTF-16 there unless the
+     text is plain ASCII.  UTF-16 needs at most twice as many bytes as
+     UTF-8, plus a byte order mark and terminator for each string. */
+  n = 1 + 2 * (strlen(value) + (desc ? strlen(desc) : 0)) + 8;
+  if (grow_buf(b, 10 + n))
+    return ENOMEM;
+
+  p = b->data + b->len + 10;
+  n = 0;
+
+  if (b->version == 4 || (is_ascii(value) && (!desc || is_ascii(desc)))) {
+    p[n++] = (b->version == 4 ? 3 : 0);
+    if (desc) {
+      strcpy((char *) p + n, desc);
+      n += strlen(desc) + 1;
+    }
+    memcpy(p + n, value, strlen(value));
+    n += strlen(value);
+  }
+  else {
+    p[n++] = 1;
+    if (desc) {
+      p[n++] = 0xff;
+      p[n++] = 0xfe;
+      n += utf8_to_utf16(p + n, desc);
+      p[n++] = 0;
+      p[n++] = 0;
+    }
+    p[n++] = 0xff;
+    p[n++] = 0xfe;
+    n += utf8_to_utf16(p + n, value);
+  }
+
+  begin_frame(b, id, n);
+  b->len += n;
+  return 0;
+}
+
+/* Check whether a frame of an existing tag is replaced by one of the
+   new frames, which are found between START and END */
+static int frame_replaced(const unsigned char *start, const unsigned char *end,
+			  int version, const unsigned char *p,
+			  unsigned long size)
+{
+  const unsigned char *f;
+
+  /* only the TXXX frame with our description is replaced */
+  if (!memcmp(p, "TXXX", 4)
+      && (size < 6 || (p[10] != 0 && p[10] != 3) || memcmp(p + 11, "ASIN", 5)))
+    return 0;
+
+  for (f = start; f + 10 <= end; f += 10 + get_frame_size(f, version))
+    if (!memcmp(f, p, 4))
+      return 1;
+  return 0;
+}
+
+/* Copy the frames of an existing tag, other than those replaced by
+   the new frames (which end at NEW_LEN) */
+static int copy_old_frames(struct id3_buf *b, size_t new_len,
+			   const unsigned char *old, unsigned long old_len)
+{
+  unsigned long pos = 0, size;
+
+  while (pos + 10 <= old_len && old[pos]) {
+    size = get_frame_size(old + pos, b->version);
+    if (size > old_len - pos - 10)
+      break;
+
+    if (!frame_replaced(b->data + 10, b->data + new_len, b->version,
+			old + pos, size)) {
+      if (grow_buf(b, 10 + size))
+	return ENOMEM;
+      memcpy(b->data + b->len, old + pos, 10 + size);
+      b->len += 10 + size;
+    }
+    pos += 10 + size;
+  }
+
+  return 0;
+}
+
+/* Add a picture frame holding the front cover */
+static int add_picture_frame(struct id3_buf *b, const char *image,
+			     size_t len)
+{
+  const char *mime = "image/jpeg";
+  size_t n;
+
+  if (len >= 8 && !memcmp(image, "\x89PNG\r\n\x1a\n", 8))
+    mime = "image/png";
+
+  n = 1 + strlen(mime) + 1 + 2 + len;
+  if (begin_frame(b, "APIC", n))
+    return ENOMEM;
+
+  b->data[b->len++] = 0;
+  strcpy((char *) b->data + b->len, mime);
+  b->len += strlen(mime) + 1;
+  b->data[b->len++] = 3;	/* front cover */
+  b->data[b->len++] = 0;	/* no description */
+  memcpy(b->data + b->len, image, len);
+  b->len += len;
+  return 0;
+}
+
+/* Build the frames for a track */
+static int build_frames(struct id3_buf *b, const clamz_track *tr,
+			const char *image, size_t image_len)
+{
+  if (add_text_frame(b, "TIT2", NULL, tr->title)
+      || add_text_frame(b, "TPE1", NULL, tr->creator)
+      || add_text_frame(b, "TALB", NULL, tr->album)
+      || add_text_frame(b, "TPE2", NULL,
+			tr->meta.value[TMETA_ALBUM_ARTIST])
+      || add_text_frame(b, "TRCK", NULL, tr->trackNum)
+      || add_text_frame(b, "TPOS", NULL, tr->meta.value[TMETA_DISC_NUM])
+      || add_text_frame(b, "TCON", NULL, tr->meta.value[TMETA_GENRE])
+      || add_text_frame(b, "TXXX", "ASIN", tr->meta.value[TMETA_ASIN])
+      || (image && add_picture_frame(b, image, image_len)))
+    return ENOMEM;
+  return 0;
+}
+
+/* Write the whole of a buffer at the given position */
+static int write_all(int fd, const unsigned char *p, size_t len, off_t pos)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = pwrite(fd, p, len, pos);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return errno;
+    p += r;
+    pos += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Read the rest of a file from the given position, adding it to a
+   digest and (if OUTFD is not -1) copying it to another file */
+static int copy_rest(int fd, off_t pos, int outfd, off_t outpos,
+		     gcry_md_hd_t md)
+{
+  unsigned char *buf;
+  ssize_t r;
+  int err = 0;
+
+  buf = malloc(COPY_SIZE);
+  if (!buf)
+    return ENOMEM;
+
+  for (;;) {
+    r = pread(fd, buf, COPY_SIZE, pos);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0) {
+      err = errno;
+      break;
+    }
+    if (r == 0)
+      break;
+
+    gcry_md_write(md, buf, r);
+    if (outfd > -1 && (err = write_all(outfd, buf, r, outpos)))
+      break;
+    pos += r;
+    outpos += r;
+  }
+
+  free(buf);
+  return err;
+}
+
+/* Write the tag to a new copy of the file, and rename it into place */
+static int rewrite_file(int fd, const char *filename, const struct stat *st,
+			const struct id3_buf *b, off_t audio_pos,
+			gcry_md_hd_t md)
+{
+  char *tmpname;
+  int outfd, err;
+
+  tmpname = malloc(strlen(filename) + 5);
+  if (!tmpname)
+    return ENOMEM;
+  sprintf(tmpname, "%s.tmp", filename);
+
+  outfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+  if (outfd < 0) {
+    err = errno;
+    free(tmpname);
+    return err;
+  }
+
+  gcry_md_write(md, b->data, b->len);
+  err = write_all(outfd, b->data, b->len, 0);
+  if (!err)
+    err = copy_rest(fd, audio_pos, outfd, b->len, md);
+  if (!err && fdatasync(outfd))
+    err = errno;
+  if (close(outfd) && !err)
+    err = errno;
+  if (!err && rename(tmpname, filename))
+    err = errno;
+
+  if (err)
+    unlink(tmpname);
+  free(tmpname);
+  return err;
+}
+
+/* Write an ID3v2 tag for a track to the given file, with IMAGE (if
+   not NULL) as its front cover, and compute the SHA-256 digest of the
+   result.  Return 0 if successful, or an error number. */
+int write_track_tag(const clamz_track *tr, const char *filename,
+		    const char *image, size_t image_len,
+		    unsigned char *digest)
+{
+  struct id3_buf b = { NULL, 0, 0, 3 };
+  unsigned char hdr[10], *old = NULL;
+  unsigned long old_size = 0;
+  off_t audio_pos = 0;
+  struct stat st;
+  gcry_md_hd_t md;
+  size_t new_len;
+  ssize_t r;
+  int fd, err = 0, keep = 0;
+
+  fd = open(filename, O_RDWR);
+  if (fd < 0)
+    return errno;
+  if (fstat(fd, &st)) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+
+  r = pread(fd, hdr, 10, 0);
+  if (r == 10 && !memcmp(hdr, "ID3", 3) && hdr[3] >= 2 && hdr[3] <= 4
+      && !((hdr[6] | hdr[7] | hdr[8] | hdr[9]) & 0x80)) {
+    old_size = get_synchsafe(hdr + 6);
+    audio_pos = 10 + old_size + (hdr[3] == 4 && (hdr[5] & 0x10) ? 10 : 0);
+    if (audio_pos > st.st_size)
+      audio_pos = old_size = 0;
+    else {
+      /* frames are only kept from a tag that needs no decoding */
+      keep = ((hdr[3] == 3 || hdr[3] == 4) && !(hdr[5] & 0xc0));
+      b.version = (keep ? hdr[3] : 3);
+    }
+  }
+
+  if (keep) {
+    old = malloc(old_size ? old_size : 1);
+    if (!old)
+      err = ENOMEM;
+    else if ((r = pread(fd, old, old_size, 10)) != (ssize_t) old_size)
+      err = (r < 0 ? errno : EIO);
+  }
+
+  /* room for the tag header, filled in below */
+  if (!err)
+    err = grow_buf(&b, 10);
+  if (!err) {
+    b.len = 10;
+    err = build_frames(&b, tr, image, image_len);
+  }
+  new_len = b.len;
+  if (!err && keep)
+    err = copy_old_frames(&b, new_len, old, old_size);
+  free(old);
+
+  if (!err && gcry_md_open(&md, GCRY_MD_SHA256, 0))
+    err = ENOMEM;
+
+  if (!err) {
+    /* pad the tag out to fill the old one, or add fresh padding */
+    if (audio_pos >= (off_t) b.len)
+      new_len = audio_pos;
+    else
+      new_len = b.len + TAG_PADDING;
+    err = grow_buf(&b, new_len - b.len);
+    if (!err) {
+      memset(b.data + b.len, 0, new_len - b.len);
+      b.len = new_len;
+
+      memcpy(b.data, "ID3", 3);
+      b.data[3] = b.version;
+      b.data[4] = b.data[5] = 0;
+      put_synchsafe(b.data + 6, b.len - 10);
+
+      if (audio_pos == (off_t) b.len) {
+	err = write_all(fd, b.data, b.len, 0);
+	gcry_md_write(md, b.data, b.len);
+	if (!err)
+	  err = copy_rest(fd, audio_pos, -1, 0, md);
+      }
+      else
+	err = rewrite_file(fd, filename, &st, &b, audio_pos, md);
+    }
+
+    if (!err)
+      memcpy(digest, gcry_md_read(md, GCRY_MD_SHA256), 32);
+    gcry_md_close(md);
+  }
+
+  if (close(fd) && !err)
+    err = errno;
+  free(b.data);
+  return err;
+}
@@ -114,29 +114,29 @@ static char *get_file_var(const clamz_config *cfg, const clamz_track *tr,
     fallback = "00";
   }
   else if (!strcasecmp(var, "album_artist"))
-    s = find_meta(tr->meta, TMETA_ALBUM_ARTIST);
+    s = tr->meta.value[TMETA_ALBUM_ARTIST];
   else if (!strcasecmp(var, "genre"))
-    s = find_meta(tr->meta, TMETA_GENRE);
+    s = tr->meta.value[TMETA_GENRE];
   else if (!strcasecmp(var, "discnum")) {
-    s = find_meta(tr->meta, TMETA_DISC_NUM);
+    s = tr->meta.value[TMETA_DISC_NUM];
     fallback = "1";
   }
   else if (!strcasecmp(var, "suffix")) {
-    s = find_meta(tr->meta, TMETA_TRACK_TYPE);
+    s = tr->meta.value[TMETA_TRACK_TYPE];
     fallback = "mp3";
   }
   else if (!strcasecmp(var, "asin"))
-    s = find_meta(tr->meta, TMETA_ASIN);
+    s = tr->meta.value[TMETA_ASIN];
   else if (!strcasecmp(var, "album_asin"))
-    s = find_meta(tr->meta, TMETA_ALBUM_ASIN);
+    s = tr->meta.value[TMETA_ALBUM_ASIN];
   else if (!strcasecmp(var, "amz_title"))
     s = tr->playlist->title;
   else if (!strcasecmp(var, "amz_creator"))
     s = tr->playlist->creator;
   else if (!strcasecmp(var, "amz_asin"))
-    s = find_meta(tr->playlist->meta, PMETA_ASIN);
+    s = tr->playlist->meta.value[PMETA_ASIN];
   else if (!strcasecmp(var, "amz_genre"))
-    s = find_meta(tr->playlist->meta, PMETA_GENRE);
+    s = tr->playlist->meta.value[PMETA_GENRE];
   else {
     s = getenv(var);
     fallback = "";